@@ -0,0 +1,172 @@
+#include "rawdisk.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Compares the rawdisk backends on sequential and random block access, and
+// the asynchronous requests at increasing queue depths.
+// Usage: bench_disk [image file] [size in MiB] [random accesses]
+// The image is created (and removed afterwards) if it does not exist.
+
+// blocks per request for the multi-block tests
+#define RUN_BLOCKS 256
+
+typedef struct {
+  const char *name;
+  int backend;
+  int cache_blocks;
+} bench_config;
+
+static bench_config configs[] = {
+    {"syscall", DISK_SYSCALL, 0},
+    {"syscall+cache", DISK_SYSCALL, CACHE_NBLOCKS},
+    {"mmap", DISK_MMAP, 0},
+};
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *config, const char *test, int nblocks,
+                   double secs) {
+  printf("%-16s %-10s %9d blocks %8.3f s %9.1f MiB/s %8.0f ns/block\n", config,
+         test, nblocks, secs, nblocks * (double)BLOCK_SIZE / secs / 1048576,
+         secs * 1e9 / nblocks);
+}
+
+// buffers free for the next asynchronous read, and completions so far
+static int qd_free[IO_QUEUE_DEPTH];
+static int qd_nfree;
+static int qd_done;
+
+static void qdComplete(int blocknr, void *block, int result, void *arg) {
+  qd_done++;
+  qd_free[qd_nfree++] = (intptr_t)arg;
+}
+
+// drops the image from the page cache, so reads have to reach the device
+static void dropImage(const char *image) {
+  int fd = open(image, O_RDONLY);
+  if (fd >= 0) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+  }
+}
+
+// random reads keeping qd requests in flight, first with the synchronous
+// fallback, then with io_uring
+static void benchQueueDepth(char *image, int nblocks, int *order,
+                            int nrandom) {
+  char *bufs = malloc(IO_QUEUE_DEPTH * BLOCK_SIZE);
+  char name[32];
+  for (int async = 0; async <= 1; async++) {
+    setAsyncDisk(async);
+    setCacheSize(0);
+    if (openDiskWith(image, nblocks * BLOCK_SIZE, DISK_SYSCALL) < 0) {
+      perror("open disk failure");
+      break;
+    }
+    if (async && !asyncDisk()) {
+      printf("io_uring is not available, skipping\n");
+      closeDisk();
+      break;
+    }
+    for (int qd = 1; qd <= IO_QUEUE_DEPTH; qd *= 2) {
+      int issued = 0;
+      qd_done = 0;
+      qd_nfree = 0;
+      for (int i = 0; i < qd; i++)
+        qd_free[qd_nfree++] = i;
+      dropImage(image);
+      double t = now();
+      while (qd_done < nrandom) {
+        while (issued < nrandom && qd_nfree > 0) {
+          intptr_t b = qd_free[--qd_nfree];
+          submitReadBlock(order[issued++], bufs + b * BLOCK_SIZE, qdComplete,
+                          (void *)b);
+        }
+        submitBlocks();
+        reapBlocks(1);
+      }
+      snprintf(name, sizeof(name), "%s qd=%d", async ? "io_uring" : "sync",
+               qd);
+      report(name, "rand-read", nrandom, now() - t);
+    }
+    closeDisk();
+  }
+  setAsyncDisk(1);
+  free(bufs);
+}
+
+int main(int argc, char *argv[]) {
+  char *image = argc > 1 ? argv[1] : "BENCH_DISK";
+  int mib = argc > 2 ? atoi(argv[2]) : 64;
+  int nrandom = argc > 3 ? atoi(argv[3]) : 200000;
+  int nblocks = mib * (1048576 / BLOCK_SIZE);
+  int created = access(image, F_OK) != 0;
+  char block[BLOCK_SIZE];
+  int *order = malloc(nrandom * sizeof(int));
+  int run[RUN_BLOCKS];
+  char *runbuf = malloc(RUN_BLOCKS * BLOCK_SIZE);
+
+  srand(42);
+  for (int i = 0; i < nrandom; i++)
+    order[i] = rand() % nblocks;
+  memset(block, 0x5a, BLOCK_SIZE);
+
+  for (int c = 0; c < sizeof(configs) / sizeof(configs[0]); c++) {
+    bench_config *cfg = &configs[c];
+    setCacheSize(cfg->cache_blocks);
+    if (openDiskWith(image, nblocks * BLOCK_SIZE, cfg->backend) < 0) {
+      perror("open disk failure");
+      return -1;
+    }
+
+    double t = now();
+    for (int b = 0; b < nblocks; b++)
+      writeBlock(b, block);
+    syncDisk();
+    report(cfg->name, "seq-write", nblocks, now() - t);
+
+    t = now();
+    for (int b = 0; b < nblocks; b++)
+      readBlock(b, block);
+    report(cfg->name, "seq-read", nblocks, now() - t);
+
+    // same, 128 KiB per request
+    t = now();
+    for (int b = 0; b + RUN_BLOCKS <= nblocks; b += RUN_BLOCKS) {
+      for (int i = 0; i < RUN_BLOCKS; i++)
+        run[i] = b + i;
+      readBlocks(run, RUN_BLOCKS, runbuf);
+    }
+    report(cfg->name, "seq-readv", nblocks, now() - t);
+
+    t = now();
+    for (int i = 0; i < nrandom; i++)
+      readBlock(order[i], block);
+    report(cfg->name, "rand-read", nrandom, now() - t);
+
+    t = now();
+    for (int i = 0; i < nrandom; i++)
+      writeBlock(order[i], block);
+    syncDisk();
+    report(cfg->name, "rand-write", nrandom, now() - t);
+
+    closeDisk();
+  }
+
+  benchQueueDepth(image, nblocks, order, nrandom);
+
+  if (created)
+    unlink(image);
+  free(order);
+  free(runbuf);
+  return 0;
+}
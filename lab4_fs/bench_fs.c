@@ -0,0 +1,408 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Benchmarks a mounted file system: sequential and random reads and writes
+// at several request sizes, churn of small files (create, stat, unlink), a
+// large directory (listing it, looking up names that are and are not in
+// it) and several clients reading and writing at once. Each test reports
+// its throughput, operations per second and the p50/p99 latency of the
+// operations, as JSON on stdout. The progress goes to stderr.
+// Usage: bench_fs [mount point] [file size in MiB] [max clients]
+//
+// The random offsets come from fixed seeds, so every run does the same
+// operations. make bench runs it on a freshly formatted disk, with the
+// kernel's caching of entries and attributes turned off so the lookups and
+// stats reach ssfs. The file data is dropped from the page cache before it
+// is read back.
+
+// request sizes of the sequential and the random tests
+static const int seq_sizes[] = {4096, 65536, 1048576};
+static const int rand_sizes[] = {4096, 65536};
+// random requests per test, per client for the concurrent test
+#define RAND_OPS 2000
+// files of the small file churn, entries of the large directory (the
+// names fit in the 12 characters of an entry)
+#define CHURN_FILES 2000
+#define SMALL_FILE 1024
+#define DIR_ENTRIES 10000
+#define DIR_LISTINGS 10
+#define LOOKUPS 5000
+// size of the file of each client of the concurrent test
+#define CLIENT_MIB 4
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+static const char *mount_point = "mnt";
+static int first_result = 1;
+
+// the latencies of the operations of a test, in ns
+typedef struct {
+  uint64_t *ns;
+  long count;
+  long max;
+} samples;
+
+static uint64_t now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void die(const char *what, const char *path) {
+  fprintf(stderr, "%s %s: %s\n", what, path, strerror(errno));
+  exit(1);
+}
+
+static void add_sample(samples *s, uint64_t ns) {
+  if (s->count == s->max) {
+    s->max = s->max ? 2 * s->max : 1024;
+    s->ns = realloc(s->ns, s->max * sizeof(uint64_t));
+    if (!s->ns)
+      die("realloc", "samples");
+  }
+  s->ns[s->count++] = ns;
+}
+
+static int by_ns(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// returns the latency at fraction p of the sorted samples, in us
+static double percentile(const samples *s, double p) {
+  long i = p * s->count;
+  return s->count ? s->ns[i < s->count ? i : s->count - 1] / 1e3 : 0;
+}
+
+// prints the result of a test: the operations in s took ns in all and
+// moved bytes bytes. size is the bytes of each one, or the entries of the
+// directory for the large directory tests. Empties s.
+static void report(const char *test, long size, int clients, samples *s,
+                   uint64_t ns, uint64_t bytes) {
+  double secs = ns / 1e9;
+  qsort(s->ns, s->count, sizeof(uint64_t), by_ns);
+  printf("%s\n    {\"test\": \"%s\", \"size\": %ld, \"clients\": %d, "
+         "\"ops\": %ld, \"seconds\": %.6f, \"mib_per_s\": %.3f, "
+         "\"iops\": %.1f, \"p50_us\": %.3f, \"p99_us\": %.3f}",
+         first_result ? "" : ",", test, size, clients, s->count, secs,
+         bytes / secs / 1048576, s->count / secs, percentile(s, 0.5),
+         percentile(s, 0.99));
+  first_result = 0;
+  fprintf(stderr, "%-12s %8ld B %2d clients %8.1f MiB/s %10.1f ops/s "
+                  "p50 %9.3f us p99 %9.3f us\n",
+          test, size, clients, bytes / secs / 1048576, s->count / secs,
+          percentile(s, 0.5), percentile(s, 0.99));
+  s->count = 0;
+}
+
+static void path_of(char *path, const char *name) {
+  snprintf(path, 256, "%s/%s", mount_point, name);
+}
+
+// drops the cached pages of the file at path, so it is read from ssfs
+static void drop_cache(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    die("open", path);
+  if (fsync(fd) < 0)
+    die("fsync", path);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+// writes a file of mib MiB with requests of size bytes, then fsyncs it
+static void seq_write(const char *path, long mib, int size, char *buf) {
+  samples s = {0};
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    die("open", path);
+  uint64_t start = now();
+  for (long done = 0; done < mib << 20; done += size) {
+    uint64_t t = now();
+    if (write(fd, buf, size) != size)
+      die("write", path);
+    add_sample(&s, now() - t);
+  }
+  if (fsync(fd) < 0)
+    die("fsync", path);
+  report("seq_write", size, 1, &s, now() - start, mib << 20);
+  close(fd);
+  free(s.ns);
+}
+
+// reads the file at path with requests of size bytes, to the end
+static void seq_read(const char *path, int size, char *buf) {
+  samples s = {0};
+  uint64_t bytes = 0;
+  drop_cache(path);
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    die("open", path);
+  uint64_t start = now();
+  for (;;) {
+    uint64_t t = now();
+    ssize_t n = read(fd, buf, size);
+    if (n < 0)
+      die("read", path);
+    if (n == 0)
+      break;
+    add_sample(&s, now() - t);
+    bytes += n;
+  }
+  report("seq_read", size, 1, &s, now() - start, bytes);
+  close(fd);
+  free(s.ns);
+}
+
+// does ops reads or writes of size bytes at random offsets of fd, of a
+// file of file_size bytes, adding their latencies to s
+static void rand_io(int fd, const char *path, off_t file_size, int size,
+                    int write, int ops, unsigned int *seed, char *buf,
+                    samples *s) {
+  for (int i = 0; i < ops; i++) {
+    off_t off = (off_t)(rand_r(seed) % (file_size / size)) * size;
+    uint64_t t = now();
+    ssize_t n = write ? pwrite(fd, buf, size, off) : pread(fd, buf, size, off);
+    if (n != size)
+      die(write ? "write" : "read", path);
+    add_sample(s, now() - t);
+  }
+}
+
+static void rand_test(const char *path, long mib, int size, int write,
+                      char *buf) {
+  samples s = {0};
+  unsigned int seed = size + write;
+  drop_cache(path);
+  int fd = open(path, O_RDWR);
+  if (fd < 0)
+    die("open", path);
+  uint64_t start = now();
+  rand_io(fd, path, mib << 20, size, write, RAND_OPS, &seed, buf, &s);
+  if (write && fsync(fd) < 0)
+    die("fsync", path);
+  report(write ? "rand_write" : "rand_read", size, 1, &s, now() - start,
+         (uint64_t)RAND_OPS * size);
+  close(fd);
+  free(s.ns);
+}
+
+// creates CHURN_FILES small files in a directory, stats them, and removes
+// them, each step a test of its own
+static void churn(char *buf) {
+  samples s = {0};
+  char dir[256], path[512];
+  path_of(dir, "churn");
+  if (mkdir(dir, 0755) < 0)
+    die("mkdir", dir);
+  uint64_t start = now();
+  for (int i = 0; i < CHURN_FILES; i++) {
+    snprintf(path, sizeof(path), "%s/f%d", dir, i);
+    uint64_t t = now();
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0 || write(fd, buf, SMALL_FILE) != SMALL_FILE || close(fd) < 0)
+      die("create", path);
+    add_sample(&s, now() - t);
+  }
+  report("create", SMALL_FILE, 1, &s, now() - start,
+         (uint64_t)CHURN_FILES * SMALL_FILE);
+  start = now();
+  for (int i = 0; i < CHURN_FILES; i++) {
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/f%d", dir, i);
+    uint64_t t = now();
+    if (stat(path, &st) < 0 || st.st_size != SMALL_FILE)
+      die("stat", path);
+    add_sample(&s, now() - t);
+  }
+  report("stat", 0, 1, &s, now() - start, 0);
+  start = now();
+  for (int i = 0; i < CHURN_FILES; i++) {
+    snprintf(path, sizeof(path), "%s/f%d", dir, i);
+    uint64_t t = now();
+    if (unlink(path) < 0)
+      die("unlink", path);
+    add_sample(&s, now() - t);
+  }
+  report("unlink", 0, 1, &s, now() - start, 0);
+  rmdir(dir);
+  free(s.ns);
+}
+
+// fills a directory with DIR_ENTRIES empty files, then lists it, and looks
+// up names in it at random, ones that are there and ones that are not
+static void large_dir() {
+  samples s = {0};
+  char dir[256], path[512];
+  unsigned int seed = 1;
+  path_of(dir, "large");
+  if (mkdir(dir, 0755) < 0)
+    die("mkdir", dir);
+  for (int i = 0; i < DIR_ENTRIES; i++) {
+    snprintf(path, sizeof(path), "%s/e%d", dir, i);
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0)
+      die("create", path);
+    close(fd);
+  }
+
+  // one sample per listing, its size is the entries listed
+  uint64_t start = now();
+  for (int l = 0; l < DIR_LISTINGS; l++) {
+    uint64_t t = now();
+    DIR *d = opendir(dir);
+    if (!d)
+      die("opendir", dir);
+    int n = 0;
+    while (readdir(d))
+      n++;
+    closedir(d);
+    if (n != DIR_ENTRIES + 2) {
+      errno = EIO;
+      die("readdir", dir);
+    }
+    add_sample(&s, now() - t);
+  }
+  report("readdir", DIR_ENTRIES, 1, &s, now() - start, 0);
+
+  for (int hit = 1; hit >= 0; hit--) {
+    start = now();
+    for (int i = 0; i < LOOKUPS; i++) {
+      struct stat st;
+      snprintf(path, sizeof(path), "%s/%c%d", dir, hit ? 'e' : 'm',
+               rand_r(&seed) % DIR_ENTRIES);
+      uint64_t t = now();
+      if ((stat(path, &st) == 0) != hit)
+        die("stat", path);
+      add_sample(&s, now() - t);
+    }
+    report(hit ? "lookup_hit" : "lookup_miss", DIR_ENTRIES, 1, &s,
+           now() - start, 0);
+  }
+
+  for (int i = 0; i < DIR_ENTRIES; i++) {
+    snprintf(path, sizeof(path), "%s/e%d", dir, i);
+    unlink(path);
+  }
+  rmdir(dir);
+  free(s.ns);
+}
+
+// a client of the concurrent test, reading and writing 4 KiB at random in
+// a file of its own
+typedef struct {
+  int id;
+  samples s;
+} client;
+
+static void *run_client(void *arg) {
+  client *c = arg;
+  char path[256], name[16], buf[4096];
+  unsigned int seed = c->id + 1;
+  snprintf(name, sizeof(name), "c%d", c->id);
+  path_of(path, name);
+  memset(buf, 'a' + c->id % 26, sizeof(buf));
+  int fd = open(path, O_RDWR);
+  if (fd < 0)
+    die("open", path);
+  for (int i = 0; i < RAND_OPS; i++)
+    rand_io(fd, path, CLIENT_MIB << 20, sizeof(buf), rand_r(&seed) % 2, 1,
+            &seed, buf, &c->s);
+  close(fd);
+  return NULL;
+}
+
+// runs 1, 2, 4... up to max_clients clients at the same time
+static void concurrent(int max_clients) {
+  char path[256], name[16];
+  char *buf = calloc(1, 1 << 20);
+  client *clients = calloc(max_clients, sizeof(client));
+  pthread_t *threads = malloc(max_clients * sizeof(pthread_t));
+  for (int i = 0; i < max_clients; i++) {
+    snprintf(name, sizeof(name), "c%d", i);
+    path_of(path, name);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    for (int m = 0; fd >= 0 && m < CLIENT_MIB; m++)
+      if (write(fd, buf, 1 << 20) != 1 << 20)
+        die("write", path);
+    if (fd < 0 || fsync(fd) < 0)
+      die("create", path);
+    close(fd);
+    drop_cache(path);
+  }
+
+  samples all = {0};
+  for (int n = 1;; n = min(2 * n, max_clients)) {
+    uint64_t start = now();
+    for (int i = 0; i < n; i++) {
+      clients[i].id = i;
+      pthread_create(&threads[i], NULL, run_client, &clients[i]);
+    }
+    for (int i = 0; i < n; i++) {
+      pthread_join(threads[i], NULL);
+      for (long j = 0; j < clients[i].s.count; j++)
+        add_sample(&all, clients[i].s.ns[j]);
+      clients[i].s.count = 0;
+    }
+    report("concurrent", 4096, n, &all, now() - start,
+           (uint64_t)n * RAND_OPS * 4096);
+    if (n == max_clients)
+      break;
+  }
+
+  for (int i = 0; i < max_clients; i++) {
+    snprintf(name, sizeof(name), "c%d", i);
+    path_of(path, name);
+    unlink(path);
+    free(clients[i].s.ns);
+  }
+  free(all.ns);
+  free(threads);
+  free(clients);
+  free(buf);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc > 1)
+    mount_point = argv[1];
+  long mib = argc > 2 ? atol(argv[2]) : 64;
+  int max_clients = argc > 3 ? atoi(argv[3]) : 8;
+  if (mib < 2 || max_clients < 1) {
+    printf("usage: %s [mount point] [file size in MiB] [max clients]\n",
+           argv[0]);
+    return 1;
+  }
+  char *buf = malloc(1 << 20);
+  memset(buf, 'x', 1 << 20);
+  char path[256];
+  path_of(path, "seq");
+
+  printf("{\n  \"mount_point\": \"%s\",\n  \"file_mib\": %ld,\n"
+         "  \"results\": [",
+         mount_point, mib);
+  for (int i = 0; i < sizeof(seq_sizes) / sizeof(seq_sizes[0]); i++) {
+    seq_write(path, mib, seq_sizes[i], buf);
+    seq_read(path, seq_sizes[i], buf);
+  }
+  for (int i = 0; i < sizeof(rand_sizes) / sizeof(rand_sizes[0]); i++) {
+    rand_test(path, mib, rand_sizes[i], 0, buf);
+    rand_test(path, mib, rand_sizes[i], 1, buf);
+  }
+  unlink(path);
+  churn(buf);
+  large_dir();
+  concurrent(max_clients);
+  printf("\n  ]\n}\n");
+  free(buf);
+  return 0;
+}
@@ -1,38 +1,175 @@
 #include "fs_support.h"
+#include "journal.h"
 #include "rawdisk.h"
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+// Usage: format_myfs [size]
+// The size is in blocks, or in bytes with a K, M or G suffix (e.g. 4G).
+// Defaults to FS_NBLOCKS blocks.
+
+// parses the size argument, returns the number of blocks or 0 if invalid
+static block_id parse_size(const char *arg) {
+  char *end;
+  unsigned long long n = strtoull(arg, &end, 10);
+  unsigned long long unit = 0;
+  switch (*end) {
+  case 0:
+    return n <= INT_MAX ? n : 0; // already in blocks
+  case 'k':
+  case 'K':
+    unit = 1ULL << 10;
+    break;
+  case 'm':
+  case 'M':
+    unit = 1ULL << 20;
+    break;
+  case 'g':
+  case 'G':
+    unit = 1ULL << 30;
+    break;
+  default:
+    return 0;
+  }
+  n = n * unit / BLOCK_SIZE;
+  // the disk numbers its blocks with ints
+  return n <= INT_MAX ? n : 0;
+}
 
 int main(int argc, char *argv[]) {
-  if (openDisk(DISK_FILE, BLOCK_SIZE * FS_NBLOCKS) < 0) {
+  block_id nblocks = argc > 1 ? parse_size(argv[1]) : FS_NBLOCKS;
+  fs_block blk;
+
+  // superblock, group free counts, bitmap, journal, inode table and root
+  // directory, and at least one data block
+  uint32_t bitmap_blocks = (nblocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+  uint32_t groups_blocks =
+      (bitmap_blocks + GROUPS_PER_BLOCK - 1) / GROUPS_PER_BLOCK;
+  uint32_t journal_blocks =
+      min(JOURNAL_MAX_BLOCKS, nblocks / 32 > JOURNAL_MIN_BLOCKS
+                                  ? nblocks / 32
+                                  : JOURNAL_MIN_BLOCKS);
+  // fs_flush commits once a transaction holds half of what fits, so the
+  // operation after must fit in the other half. Then come the descriptors,
+  // the commit record and the header (see journal_max_tx).
+  uint32_t max_tx = 2 * (bitmap_blocks + groups_blocks + JOURNAL_OP_BLOCKS);
+  uint32_t need = max_tx + (max_tx + JOURNAL_TAGS - 1) / JOURNAL_TAGS + 2;
+  if (journal_blocks < need)
+    journal_blocks = need;
+  if (nblocks < groups_blocks + bitmap_blocks + journal_blocks + 4) {
+    fprintf(stderr, "invalid size %s\n", argc > 1 ? argv[1] : "");
+    return -1;
+  }
+  if (openDisk(DISK_FILE, (off_t)BLOCK_SIZE * nblocks) < 0) {
     perror("open disk failure");
     return -1;
   }
 
-  // first update the block map
-  fs_block blk;
-  // no need to read the block!
-  // readBlock(BLKMAP_BID, blk.blockmap);
-  // make sure all blocks are part of the free list, except block 1
-  // which will have the directory entry
-  blk.blockmap[0] = 2;
-
-  for (unsigned short bid = 2; bid < FS_NBLOCKS; bid++) {
-    blk.blockmap[bid] = bid + 1;
-    printf("%u:%u ", bid, blk.blockmap[bid]);
-  }
-  blk.blockmap[FS_NBLOCKS - 1] = 0;
-  if (writeBlock(BLKMAP_BID, blk.blockmap) < 0) {
+  // first the superblock, describing where everything else is
+  superblock super;
+  memset(&super, 0, sizeof(super));
+  super.magic = FS_MAGIC;
+  super.version = FS_VERSION;
+  super.block_size = BLOCK_SIZE;
+  super.nblocks = nblocks;
+  super.groups_start = SUPER_BID + 1;
+  super.groups_blocks = groups_blocks;
+  super.bitmap_start = super.groups_start + groups_blocks;
+  super.bitmap_blocks = bitmap_blocks;
+  super.journal_start = super.bitmap_start + bitmap_blocks;
+  super.journal_blocks = journal_blocks;
+  // the inode table starts with one block right after the journal, then
+  // the root directory has one block
+  block_id itable = super.journal_start + journal_blocks;
+  block_id rootdir = itable + 1;
+  super.itable.mode = S_IFREG | 0600;
+  super.itable.size_bytes = BLOCK_SIZE;
+  super.itable.nextents = 1;
+  super.itable.extents[0].start = itable;
+  super.itable.extents[0].length = 1;
+  super.itable.ext_block = EOF_BLOCK;
+  super.itable.atime = super.itable.mtime = super.itable.ctime = time(0);
+  // inode 0 is the table itself and inode 1 the root, the others are free
+  super.ninodes = INODES_PER_BLOCK;
+  super.free_inodes = INODES_PER_BLOCK - 2;
+  super.free_inode = ROOT_INO + 1;
+  // all blocks are free, except the metadata and the root directory
+  block_id used = rootdir + 1;
+  super.free_blocks = nblocks - used;
+
+  memset(blk.bytes, 0, BLOCK_SIZE);
+  blk.super = super;
+  if (writeBlock(SUPER_BID, blk.bytes) < 0) {
     // some error occured
-    perror("cannot write BLKMAP");
+    perror("cannot write the superblock");
     return -1;
   }
 
-  // also write 0 in the block 1, which means empty Directory
+  // then the bitmap and the free blocks of each group. The bits past the
+  // last block are set, so they are never handed out.
+  fs_block counts;
+  memset(counts.bytes, 0, BLOCK_SIZE);
+  for (uint32_t g = 0; g < bitmap_blocks; g++) {
+    block_id first = g * BITS_PER_BLOCK;
+    memset(blk.bitmap, 0, BLOCK_SIZE);
+    counts.counts[g % GROUPS_PER_BLOCK] = 0;
+    for (block_id b = 0; b < BITS_PER_BLOCK; b++) {
+      if (first + b < used || first + b >= nblocks)
+        blk.bitmap[b / 8] |= 1 << (b % 8);
+      else
+        counts.counts[g % GROUPS_PER_BLOCK]++;
+    }
+    if (writeBlock(super.bitmap_start + g, blk.bitmap) < 0) {
+      perror("cannot write the bitmap");
+      return -1;
+    }
+    if ((g + 1) % GROUPS_PER_BLOCK == 0 || g + 1 == bitmap_blocks) {
+      if (writeBlock(super.groups_start + g / GROUPS_PER_BLOCK,
+                     counts.bytes) < 0) {
+        perror("cannot write the group free counts");
+        return -1;
+      }
+      memset(counts.bytes, 0, BLOCK_SIZE);
+    }
+  }
+  if (journal_format(super.journal_start, journal_blocks) < 0) {
+    perror("cannot write the journal");
+    return -1;
+  }
+  printf("%u blocks: superblock %u, group counts %u+%u, bitmap %u+%u, "
+         "journal %u+%u, inode table %u, root directory %u\n",
+         super.nblocks, SUPER_BID, super.groups_start, super.groups_blocks,
+         super.bitmap_start, super.bitmap_blocks, super.journal_start,
+         super.journal_blocks, itable, rootdir);
+
+  // the inode table, with the root and the chain of free inodes
+  memset(blk.bytes, 0, BLOCK_SIZE);
+  inode *root = &blk.inodes[ROOT_INO];
+  root->mode = S_IFDIR | 0755;
+  root->size_bytes = BLOCK_SIZE;
+  root->nextents = 1;
+  root->extents[0].start = rootdir;
+  root->extents[0].length = 1;
+  root->ext_block = EOF_BLOCK;
+  root->atime = root->mtime = root->ctime = time(0);
+  for (inode_id i = ROOT_INO + 1; i < INODES_PER_BLOCK; i++)
+    blk.inodes[i].next_free = i + 1 < INODES_PER_BLOCK ? i + 1 : 0;
+  if (writeBlock(itable, blk.bytes) < 0) {
+    perror("cannot write the inode table");
+    return -1;
+  }
+
+  // also write 0 in the root directory block, which means empty Directory
   bzero(blk.bytes, BLOCK_SIZE);
-  writeBlock(ROOTDIR_BID, blk.bytes);
+  writeBlock(rootdir, blk.bytes);
 
   // finish This
-  closeDisk();
+  if (closeDisk() < 0) {
+    perror("cannot write the disk");
+    return -1;
+  }
   // should also write 0 in all other blocks to make it secure
 }
@@ -1,107 +1,1933 @@
 #include "fs_support.h"
+#include "journal.h"
 #include "rawdisk.h"
+#include <endian.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
-// caches for the directory and block map
-// FIXME: could be converted to a table or another structure holding more blocks
-// but for now we're using one block for directory, one for the block map
-fs_block bdir;
-fs_block bmap;
-
-// returns a block to the free blocks list. assumes that blocks[0] points to
-// the first free block. For simplicity, you can add blocks to the head of the
-// list. Note that the blocks structure must be written back to the disk.
-// This function returns the id of the old block pointed by the freed block
-// (which might point to the next block in a chain).
-unsigned short freeBlock(unsigned short *blocks, unsigned short freedId) {
-  unsigned short bid = blocks[freedId];
-  blocks[freedId] = blocks[0];
-  blocks[0] = freedId;
-  // FIXME: For security reasons, one might want to clear the freedId block on
-  // the disk (write 0s in it). You could do this here.
-  return bid;
-}
-
-// allocates a Block from the free list, if there are any. Returns either the
-// newly allocated block id, or -1 if there are none.
-unsigned short allocateBlock(unsigned short *blocks) {
-  unsigned short bid = blocks[0];
-  if (bid == 0) { // points back to itself, no more blocks
-    printf("allocateBlock: block 0 points to self! no free blocks\n");
+// the superblock, holding the inode of the inode table
+superblock sb;
+
+// once mounted, sb, the inodes, the directories and the metadata regions
+// are the authoritative copies. Changes only mark them dirty, and they are
+// written back by fs_flush (or when due).
+static int mounted = 0;
+static int sb_dirty = 0;
+static time_t last_flush = 0;
+// the blocks the inodes, directories, delayed files and freed runs changed
+// since the last flush will add to its transaction, at most
+static unsigned int tx_blocks = 0;
+
+// The file system is used by several threads at once. The locks, always
+// taken in this order:
+// - fs_lock, for the directories, the inode table and the superblock. It
+//   is recursive, so the helpers can take it again.
+// - the lock of an inode, for its contents, extents and data. Directories
+//   are only changed with fs_lock held as well.
+// - freeing_lock, held by a flush from taking the freed blocks until they
+//   are free, so reclaim_blocks can wait for it.
+// - alloc_lock, for the bitmap, the group free counts, the free block
+//   count and the reserved blocks.
+// - icache_lock, for the hash table of the inodes in memory.
+static pthread_mutex_t fs_lock;
+static pthread_mutex_t freeing_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t icache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// a region of metadata blocks (the bitmap, the group free counts). Its
+// blocks are read when first needed, so mounting does not read all the
+// metadata of a large disk.
+typedef struct {
+  block_id start;
+  uint32_t nblocks;
+  struct {
+    fs_block *blk; // NULL until loaded
+    int dirty;
+  } * blocks;
+  uint32_t *dirty; // the dirty blocks, so a flush does not look at all
+  uint32_t ndirty;
+} meta_region;
+static meta_region bitmap;
+static meta_region groups;
+// where the last allocation ended, the next one starts looking from there
+static block_id alloc_cursor;
+// free blocks set aside for the delayed blocks of the files, which other
+// allocations leave alone so the delayed ones always find room
+static uint32_t reserved;
+// the runs freed since the last commit. They are only marked free once the
+// transaction freeing them is committed, so no other file gets them (and
+// writes to them) while a crash could still bring back the old owner.
+static extent *freeing;
+static unsigned int nfreeing, maxfreeing;
+// the blocks of those runs, and of the ones being committed
+static uint32_t freeing_blocks;
+// blocks allocated and freed since the mount, for get_fs_stats
+static unsigned long blocks_allocated, blocks_freed;
+
+// the extents of each file, with the logical block each one starts at, so
+// the block at some offset is found with a binary search. Built on first
+// use and kept up to date by file_resize. The lengths are kept without
+// EXTENT_UNWRITTEN, which goes in unwritten.
+typedef struct {
+  extent ext[FILE_MAX_EXTENTS];
+  unsigned int lstart[FILE_MAX_EXTENTS + 1]; // lstart[nextents] == nblocks
+  unsigned char unwritten[FILE_MAX_EXTENTS];
+  unsigned int nextents;
+  unsigned int nblocks;
+  unsigned int last; // extent of the last lookup, where sequential access is
+} file_index;
+
+// a directory read in memory, with a hash index from names to its slots.
+// Directories are files of dir_entry blocks. Once loaded they stay in
+// memory, so walking a path does not read or scan the directories again.
+typedef struct {
+  fs_block *blocks;      // the blocks of the directory
+  unsigned int nslots;   // DIR_ENTRIES_PER_BLOCK per block
+  unsigned int nused;    // slots holding an entry
+  unsigned int hint;     // there is no empty slot below this one
+  int *next;             // hash chains, by slot, -1 ends a chain
+  int *heads;            // first slot of each bucket
+  unsigned int nbuckets; // power of 2
+  unsigned char *dirty;  // the changed blocks
+  int is_dirty;
+} dir_node;
+
+// an inode in memory. Inodes are read from the inode table when first
+// used, and stay in memory until the file system is unmounted. Where the
+// entry of an inode is gets noted when it is found in its directory, so it
+// can be renamed or removed without looking for it again.
+typedef struct incore_t {
+  inode in;               // the inode itself
+  inode_id ino;           // its number
+  inode_id dir;           // the directory holding its entry, 0 for the root
+  unsigned int slot;      // where the entry is in that directory
+  int opens;              // open handles to the file
+  unsigned long lookups;  // references the kernel holds, from lookups
+  int unlinked;           // the entry is gone, freed on the last release
+  int dirty;              // changed since it was written to the table
+  pthread_rwlock_t lock;  // readers and writers of the file
+  file_index *fx;         // NULL until built
+  char *delayed;          // the delayed blocks at the end of the file
+  unsigned int ndelayed;  // how many there are
+  unsigned int maxdelay;  // how many fit in delayed
+  int ext_reserved;       // a free block is set aside for its extent block
+  dir_node *node;         // the loaded directory, if the inode is one
+  struct incore_t *hnext; // next inode in the same hash bucket
+} incore;
+static incore **icache;           // hash table of the inodes, by number
+static unsigned int icache_size;  // power of 2
+static incore **incores;          // all the inodes in memory
+static unsigned int nincores, maxincores;
+
+static incore *ifind(inode_id ino);
+
+// sets up region r, of nblocks blocks from start, with nothing loaded yet
+static int region_open(meta_region *r, block_id start, uint32_t nblocks) {
+  r->start = start;
+  r->nblocks = nblocks;
+  r->blocks = calloc(nblocks, sizeof(*r->blocks));
+  r->dirty = malloc(nblocks * sizeof(uint32_t));
+  r->ndirty = 0;
+  return r->blocks && r->dirty ? 0 : -1;
+}
+
+// returns block i of region r, reading it if needed, or NULL if it cannot
+// be read. Marks it dirty if it is going to be changed.
+static fs_block *region_block(meta_region *r, uint32_t i, int dirty) {
+  if (!r->blocks[i].blk) {
+    fs_block *blk = malloc(sizeof(fs_block));
+    if (!blk || readBlock(r->start + i, blk->bytes) < 0) {
+      free(blk);
+      return NULL;
+    }
+    r->blocks[i].blk = blk;
+  }
+  if (dirty && !r->blocks[i].dirty) {
+    r->blocks[i].dirty = 1;
+    r->dirty[r->ndirty++] = i;
+  }
+  return r->blocks[i].blk;
+}
+
+// writes back the dirty blocks of region r, returns how many there were
+static int region_flush(meta_region *r) {
+  int n = 0;
+  while (r->ndirty > 0) {
+    uint32_t i = r->dirty[r->ndirty - 1];
+    if (journal_write(r->start + i, r->blocks[i].blk->bytes) < 0)
+      return -1;
+    r->blocks[i].dirty = 0;
+    r->ndirty--;
+    n++;
+  }
+  return n;
+}
+
+// lets go of the blocks of region r
+static void region_close(meta_region *r) {
+  if (r->blocks)
+    for (uint32_t i = 0; i < r->nblocks; i++)
+      free(r->blocks[i].blk);
+  free(r->blocks);
+  free(r->dirty);
+  r->blocks = NULL;
+  r->dirty = NULL;
+}
+
+// returns the number of free blocks of group g (the blocks of one bitmap
+// block), or a pointer to it to change it. NULL if it cannot be read.
+static uint32_t *group_free(uint32_t g, int dirty) {
+  fs_block *blk = region_block(&groups, g / GROUPS_PER_BLOCK, dirty);
+  return blk ? &blk->counts[g % GROUPS_PER_BLOCK] : NULL;
+}
+
+// returns the bitmap words of the group of block bid, NULL if unreadable
+static uint64_t *bitmap_words(block_id bid, int dirty) {
+  fs_block *blk = region_block(&bitmap, bid / BITS_PER_BLOCK, dirty);
+  return blk ? blk->words : NULL;
+}
+
+// returns 1 if block bid is in use (or does not exist), 0 if it is free.
+// alloc_lock must be held.
+static int in_use(block_id bid) {
+  if (bid >= sb.nblocks)
+    return 1;
+  uint64_t *words = bitmap_words(bid, 0);
+  if (!words) // cannot tell, better not hand it out
+    return 1;
+  bid %= BITS_PER_BLOCK;
+  return (le64toh(words[bid / 64]) >> (bid % 64)) & 1;
+}
+
+int block_in_use(block_id bid) {
+  pthread_mutex_lock(&alloc_lock);
+  int used = in_use(bid);
+  pthread_mutex_unlock(&alloc_lock);
+  return used;
+}
+
+// marks blocks start..start+length-1 as used or free, a word at a time, and
+// keeps the free counts of their groups and of the file system up to date.
+// The blocks must all be free (or all used) before.
+static void mark_run(block_id start, uint32_t length, int used) {
+  block_id bid = start, end = start + length;
+  while (bid < end) {
+    uint64_t *words = bitmap_words(bid, 1);
+    uint32_t *count = group_free(bid / BITS_PER_BLOCK, 1);
+    block_id gend = min(end, (bid / BITS_PER_BLOCK + 1) * BITS_PER_BLOCK);
+    if (!words || !count) {
+      bid = gend;
+      continue;
+    }
+    if (used) {
+      *count -= gend - bid;
+      sb.free_blocks -= gend - bid;
+    } else {
+      *count += gend - bid;
+      sb.free_blocks += gend - bid;
+    }
+    while (bid < gend) {
+      unsigned int b = bid % 64, n = min(64 - b, gend - bid);
+      uint64_t mask = (n == 64 ? ~0ULL : ((1ULL << n) - 1)) << b;
+      uint64_t *w = &words[bid % BITS_PER_BLOCK / 64];
+      *w = htole64(used ? le64toh(*w) | mask : le64toh(*w) & ~mask);
+      bid += n;
+    }
+  }
+}
+
+// returns the first free block in bid..to-1, or to if there is none. Groups
+// with no free blocks are skipped without reading their bitmap, the others
+// are scanned a 64 bit word at a time.
+static block_id next_free(block_id bid, block_id to) {
+  while (bid < to) {
+    uint32_t g = bid / BITS_PER_BLOCK;
+    block_id gend = min(to, (g + 1) * BITS_PER_BLOCK);
+    uint32_t *count = group_free(g, 0);
+    uint64_t *words = count && *count ? bitmap_words(bid, 0) : NULL;
+    if (!words) {
+      bid = gend;
+      continue;
+    }
+    unsigned int b = bid % BITS_PER_BLOCK, w = b / 64;
+    // set the bits below bid, so they do not count as free
+    uint64_t used = le64toh(words[w]) | ((1ULL << (b % 64)) - 1);
+    while (!~used && g * BITS_PER_BLOCK + (w + 1) * 64 < gend)
+      used = le64toh(words[++w]);
+    if (~used) {
+      bid = g * BITS_PER_BLOCK + w * 64 + __builtin_ctzll(~used);
+      if (bid < gend)
+        return bid;
+    }
+    bid = gend;
+  }
+  return to;
+}
+
+// returns the number of free blocks from bid on, counting at most max.
+// Whole free groups are counted from their free count.
+static uint32_t free_length(block_id bid, uint32_t max) {
+  block_id start = bid;
+  uint32_t length = 0;
+  while (length < max && bid < sb.nblocks) {
+    uint32_t g = bid / BITS_PER_BLOCK;
+    uint32_t *count = group_free(g, 0);
+    if (count && *count == BITS_PER_BLOCK) {
+      length += (g + 1) * BITS_PER_BLOCK - bid;
+      bid = (g + 1) * BITS_PER_BLOCK;
+      continue;
+    }
+    uint64_t *words = count ? bitmap_words(bid, 0) : NULL;
+    if (!words)
+      break;
+    unsigned int b = bid % BITS_PER_BLOCK;
+    uint64_t used = le64toh(words[b / 64]) >> (b % 64);
+    // free bits up to the first used one, or to the end of the word
+    uint32_t n = used ? __builtin_ctzll(used) : 64 - b % 64;
+    length += n;
+    bid += n;
+    if (used)
+      break;
+  }
+  return min(min(length, max), sb.nblocks - start);
+}
+
+// looks for a run of want free blocks starting in from..to-1. Returns the
+// first one, or EOF_BLOCK and the longest run seen in *longest, *longlen.
+static block_id find_run(block_id from, block_id to, uint32_t want,
+                         block_id *longest, uint32_t *longlen) {
+  for (block_id bid = next_free(from, to); bid < to;) {
+    uint32_t length = free_length(bid, want);
+    if (length == want)
+      return bid;
+    if (length > *longlen) {
+      *longest = bid;
+      *longlen = length;
+    }
+    bid = next_free(bid + length, to);
+  }
+  return EOF_BLOCK;
+}
+
+// allocates up to want consecutive blocks. Prefers the blocks starting at
+// goal, so a file can extend its last extent. Otherwise takes the next run
+// with at least want blocks after the previous allocation (next fit), then
+// the longest run. Returns the first block and puts the number of blocks in
+// *got, or returns EOF_BLOCK if there are no free blocks. The reserved
+// blocks are not handed out. alloc_lock must be held.
+static block_id alloc(block_id goal, uint32_t want, uint32_t *got) {
+  block_id start = EOF_BLOCK, longest = EOF_BLOCK;
+  uint32_t longlen = 0;
+  *got = 0;
+  if (want == 0)
     return EOF_BLOCK;
-  } else {                   // return the head of the list
-    blocks[0] = blocks[bid]; // the list starts with the next free block
-    blocks[bid] = EOF_BLOCK; // allocated block points nowere
-    return bid;
-  }
-}
-
-// loads the block map from the disk
-unsigned short *load_blockmap() {
-  readBlock(BLKMAP_BID, bmap.blockmap);
-  return bmap.blockmap;
-}
-
-// allocates a new block using the loaded map. returns the id of the block
-unsigned short alloc_block() { return allocateBlock(bmap.blockmap); }
-
-// frees the given block in the loaded map. returns the block id the freed
-// block points to
-unsigned short free_block(unsigned short bid) {
-  return freeBlock(bmap.blockmap, bid);
-}
-
-// saves the block map back on the disk
-void save_blockmap() { writeBlock(BLKMAP_BID, bmap.blockmap); }
-
-// loads the directory data structure from the disk
-int load_directory() {
-  // is a flat structure - one block directory at ROOTDIR_BID
-  return readBlock(ROOTDIR_BID, bdir.bytes);
-}
-
-// this function finds the directory block containing the entry for the given
-// file (path). The return values are as follows:
-// if >0 the return value is the index in the directory entry while bdir
-// and bdir_id (global vars) ``refer to the block containing the entry
-// if -1 the entry could not be found
-// FIXME: this assumes a flat structure now, where all files are in the root
-// directory. For a more generic FS, it should allow subdirectories. To handle
-// this, one would need to identify dirs top-down and read the right blocks
-// from the disk. Useful functions: strsep, strdup, strcmp
-int find_dir_entry(const char *path) {
-  // now find the file
-  unsigned short di = 0;
-  // while not all entries inspected
-  // and entry not empty
-  // and entry not the one we are looking for
-  while (di < DIR_ENTRIES_PER_BLOCK &&
-         !dir_entry_is_empty(bdir.directory[di]) &&
-         strncmp(path, bdir.directory[di].name, FS_NAME_LEN))
-    di++;
-  if (di == DIR_ENTRIES_PER_BLOCK || dir_entry_is_empty(bdir.directory[di]))
-    return -1;
+  if (sb.free_blocks <= reserved) { // the bitmap is full, no more blocks
+    printf("alloc_run: no free blocks\n");
+    return EOF_BLOCK;
+  }
+  want = min(want, sb.free_blocks - reserved);
+  if (goal != EOF_BLOCK && !in_use(goal)) {
+    start = goal;
+    *got = free_length(goal, want);
+  } else {
+    start = find_run(alloc_cursor, sb.nblocks, want, &longest, &longlen);
+    if (start == EOF_BLOCK)
+      start = find_run(0, alloc_cursor, want, &longest, &longlen);
+    *got = want;
+    if (start == EOF_BLOCK) {
+      start = longest;
+      *got = longlen;
+    }
+  }
+  if (start == EOF_BLOCK) { // the free blocks could not be read
+    printf("alloc_run: no free blocks\n");
+    *got = 0;
+    return EOF_BLOCK;
+  }
+  mark_run(start, *got, 1);
+  alloc_cursor = start + *got;
+  blocks_allocated += *got;
+  return start;
+}
+
+// allocates up to want consecutive blocks, see alloc
+block_id alloc_run(block_id goal, uint32_t want, uint32_t *got) {
+  pthread_mutex_lock(&alloc_lock);
+  block_id start = alloc(goal, want, got);
+  pthread_mutex_unlock(&alloc_lock);
+  return start;
+}
+
+// gives blocks start..start+length-1, from alloc_run, back at once. They
+// must not have been used yet: no commit has them, so they need not wait
+// for one as free_run makes them.
+static void unalloc_run(block_id start, uint32_t length) {
+  pthread_mutex_lock(&alloc_lock);
+  mark_run(start, length, 0);
+  blocks_allocated -= length;
+  pthread_mutex_unlock(&alloc_lock);
+}
+
+// gives blocks start..start+length-1 back to the free space
+// FIXME: For security reasons, one might want to clear the freed blocks on
+// the disk (write 0s in them). You could do this here.
+void free_run(block_id start, uint32_t length) {
+  // the flush freeing them changes their bitmap and group count blocks
+  uint32_t spans = (start + length - 1) / BITS_PER_BLOCK -
+                   start / BITS_PER_BLOCK + 1;
+  __atomic_add_fetch(&tx_blocks, 2 * spans, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&alloc_lock);
+  blocks_freed += length;
+  extent *last = nfreeing ? &freeing[nfreeing - 1] : NULL;
+  if (last && last->start + last->length == start) {
+    last->length += length;
+  } else {
+    if (nfreeing == maxfreeing) {
+      unsigned int max = maxfreeing ? 2 * maxfreeing : 64;
+      extent *runs = realloc(freeing, max * sizeof(extent));
+      if (!runs) { // no room to wait, better free them now than leak them
+        mark_run(start, length, 0);
+        pthread_mutex_unlock(&alloc_lock);
+        return;
+      }
+      freeing = runs;
+      maxfreeing = max;
+    }
+    freeing[nfreeing].start = start;
+    freeing[nfreeing++].length = length;
+  }
+  freeing_blocks += length;
+  pthread_mutex_unlock(&alloc_lock);
+}
+
+// sets n free blocks aside for delayed blocks, without picking them yet.
+// Returns -1 if there are not that many free blocks left.
+static int reserve(uint32_t n) {
+  int res = 0;
+  pthread_mutex_lock(&alloc_lock);
+  if (sb.free_blocks - reserved < n)
+    res = -1;
   else
-    return di;
+    reserved += n;
+  pthread_mutex_unlock(&alloc_lock);
+  return res;
+}
+
+// gives back n reserved blocks, of delayed blocks that were cut off
+static void unreserve(uint32_t n) {
+  pthread_mutex_lock(&alloc_lock);
+  reserved -= n;
+  pthread_mutex_unlock(&alloc_lock);
+}
+
+// allocates up to want of the reserved blocks, see alloc. What is not
+// allocated stays reserved.
+static block_id alloc_reserved(block_id goal, uint32_t want, uint32_t *got) {
+  pthread_mutex_lock(&alloc_lock);
+  reserved -= want;
+  block_id start = alloc(goal, want, got);
+  reserved += want - *got;
+  pthread_mutex_unlock(&alloc_lock);
+  return start;
+}
+
+// gives blocks start..start+length-1, from alloc_reserved, back to the
+// reserved blocks
+static void free_reserved(block_id start, uint32_t length) {
+  pthread_mutex_lock(&alloc_lock);
+  mark_run(start, length, 0);
+  reserved += length;
+  blocks_freed += length;
+  pthread_mutex_unlock(&alloc_lock);
+}
+
+// returns the index of the file of inode ic, reading its extents once if it
+// was not built yet
+static file_index *load_index(incore *ic) {
+  file_index *fx = ic->fx;
+  inode *in = &ic->in;
+  if (fx)
+    return fx;
+  fx = malloc(sizeof(file_index));
+  if (!fx)
+    return NULL;
+  // an inline file has no extents, whatever its data looks like
+  fx->nextents = in->flags & INODE_INLINE ? 0
+                                          : min(in->nextents, FILE_MAX_EXTENTS);
+  memcpy(fx->ext, in->extents, min(fx->nextents, DIR_EXTENTS) * sizeof(extent));
+  if (fx->nextents > DIR_EXTENTS) {
+    fs_block eb;
+    if (journal_read(in->ext_block, eb.bytes) < 0) {
+      free(fx);
+      return NULL;
+    }
+    memcpy(fx->ext + DIR_EXTENTS, eb.extents,
+           (fx->nextents - DIR_EXTENTS) * sizeof(extent));
+  }
+  fx->nblocks = 0;
+  for (unsigned int i = 0; i < fx->nextents; i++) {
+    fx->unwritten[i] = (fx->ext[i].length & EXTENT_UNWRITTEN) != 0;
+    fx->ext[i].length &= ~EXTENT_UNWRITTEN;
+    fx->lstart[i] = fx->nblocks;
+    fx->nblocks += fx->ext[i].length;
+  }
+  fx->lstart[fx->nextents] = fx->nblocks;
+  fx->last = 0;
+  ic->fx = fx;
+  return fx;
+}
+
+// marks inode ic as changed. The inode of the inode table is kept in the
+// superblock.
+static void inode_dirty(incore *ic) {
+  if (ic->ino == ITABLE_INO) {
+    sb.itable = ic->in;
+    sb_dirty = 1;
+  } else {
+    if (!ic->dirty)
+      __atomic_add_fetch(&tx_blocks, 1, __ATOMIC_RELAXED);
+    ic->dirty = 1;
+  }
+}
+
+// writes the extents of the index back into the inode, and into its extent
+// block if they do not all fit there (file_resize allocates it)
+static void store_extents(incore *ic) {
+  file_index *fx = ic->fx;
+  inode *in = &ic->in;
+  fs_block eb;
+  memset(eb.bytes, 0, BLOCK_SIZE);
+  in->nextents = fx->nextents;
+  for (unsigned int i = 0; i < fx->nextents; i++) {
+    extent *e = i < DIR_EXTENTS ? &in->extents[i]
+                                : &eb.extents[i - DIR_EXTENTS];
+    *e = fx->ext[i];
+    if (fx->unwritten[i])
+      e->length |= EXTENT_UNWRITTEN;
+  }
+  if (fx->nextents > DIR_EXTENTS) {
+    journal_write(in->ext_block, eb.bytes);
+  } else if (in->ext_block != EOF_BLOCK) {
+    free_run(in->ext_block, 1);
+    in->ext_block = EOF_BLOCK;
+  }
+  inode_dirty(ic);
+}
+
+// makes sure the file of inode ic has an extent block, for when its extents
+// no longer fit in the inode. Returns 1 if it has one.
+static int has_extent_block(incore *ic) {
+  uint32_t got;
+  if (ic->in.ext_block == EOF_BLOCK && ic->ext_reserved) {
+    ic->in.ext_block = alloc_reserved(EOF_BLOCK, 1, &got);
+    ic->ext_reserved = ic->in.ext_block == EOF_BLOCK;
+  } else if (ic->in.ext_block == EOF_BLOCK) {
+    ic->in.ext_block = alloc_run(EOF_BLOCK, 1, &got);
+  }
+  return ic->in.ext_block != EOF_BLOCK;
+}
+
+// returns the extent of the index holding logical block lblk, which must be
+// smaller than the number of blocks of the file
+static unsigned int find_extent(file_index *fx, unsigned int lblk) {
+  unsigned int lo = 0, hi = fx->nextents - 1;
+  // sequential access stays in the same extent, or moves to the next one
+  if (fx->last < fx->nextents && lblk >= fx->lstart[fx->last]) {
+    if (lblk < fx->lstart[fx->last + 1])
+      return fx->last;
+    if (fx->last + 1 < fx->nextents && lblk < fx->lstart[fx->last + 2])
+      return ++fx->last;
+  }
+  while (lo < hi) {
+    unsigned int mid = (lo + hi + 1) / 2;
+    if (fx->lstart[mid] <= lblk)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return fx->last = lo;
+}
+
+// returns the index of the file of inode ino, NULL if it cannot be read
+static file_index *ino_index(int ino) {
+  incore *ic = ifind(ino);
+  return ic ? load_index(ic) : NULL;
+}
+
+// returns 1 if the blocks of extent e of the index read as zeros, without
+// a place on the disk holding data: a hole, or preallocated blocks
+static int reads_zeros(file_index *fx, unsigned int e) {
+  return fx->ext[e].start == HOLE_BLOCK || fx->unwritten[e];
+}
+
+// returns the id of block lblk of the file of inode ino, or EOF_BLOCK if the
+// file is not that long, or the block reads as zeros (see reads_zeros)
+block_id file_block(int ino, unsigned int lblk) {
+  file_index *fx = ino_index(ino);
+  if (!fx || lblk >= fx->nblocks)
+    return EOF_BLOCK;
+  unsigned int e = find_extent(fx, lblk);
+  if (reads_zeros(fx, e))
+    return EOF_BLOCK;
+  return fx->ext[e].start + (lblk - fx->lstart[e]);
+}
+
+// puts the ids of (at most) n blocks of the file of inode ino, starting with
+// block lblk, in bids, EOF_BLOCK for those that read as zeros. Returns how
+// many blocks were mapped.
+int file_map(int ino, unsigned int lblk, int n, int *bids) {
+  file_index *fx = ino_index(ino);
+  int count = 0;
+  if (!fx || lblk >= fx->nblocks)
+    return 0;
+  for (unsigned int e = find_extent(fx, lblk); e < fx->nextents && count < n;
+       e++) {
+    unsigned int from = lblk + count - fx->lstart[e];
+    for (unsigned int b = from; b < fx->ext[e].length && count < n; b++)
+      bids[count++] = reads_zeros(fx, e) ? (int)EOF_BLOCK
+                                         : (int)(fx->ext[e].start + b);
+  }
+  return count;
+}
+
+// returns the number of blocks of the file of inode ino, the delayed ones
+// included
+unsigned int file_nblocks(int ino) {
+  incore *ic = ifind(ino);
+  file_index *fx = ic ? load_index(ic) : NULL;
+  return fx ? fx->nblocks + ic->ndelayed : 0;
+}
+
+// returns 1 if blocks start..start+length-1 (a hole if start is
+// HOLE_BLOCK) can make extent e of the index longer: they follow it, and
+// are unwritten if it is
+static int extends(file_index *fx, unsigned int e, block_id start,
+                   int unwritten) {
+  extent *x = &fx->ext[e];
+  if (fx->unwritten[e] != unwritten)
+    return 0;
+  if (x->start == HOLE_BLOCK || start == HOLE_BLOCK)
+    return x->start == start;
+  return start == x->start + x->length;
+}
+
+// returns 1 if the file of inode ic can have one more extent, getting an
+// extent block if it needs one
+static int extent_room(incore *ic) {
+  file_index *fx = ic->fx;
+  return fx->nextents < FILE_MAX_EXTENTS &&
+         (fx->nextents < DIR_EXTENTS || has_extent_block(ic));
+}
+
+// returns how many more extents the file of inode ic can have, for want
+// delayed blocks. If they need more than its inode holds, a free block is
+// set aside for its extent block, until they are allocated.
+static unsigned int extents_left(incore *ic, unsigned int want) {
+  file_index *fx = ic->fx;
+  if (fx->nextents + want > DIR_EXTENTS && ic->in.ext_block == EOF_BLOCK &&
+      !ic->ext_reserved) {
+    if (reserve(1) < 0)
+      return DIR_EXTENTS - min(fx->nextents, DIR_EXTENTS);
+    ic->ext_reserved = 1;
+  }
+  return FILE_MAX_EXTENTS - fx->nextents;
+}
+
+// gives back the block set aside for the extent block of the file of inode
+// ic, once it has no delayed blocks left
+static void unreserve_extent_block(incore *ic) {
+  if (ic->ext_reserved && ic->ndelayed == 0) {
+    unreserve(1);
+    ic->ext_reserved = 0;
+  }
+}
+
+// returns where to look for free blocks for extent n of the index: right
+// after the last extent before it that is not a hole
+static block_id goal_before(file_index *fx, unsigned int n) {
+  for (unsigned int i = n; i-- > 0;)
+    if (fx->ext[i].start != HOLE_BLOCK)
+      return fx->ext[i].start + fx->ext[i].length;
+  return EOF_BLOCK;
+}
+
+// adds blocks start..start+length-1 at the end of the file of inode ic,
+// making its last extent longer if they follow it. A hole is added with
+// start HOLE_BLOCK. Returns -1 if the file has no extent left for them.
+static int append_run(incore *ic, block_id start, uint32_t length) {
+  file_index *fx = ic->fx;
+  unsigned int last = fx->nextents - 1;
+  if (fx->nextents && extends(fx, last, start, 0)) {
+    fx->ext[last].length += length;
+  } else if (extent_room(ic)) {
+    fx->ext[fx->nextents].start = start;
+    fx->ext[fx->nextents].length = length;
+    fx->unwritten[fx->nextents] = 0;
+    fx->lstart[fx->nextents++] = fx->nblocks;
+  } else {
+    return -1;
+  }
+  fx->nblocks += length;
+  fx->lstart[fx->nextents] = fx->nblocks;
+  return 0;
+}
+
+// drops the last n delayed blocks of the file of inode ic, and what was
+// reserved for them
+static void cut_delayed(incore *ic, unsigned int n) {
+  ic->ndelayed -= n;
+  unreserve(n);
+  if (ic->ndelayed == 0) {
+    free(ic->delayed);
+    ic->delayed = NULL;
+    ic->maxdelay = 0;
+    unreserve_extent_block(ic);
+  }
+}
+
+// takes the data of the file of inode ic out of its inode, if it is there.
+// With keep set it moves to a delayed block, the first of the file,
+// otherwise it is dropped. Returns -1 if there is no room for the block,
+// the data is then still inline.
+static int leave_inline(incore *ic, int keep) {
+  inode *in = &ic->in;
+  char data[INLINE_SIZE];
+  if (!(in->flags & INODE_INLINE))
+    return 0;
+  memcpy(data, in->data, INLINE_SIZE);
+  in->flags &= ~INODE_INLINE;
+  memset(in->data, 0, INLINE_SIZE);
+  in->ext_block = EOF_BLOCK;
+  inode_dirty(ic);
+  if (keep) {
+    if (file_delay(ic->ino, 1) < 0) {
+      memcpy(in->data, data, INLINE_SIZE);
+      in->flags |= INODE_INLINE;
+      return -1;
+    }
+    memcpy(file_delayed(ic->ino, 0), data, INLINE_SIZE);
+  }
+  return 0;
+}
+
+// grows or shrinks the file of inode ino to nblocks blocks. Freed blocks go
+// back to the free list. New blocks are zeroed, and taken right after the
+// last extent when possible so it just gets longer. The delayed blocks are
+// cut first when the file shrinks, and allocated first when it grows.
+// An inline file leaves its inode first. Returns -1 if it runs out of
+// blocks (or extents).
+int file_resize(int ino, unsigned int nblocks) {
+  incore *ic = ifind(ino);
+  file_index *fx = ic ? load_index(ic) : NULL;
+  int res = 0;
+  if (!fx || leave_inline(ic, nblocks > 0) < 0)
+    return -1;
+  unsigned int total = fx->nblocks + ic->ndelayed;
+  if (nblocks < total)
+    cut_delayed(ic, min(ic->ndelayed, total - nblocks));
+  else if (nblocks > total && file_allocate(ino, 1) < 0)
+    return -1;
+  // the blocks still delayed stay the last ones
+  nblocks -= ic->ndelayed;
+  while (fx->nblocks > nblocks) {
+    // cut the last extent, then free what was cut (a hole has nothing)
+    extent *e = &fx->ext[fx->nextents - 1];
+    uint32_t cut = min(e->length, fx->nblocks - nblocks);
+    e->length -= cut;
+    if (e->start != HOLE_BLOCK)
+      free_run(e->start + e->length, cut);
+    fx->nblocks -= cut;
+    if (e->length == 0)
+      fx->nextents--;
+  }
+  if (fx->nblocks < nblocks) {
+    fs_block zero;
+    memset(zero.bytes, 0, BLOCK_SIZE);
+    while (fx->nblocks < nblocks) {
+      block_id goal = goal_before(fx, fx->nextents);
+      uint32_t got;
+      block_id start = alloc_run(goal, nblocks - fx->nblocks, &got);
+      if (start == EOF_BLOCK) {
+        res = -1;
+        break;
+      }
+      if (append_run(ic, start, got) < 0) {
+        free_run(start, got);
+        res = -1;
+        break;
+      }
+      // new blocks read as zeros, even if they held an old file
+      for (block_id bid = start; bid < start + got; bid++)
+        writeBlock(bid, zero.bytes);
+    }
+  }
+  fx->lstart[fx->nextents] = fx->nblocks;
+  store_extents(ic);
+  return res;
+}
+
+// grows the file of inode ino to nblocks blocks, like file_resize, but the
+// new blocks are delayed: they are zeroed in memory, and the free blocks
+// they need are only reserved. Appending to a file then does not allocate
+// and write its blocks a few at a time. A file growing by more than
+// FS_DELAY_BLOCKS at once gets its blocks right away. So do blocks the
+// file may have no extents for: on a cut up disk each delayed block may
+// take an extent of its own, and a write must not be accepted if it cannot
+// be kept. An inline file leaves its inode first. Returns -1 if there are
+// not enough free blocks or extents (or memory).
+int file_delay(int ino, unsigned int nblocks) {
+  incore *ic = ifind(ino);
+  file_index *fx = ic ? load_index(ic) : NULL;
+  if (!fx || (nblocks > 0 && leave_inline(ic, 1) < 0))
+    return -1;
+  if (nblocks <= fx->nblocks + ic->ndelayed)
+    return 0;
+  unsigned int more = nblocks - fx->nblocks - ic->ndelayed;
+  unsigned int want = ic->ndelayed + more;
+  if (want > FS_DELAY_BLOCKS || want > extents_left(ic, want)) {
+    if (file_allocate(ino, 1) < 0)
+      return -1;
+    if (more > FS_DELAY_BLOCKS || more > extents_left(ic, more)) {
+      unreserve_extent_block(ic);
+      return file_resize(ino, nblocks);
+    }
+  }
+  if (reserve(more) < 0) {
+    unreserve_extent_block(ic);
+    return -1;
+  }
+  if (ic->ndelayed + more > ic->maxdelay) {
+    unsigned int max = min(2 * (ic->ndelayed + more), FS_DELAY_BLOCKS);
+    char *delayed = realloc(ic->delayed, (size_t)max * BLOCK_SIZE);
+    if (!delayed) {
+      unreserve(more);
+      unreserve_extent_block(ic);
+      return -1;
+    }
+    ic->delayed = delayed;
+    ic->maxdelay = max;
+  }
+  memset(ic->delayed + (size_t)ic->ndelayed * BLOCK_SIZE, 0,
+         (size_t)more * BLOCK_SIZE);
+  // the flush allocating them changes the inode and its extent block
+  if (ic->ndelayed == 0)
+    __atomic_add_fetch(&tx_blocks, 2, __ATOMIC_RELAXED);
+  ic->ndelayed += more;
+  return 0;
+}
+
+// returns the data of block lblk of the file of inode ino if it is
+// delayed, followed by the delayed blocks after it. NULL if it is not.
+char *file_delayed(int ino, unsigned int lblk) {
+  incore *ic = ifind(ino);
+  file_index *fx = ic ? load_index(ic) : NULL;
+  if (!fx || lblk < fx->nblocks || lblk >= fx->nblocks + ic->ndelayed)
+    return NULL;
+  return ic->delayed + (size_t)(lblk - fx->nblocks) * BLOCK_SIZE;
+}
+
+// allocates the delayed blocks of the file of inode ino, in as few runs as
+// it can, and writes them with one request per run. Does nothing unless
+// force is set or too many blocks are delayed (FS_DELAY_BLOCKS for the
+// file, FS_DELAY_TOTAL for all of them). Returns -1 if some could not be
+// allocated or written, those that could not be allocated stay delayed.
+int file_allocate(int ino, int force) {
+  incore *ic = ifind(ino);
+  file_index *fx = ic ? load_index(ic) : NULL;
+  if (!fx)
+    return -1;
+  if (ic->ndelayed == 0)
+    return 0;
+  if (!force && ic->ndelayed < FS_DELAY_BLOCKS) {
+    pthread_mutex_lock(&alloc_lock);
+    force = reserved >= FS_DELAY_TOTAL;
+    pthread_mutex_unlock(&alloc_lock);
+    if (!force)
+      return 0;
+  }
+  unsigned int done = 0;
+  int res = 0;
+  while (done < ic->ndelayed) {
+    block_id goal = goal_before(fx, fx->nextents);
+    uint32_t got;
+    block_id start = alloc_reserved(goal, ic->ndelayed - done, &got);
+    if (start == EOF_BLOCK || append_run(ic, start, got) < 0) {
+      if (start != EOF_BLOCK)
+        free_reserved(start, got);
+      res = -1;
+      break;
+    }
+    // the blocks go straight to the disk file, as the other file data
+    size_t length = (size_t)got * BLOCK_SIZE;
+    if (uncacheBlocks(start, got, 1) < 0 ||
+        pwrite(diskFile(), ic->delayed + (size_t)done * BLOCK_SIZE, length,
+               (off_t)start * BLOCK_SIZE) != (ssize_t)length)
+      res = -1;
+    done += got;
+  }
+  // what is left moves to the front, it still follows the allocated blocks
+  memmove(ic->delayed, ic->delayed + (size_t)done * BLOCK_SIZE,
+          (size_t)(ic->ndelayed - done) * BLOCK_SIZE);
+  ic->ndelayed -= done;
+  if (ic->ndelayed == 0) {
+    free(ic->delayed);
+    ic->delayed = NULL;
+    ic->maxdelay = 0;
+    unreserve_extent_block(ic);
+  }
+  store_extents(ic);
+  return res;
+}
+
+// makes an extent of the file of inode ic start at logical block lblk, by
+// cutting the one holding it in two. Returns -1 if the file has no extent
+// left for that.
+static int split_at(incore *ic, unsigned int lblk) {
+  file_index *fx = ic->fx;
+  if (lblk >= fx->nblocks)
+    return 0;
+  unsigned int e = find_extent(fx, lblk);
+  uint32_t cut = lblk - fx->lstart[e];
+  if (cut == 0)
+    return 0;
+  if (!extent_room(ic))
+    return -1;
+  unsigned int after = fx->nextents - e - 1;
+  memmove(&fx->ext[e + 2], &fx->ext[e + 1], after * sizeof(extent));
+  memmove(&fx->lstart[e + 2], &fx->lstart[e + 1],
+          (after + 1) * sizeof(unsigned int));
+  memmove(&fx->unwritten[e + 2], &fx->unwritten[e + 1], after);
+  extent *x = &fx->ext[e];
+  fx->ext[e + 1].start = x->start == HOLE_BLOCK ? HOLE_BLOCK : x->start + cut;
+  fx->ext[e + 1].length = x->length - cut;
+  fx->unwritten[e + 1] = fx->unwritten[e];
+  fx->lstart[e + 1] = lblk;
+  x->length = cut;
+  fx->nextents++;
+  return 0;
+}
+
+// joins the extents of the index that follow each other, after split_at
+// and fill cut them up
+static void merge_extents(file_index *fx) {
+  unsigned int n = 0;
+  for (unsigned int i = 0; i < fx->nextents; i++) {
+    if (n > 0 && extends(fx, n - 1, fx->ext[i].start, fx->unwritten[i])) {
+      fx->ext[n - 1].length += fx->ext[i].length;
+      continue;
+    }
+    fx->ext[n] = fx->ext[i];
+    fx->unwritten[n] = fx->unwritten[i];
+    fx->lstart[n++] = fx->lstart[i];
+  }
+  fx->nextents = n;
+  fx->lstart[n] = fx->nblocks;
+  fx->last = 0;
+}
+
+// gives blocks to the holes among logical blocks a..b-1 of the file of
+// inode ic, in as few runs as the free space allows. With unwritten set,
+// for fallocate, the new blocks are left unwritten. Otherwise they are
+// about to be written, as the unwritten ones in a..b-1 which lose their
+// mark; of those, block a is zeroed if zero has bit 1, block b-1 if it has
+// bit 2, the write only covers part of them. A file with no extent left to
+// cut one in parts has all of it filled, the blocks out of a..b-1 zeroed.
+// Returns -1 if it runs out of blocks (or extents).
+static int fill(incore *ic, unsigned int a, unsigned int b, int unwritten,
+                int zero) {
+  file_index *fx = ic->fx;
+  unsigned int last = b - 1; // before b is cut to the blocks of the file
+  int changed = 0, res = 0;
+  fs_block zeros;
+  memset(zeros.bytes, 0, BLOCK_SIZE);
+  b = min(b, fx->nblocks);
+  for (unsigned int l = a, end; l < b; l = end) {
+    // the parts filled so far may join, when the extents run out
+    if (changed && fx->nextents + 2 > FILE_MAX_EXTENTS)
+      merge_extents(fx);
+    unsigned int e = find_extent(fx, l);
+    int hole = fx->ext[e].start == HOLE_BLOCK;
+    end = min(b, fx->lstart[e + 1]);
+    if (!hole && (unwritten || !fx->unwritten[e]))
+      continue;
+    // the extents kept for the delayed blocks must stay theirs
+    if (ic->ndelayed && file_allocate(ic->ino, 1) < 0) {
+      res = -1;
+      break;
+    }
+    // the part of the extent in a..b-1 becomes an extent of its own
+    if (split_at(ic, l) < 0 || split_at(ic, end) < 0) {
+      e = find_extent(fx, l);
+      l = fx->lstart[e];
+      end = fx->lstart[e + 1];
+    }
+    changed = 1;
+    e = find_extent(fx, l);
+    if (hole) {
+      uint32_t got;
+      block_id start = alloc_run(goal_before(fx, e), end - l, &got);
+      if (start != EOF_BLOCK && got < end - l && !extent_room(ic)) {
+        // no extent for the rest, a run long enough for all of it then
+        unalloc_run(start, got);
+        start = alloc_run(EOF_BLOCK, end - l, &got);
+      }
+      if (start == EOF_BLOCK) {
+        res = -1;
+        break;
+      }
+      if (got < end - l && split_at(ic, l + got) < 0) {
+        unalloc_run(start, got);
+        res = -1;
+        break;
+      }
+      fx->ext[e].start = start;
+      end = l + got;
+    }
+    fx->unwritten[e] = unwritten;
+    for (unsigned int z = l; !unwritten && z < end; z++)
+      if (z < a || z > last || (z == a && (zero & 1)) ||
+          (z == last && (zero & 2)))
+        writeBlock(fx->ext[e].start + (z - l), zeros.bytes);
+  }
+  if (changed) {
+    merge_extents(fx);
+    store_extents(ic);
+  }
+  return res;
+}
+
+// grows the file of inode ino to nblocks blocks with a hole, which takes
+// no blocks until it is written, and reads as zeros. The delayed blocks
+// are allocated first, they must stay the last ones. Returns -1 if they
+// cannot be, or the file has no extent left (nor free blocks).
+int file_hole(int ino, unsigned int nblocks) {
+  incore *ic = ifind(ino);
+  file_index *fx = ic ? load_index(ic) : NULL;
+  if (!fx || (nblocks > 0 && leave_inline(ic, 1) < 0))
+    return -1;
+  if (nblocks <= fx->nblocks + ic->ndelayed)
+    return 0;
+  if (file_allocate(ino, 1) < 0)
+    return -1;
+  // without an extent for the hole, the file gets zeroed blocks instead,
+  // delayed so they may still extend the last extent
+  if (append_run(ic, HOLE_BLOCK, nblocks - fx->nblocks) < 0)
+    return file_delay(ino, nblocks);
+  store_extents(ic);
+  return 0;
+}
+
+// gets the bytes offset..offset+size-1 of the file of inode ino ready to
+// be written, where it has blocks (delayed ones aside): the holes get
+// blocks, and the preallocated blocks are no longer unwritten. Those the
+// write only covers part of are zeroed. Returns -1 if it runs out of
+// blocks or extents.
+int file_fill(int ino, off_t offset, size_t size) {
+  incore *ic = ifind(ino);
+  file_index *fx = ic ? load_index(ic) : NULL;
+  if (!fx)
+    return -1;
+  int zero = (offset % BLOCK_SIZE ? 1 : 0) |
+             ((offset + size) % BLOCK_SIZE ? 2 : 0);
+  return fill(ic, offset / BLOCK_SIZE,
+              (offset + size + BLOCK_SIZE - 1) / BLOCK_SIZE, 0, zero);
+}
+
+// gives logical blocks from..to-1 of the file of inode ino their place on
+// the disk, for fallocate, growing the file to to blocks if it is shorter.
+// The blocks are taken in as few runs as the free space allows, and stay
+// unwritten: they read as zeros without being zeroed. Returns -1 if it
+// runs out of blocks or extents.
+int file_prealloc(int ino, unsigned int from, unsigned int to) {
+  incore *ic = ifind(ino);
+  if (!ic || file_hole(ino, to) < 0)
+    return -1;
+  return fill(ic, from, to, 1, 0);
+}
+
+// returns the data of the file of inode ino if it is kept in its inode,
+// INLINE_SIZE bytes, zeros past the end of the file. NULL if it is not.
+char *file_inline(int ino) {
+  incore *ic = ifind(ino);
+  return ic && (ic->in.flags & INODE_INLINE) ? ic->in.data : NULL;
+}
+
+// decides where the data of the file of inode ino goes, for a write or a
+// truncate up to end. A regular file without blocks and not longer than
+// INLINE_SIZE keeps its data inline (an empty one becomes inline), one
+// that grows past it has its data moved to a block. Returns 1 if the data
+// is inline, 0 if it is in blocks, -1 if there was no room to move it.
+int file_keep_inline(int ino, off_t end) {
+  incore *ic = ifind(ino);
+  file_index *fx = ic ? load_index(ic) : NULL;
+  inode *in = ic ? &ic->in : NULL;
+  if (!fx)
+    return -1;
+  if (end > INLINE_SIZE || in->size_bytes > INLINE_SIZE)
+    return leave_inline(ic, 1);
+  if (in->flags & INODE_INLINE)
+    return 1;
+  if (!S_ISREG(in->mode) || fx->nblocks + ic->ndelayed > 0)
+    return 0;
+  in->flags |= INODE_INLINE;
+  memset(in->data, 0, INLINE_SIZE);
+  inode_dirty(ic);
+  return 1;
+}
+
+// returns the entry in slot s of the loaded directory n
+static dir_entry *slot_entry(dir_node *n, unsigned int s) {
+  return &n->blocks[s / DIR_ENTRIES_PER_BLOCK]
+              .directory[s % DIR_ENTRIES_PER_BLOCK];
+}
+
+// marks the block holding slot s of directory n as changed
+static void entry_dirty(dir_node *n, unsigned int s) {
+  if (!n->dirty[s / DIR_ENTRIES_PER_BLOCK])
+    __atomic_add_fetch(&tx_blocks, 1, __ATOMIC_RELAXED);
+  n->dirty[s / DIR_ENTRIES_PER_BLOCK] = 1;
+  n->is_dirty = 1;
+}
+
+// writes back the changed blocks of the loaded directory d
+static int flush_dir(incore *d) {
+  dir_node *n = d->node;
+  for (unsigned int b = 0; b < n->nslots / DIR_ENTRIES_PER_BLOCK; b++) {
+    if (!n->dirty[b])
+      continue;
+    if (journal_write(file_block(d->ino, b), n->blocks[b].bytes) < 0)
+      return -1;
+    n->dirty[b] = 0;
+  }
+  n->is_dirty = 0;
+  return 0;
+}
+
+// lets go of the loaded directory of d
+static void free_node(incore *d) {
+  dir_node *n = d->node;
+  if (!n)
+    return;
+  free(n->blocks);
+  free(n->next);
+  free(n->heads);
+  free(n->dirty);
+  free(n);
+  d->node = NULL;
 }
 
-// Finds the first empty entry, after all the existing
-// entries, in the last_block seen as a directiry.
-// It returns the index of the entry.
-int first_empty_dir_entry() {
-  unsigned short di = 0;
-  while (di < DIR_ENTRIES_PER_BLOCK && !dir_entry_is_empty(bdir.directory[di]))
-    di++;
-  if (di == DIR_ENTRIES_PER_BLOCK) // cannot add more entries
+// adds inode ic to the hash table, which doubles when it gets as many
+// inodes as buckets. icache_lock must be held.
+static int icache_add(incore *ic) {
+  if (nincores == maxincores) {
+    unsigned int max = maxincores ? 2 * maxincores : 64;
+    incore **all = realloc(incores, max * sizeof(incore *));
+    if (!all)
+      return -1;
+    incores = all;
+    maxincores = max;
+  }
+  if (nincores >= icache_size) {
+    unsigned int size = icache_size ? 2 * icache_size : 64;
+    incore **table = calloc(size, sizeof(incore *));
+    if (!table)
+      return -1;
+    free(icache);
+    icache = table;
+    icache_size = size;
+    for (unsigned int i = 0; i < nincores; i++) {
+      incore **head = &icache[incores[i]->ino & (size - 1)];
+      incores[i]->hnext = *head;
+      *head = incores[i];
+    }
+  }
+  incore **head = &icache[ic->ino & (icache_size - 1)];
+  ic->hnext = *head;
+  *head = ic;
+  incores[nincores++] = ic;
+  return 0;
+}
+
+// returns inode ino if it is in memory, NULL if not. Inodes stay at the
+// same place until unmount, so the pointer can be used without the lock.
+static incore *ifind(inode_id ino) {
+  pthread_mutex_lock(&icache_lock);
+  incore *ic = icache_size ? icache[ino & (icache_size - 1)] : NULL;
+  while (ic && ic->ino != ino)
+    ic = ic->hnext;
+  pthread_mutex_unlock(&icache_lock);
+  return ic;
+}
+
+// returns inode ino, reading it from the inode table the first time. NULL
+// if there is no such inode, or it cannot be read. fs_lock must be held.
+static incore *iget(inode_id ino) {
+  incore *ic = ifind(ino);
+  if (ic)
+    return ic;
+  if (ino >= sb.ninodes)
+    return NULL;
+  fs_block blk;
+  if (ino != ITABLE_INO) {
+    block_id bid = file_block(ITABLE_INO, ino / INODES_PER_BLOCK);
+    if (bid == EOF_BLOCK || journal_read(bid, blk.bytes) < 0)
+      return NULL;
+  }
+  ic = calloc(1, sizeof(incore));
+  if (!ic)
+    return NULL;
+  ic->in = ino == ITABLE_INO ? sb.itable : blk.inodes[ino % INODES_PER_BLOCK];
+  ic->ino = ino;
+  pthread_rwlock_init(&ic->lock, NULL);
+  pthread_mutex_lock(&icache_lock);
+  int res = icache_add(ic);
+  pthread_mutex_unlock(&icache_lock);
+  if (res < 0) {
+    pthread_rwlock_destroy(&ic->lock);
+    free(ic);
+    return NULL;
+  }
+  return ic;
+}
+
+// writes inode ic back into its block of the inode table
+static int write_inode(incore *ic) {
+  fs_block blk;
+  block_id bid = file_block(ITABLE_INO, ic->ino / INODES_PER_BLOCK);
+  if (bid == EOF_BLOCK || journal_read(bid, blk.bytes) < 0)
     return -1;
+  blk.inodes[ic->ino % INODES_PER_BLOCK] = ic->in;
+  if (journal_write(bid, blk.bytes) < 0)
+    return -1;
+  ic->dirty = 0;
+  return 0;
+}
+
+// adds a block of free inodes to the end of the inode table
+static int grow_itable() {
+  incore *it = iget(ITABLE_INO);
+  unsigned int nblocks = file_nblocks(ITABLE_INO);
+  inode_id first = nblocks * INODES_PER_BLOCK;
+  if (file_resize(ITABLE_INO, nblocks + 1) < 0) {
+    file_resize(ITABLE_INO, nblocks);
+    return -1;
+  }
+  // chain the new inodes in front of the free ones
+  fs_block blk;
+  memset(blk.bytes, 0, BLOCK_SIZE);
+  for (unsigned int i = 0; i < INODES_PER_BLOCK; i++)
+    blk.inodes[i].next_free = i + 1 < INODES_PER_BLOCK ? first + i + 1
+                                                       : sb.free_inode;
+  if (journal_write(file_block(ITABLE_INO, nblocks), blk.bytes) < 0) {
+    file_resize(ITABLE_INO, nblocks);
+    return -1;
+  }
+  it->in.size_bytes = (nblocks + 1) * BLOCK_SIZE;
+  inode_dirty(it);
+  sb.ninodes += INODES_PER_BLOCK;
+  sb.free_inodes += INODES_PER_BLOCK;
+  sb.free_inode = first;
+  sb_dirty = 1;
+  return 0;
+}
+
+// takes a free inode, the inode table grows when there are none. Returns
+// it cleared, or NULL if there is no room.
+static incore *alloc_inode() {
+  if (sb.free_inode == 0 && grow_itable() < 0)
+    return NULL;
+  incore *ic = iget(sb.free_inode);
+  if (!ic)
+    return NULL;
+  sb.free_inode = ic->in.next_free;
+  sb.free_inodes--;
+  sb_dirty = 1;
+  memset(&ic->in, 0, sizeof(inode));
+  ic->in.ext_block = EOF_BLOCK;
+  ic->dir = ic->slot = 0;
+  ic->opens = ic->unlinked = 0;
+  inode_dirty(ic);
+  return ic;
+}
+
+// gives the blocks of inode ic back to the free space, then the inode
+// itself. It stays in memory, free, until it is taken again.
+static void free_inode(incore *ic) {
+  file_resize(ic->ino, 0);
+  free(ic->fx);
+  ic->fx = NULL;
+  free_node(ic);
+  memset(&ic->in, 0, sizeof(inode));
+  ic->in.next_free = sb.free_inode;
+  sb.free_inode = ic->ino;
+  sb.free_inodes++;
+  sb_dirty = 1;
+  ic->dir = ic->slot = 0;
+  ic->unlinked = 0;
+  inode_dirty(ic);
+}
+
+// replays the journal, then reads the superblock and keeps it in memory
+// until the file system is unmounted. The bitmap, the group free counts,
+// the inodes and the directories are read on demand, so this does not take
+// longer for larger disks.
+int fs_mount() {
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&fs_lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  fs_block blk;
+  if (readBlock(SUPER_BID, blk.bytes) < 0)
+    return -1;
+  sb = blk.super;
+  if (sb.magic != FS_MAGIC || sb.version != FS_VERSION ||
+      sb.block_size != BLOCK_SIZE) {
+    printf("fs_mount: not a formatted disk, run format_myfs first\n");
+    return -1;
+  }
+  // the replay may bring back a newer superblock
+  if (journal_open(sb.journal_start, sb.journal_blocks) < 0 ||
+      readBlock(SUPER_BID, blk.bytes) < 0)
+    return -1;
+  sb = blk.super;
+  if (region_open(&bitmap, sb.bitmap_start, sb.bitmap_blocks) < 0 ||
+      region_open(&groups, sb.groups_start, sb.groups_blocks) < 0 ||
+      !iget(ITABLE_INO))
+    return -1;
+  alloc_cursor = sb.journal_start + sb.journal_blocks;
+  reserved = 0;
+  mounted = 1;
+  sb_dirty = 0;
+  last_flush = time(0);
+  return 0;
+}
+
+// frees the files removed while they were open, flushes the metadata (and
+// the delayed blocks), closes the journal and lets go of the in memory
+// copies
+int fs_unmount() {
+  for (unsigned int i = 0; i < nincores; i++)
+    if (incores[i]->unlinked)
+      free_inode(incores[i]);
+  // the second flush commits the blocks the first one freed
+  int res = fs_flush();
+  if (fs_flush() < 0 || journal_close() < 0)
+    res = -1;
+  free(freeing);
+  freeing = NULL;
+  nfreeing = maxfreeing = freeing_blocks = 0;
+  region_close(&bitmap);
+  region_close(&groups);
+  for (unsigned int i = 0; i < nincores; i++) {
+    if (incores[i]->ndelayed) { // the flush could not allocate them
+      printf("fs_unmount: %u delayed blocks of inode %d lost\n",
+             incores[i]->ndelayed, incores[i]->ino);
+      res = -1;
+    }
+    free_node(incores[i]);
+    free(incores[i]->fx);
+    free(incores[i]->delayed);
+    pthread_rwlock_destroy(&incores[i]->lock);
+    free(incores[i]);
+  }
+  free(incores);
+  free(icache);
+  incores = icache = NULL;
+  nincores = maxincores = icache_size = 0;
+  mounted = 0;
+  pthread_mutex_destroy(&fs_lock);
+  return res;
+}
+
+// commits the metadata blocks changed since the last flush, after
+// allocating the delayed blocks of the files not in use, as one
+// transaction. The files being written are waited for, so the transaction
+// does not catch one half changed. Once it is committed, the blocks it
+// frees are free. With sync set, everything is forced to the disk.
+static int flush(int sync) {
+  int res = 0;
+  pthread_mutex_lock(&fs_lock);
+  // directories only change with fs_lock held
+  for (unsigned int i = 0; i < nincores; i++) {
+    incore *ic = incores[i];
+    if (!ic->node && ic->ino != ITABLE_INO &&
+        pthread_rwlock_trywrlock(&ic->lock) == 0) {
+      if (ic->ndelayed && file_allocate(ic->ino, 1) < 0)
+        res = -1;
+      pthread_rwlock_unlock(&ic->lock);
+    }
+  }
+  // the files stay locked until the transaction is sealed
+  for (unsigned int i = 0; i < nincores; i++) {
+    incore *ic = incores[i];
+    if (ic->node && ic->node->is_dirty && flush_dir(ic) < 0)
+      res = -1;
+    if (!ic->node && ic->ino != ITABLE_INO)
+      pthread_rwlock_rdlock(&ic->lock);
+    if (ic->dirty && write_inode(ic) < 0)
+      res = -1;
+  }
+  // the free block count goes with the bitmap. The transaction frees the
+  // freed blocks, but they stay in use in memory until it is committed.
+  pthread_mutex_lock(&freeing_lock);
+  pthread_mutex_lock(&alloc_lock);
+  extent *freed = freeing;
+  unsigned int nfreed = nfreeing;
+  freeing = NULL;
+  nfreeing = maxfreeing = 0;
+  for (unsigned int i = 0; i < nfreed; i++)
+    mark_run(freed[i].start, freed[i].length, 0);
+  int nbitmap = region_flush(&bitmap), ngroups = region_flush(&groups);
+  if (nbitmap < 0 || ngroups < 0)
+    res = -1;
+  if (sb_dirty || nbitmap > 0 || ngroups > 0) {
+    fs_block blk;
+    memset(blk.bytes, 0, BLOCK_SIZE);
+    blk.super = sb;
+    if (journal_write(SUPER_BID, blk.bytes) < 0)
+      res = -1;
+    else
+      sb_dirty = 0;
+  }
+  for (unsigned int i = 0; i < nfreed; i++)
+    mark_run(freed[i].start, freed[i].length, 1);
+  pthread_mutex_unlock(&alloc_lock);
+  if (nfreed == 0)
+    pthread_mutex_unlock(&freeing_lock);
+  __atomic_store_n(&tx_blocks, 0, __ATOMIC_RELAXED);
+  journal_seal();
+  for (unsigned int i = 0; i < nincores; i++)
+    if (!incores[i]->node && incores[i]->ino != ITABLE_INO)
+      pthread_rwlock_unlock(&incores[i]->lock);
+  last_flush = time(0);
+  pthread_mutex_unlock(&fs_lock);
+  if (journal_commit(sync) < 0) {
+    res = -1;
+  } else if (nfreed > 0) {
+    // the journal may still hold older copies of the freed blocks, which a
+    // replay would write over their next owner
+    if (journal_checkpoint() < 0)
+      res = -1;
+    pthread_mutex_lock(&alloc_lock);
+    for (unsigned int i = 0; i < nfreed; i++) {
+      mark_run(freed[i].start, freed[i].length, 0);
+      freeing_blocks -= freed[i].length;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+  }
+  if (nfreed > 0)
+    pthread_mutex_unlock(&freeing_lock);
+  free(freed);
+  return res;
+}
+
+int fs_flush() { return flush(0); }
+
+// flushes the metadata and forces everything to the disk
+int fs_sync() { return flush(1); }
+
+// commits the blocks freed since the last flush, so they can be used
+// again. Returns 1 if there were some (maybe committed by another flush
+// meanwhile). No inode may be locked.
+int reclaim_blocks() {
+  pthread_mutex_lock(&alloc_lock);
+  int pending = freeing_blocks > 0;
+  pthread_mutex_unlock(&alloc_lock);
+  if (!pending)
+    return 0;
+  fs_flush();
+  // and those of a flush that started before
+  pthread_mutex_lock(&freeing_lock);
+  pthread_mutex_unlock(&freeing_lock);
+  return 1;
+}
+
+// flushes the metadata if it has been dirty for too long. Batches the
+// updates of a burst of operations into one write per block. Flushes
+// sooner if more blocks are waiting for the commit that frees them than
+// are free, so the allocations do not run out of blocks meanwhile, and
+// once the transaction fills half the journal, so it still fits in one
+// commit with what the operations running meanwhile add to it.
+static void flush_if_due() {
+  pthread_mutex_lock(&alloc_lock);
+  int short_of_blocks =
+      nfreeing > 0 && freeing_blocks > sb.free_blocks - reserved;
+  // and the dirty bitmap and group count blocks, and the superblock
+  unsigned int blocks = __atomic_load_n(&tx_blocks, __ATOMIC_RELAXED) +
+                        bitmap.ndirty + groups.ndirty + 1;
+  pthread_mutex_unlock(&alloc_lock);
+  blocks += journal_running();
+  pthread_mutex_lock(&fs_lock);
+  if (!mounted || short_of_blocks || blocks > journal_max_tx() / 2 ||
+      time(0) - last_flush >= FS_FLUSH_INTERVAL)
+    fs_flush();
+  pthread_mutex_unlock(&fs_lock);
+}
+
+// the changed bitmap blocks get back on the disk at the next flush, which
+// happens now if it is due. Must not be called with an inode locked.
+void save_blockmap() {
+  flush_if_due();
+}
+
+
+// returns the hash of a name of len characters (FNV-1a), looking at no more
+// than the FS_NAME_LEN characters kept in a directory entry
+static unsigned int name_hash(const char *name, size_t len) {
+  unsigned int h = 2166136261u;
+  for (size_t i = 0; i < min(len, FS_NAME_LEN) && name[i]; i++)
+    h = (h ^ (unsigned char)name[i]) * 16777619u;
+  return h;
+}
+
+// returns 1 if a stored name is name (len characters, cut to FS_NAME_LEN
+// like the names of new entries)
+static int name_matches(const char *stored, const char *name, size_t len) {
+  len = min(len, FS_NAME_LEN);
+  return !strncmp(stored, name, len) && (len == FS_NAME_LEN || !stored[len]);
+}
+
+// adds slot s of directory n to its hash index
+static void hash_insert(dir_node *n, unsigned int s) {
+  unsigned int b =
+      name_hash(slot_entry(n, s)->name, FS_NAME_LEN) & (n->nbuckets - 1);
+  n->next[s] = n->heads[b];
+  n->heads[b] = s;
+}
+
+// takes slot s of directory n out of its hash index
+static void hash_remove(dir_node *n, unsigned int s) {
+  unsigned int b =
+      name_hash(slot_entry(n, s)->name, FS_NAME_LEN) & (n->nbuckets - 1);
+  int *link = &n->heads[b];
+  while (*link >= 0 && *link != s)
+    link = &n->next[*link];
+  if (*link >= 0)
+    *link = n->next[s];
+}
+
+// rebuilds the hash index of directory n, with about one bucket per slot
+static int hash_rebuild(dir_node *n) {
+  unsigned int nbuckets = 8;
+  while (nbuckets < n->nslots)
+    nbuckets *= 2;
+  if (nbuckets != n->nbuckets) {
+    int *heads = realloc(n->heads, nbuckets * sizeof(int));
+    if (!heads)
+      return -1;
+    n->heads = heads;
+    n->nbuckets = nbuckets;
+  }
+  for (unsigned int b = 0; b < n->nbuckets; b++)
+    n->heads[b] = -1;
+  for (unsigned int s = 0; s < n->nslots; s++)
+    if (!dir_entry_is_empty((*slot_entry(n, s))))
+      hash_insert(n, s);
+  return 0;
+}
+
+// makes room for nblocks blocks of entries in directory n. New slots are
+// empty.
+static int node_resize(dir_node *n, unsigned int nblocks) {
+  unsigned int nslots = nblocks * DIR_ENTRIES_PER_BLOCK;
+  fs_block *blocks = realloc(n->blocks, nblocks * sizeof(fs_block));
+  if (blocks)
+    n->blocks = blocks;
+  int *next = realloc(n->next, nslots * sizeof(int));
+  if (next)
+    n->next = next;
+  unsigned char *dirty = realloc(n->dirty, nblocks);
+  if (dirty)
+    n->dirty = dirty;
+  if (nblocks && (!blocks || !next || !dirty))
+    return -1;
+  for (unsigned int b = n->nslots / DIR_ENTRIES_PER_BLOCK; b < nblocks; b++) {
+    memset(n->blocks[b].bytes, 0, BLOCK_SIZE);
+    n->dirty[b] = 0;
+  }
+  n->nslots = nslots;
+  return 0;
+}
+
+// returns the loaded directory of inode d, reading it the first time.
+// Returns NULL if d is not a directory (or it cannot be read).
+static dir_node *load_dir(incore *d) {
+  if (d->node)
+    return d->node;
+  if (!S_ISDIR(d->in.mode) || !(d->node = calloc(1, sizeof(dir_node))))
+    return NULL;
+  dir_node *n = d->node;
+
+  // read the blocks, one request per run of consecutive blocks
+  unsigned int nblocks = file_nblocks(d->ino);
+  int *bids = malloc((nblocks + 1) * sizeof(int));
+  if (!bids || node_resize(n, nblocks) < 0 ||
+      file_map(d->ino, 0, nblocks, bids) != nblocks ||
+      (nblocks && readBlocks(bids, nblocks, n->blocks) < 0) ||
+      hash_rebuild(n) < 0) {
+    free(bids);
+    free_node(d);
+    return NULL;
+  }
+  free(bids);
+  for (unsigned int s = 0; s < n->nslots; s++)
+    if (!dir_entry_is_empty((*slot_entry(n, s))))
+      n->nused++;
+  return n;
+}
+
+// returns the slot of the entry name (len characters) in the loaded
+// directory n, or -1
+static int lookup(dir_node *n, const char *name, size_t len) {
+  int s = n->heads[name_hash(name, len) & (n->nbuckets - 1)];
+  while (s >= 0 && !name_matches(slot_entry(n, s)->name, name, len))
+    s = n->next[s];
+  return s;
+}
+
+// returns the inode of the entry in slot s of the loaded directory d, and
+// notes where its entry is
+static incore *slot_inode(incore *d, unsigned int s) {
+  incore *ic = iget(slot_entry(d->node, s)->ino);
+  if (ic) {
+    ic->dir = d->ino;
+    ic->slot = s;
+  }
+  return ic;
+}
+
+// returns the inode of the first len characters of path, walking it from
+// the root through the loaded directories. Returns -ENOENT if some part of
+// it does not exist, -ENOTDIR if some part is not a directory.
+static int walk(const char *path, size_t len) {
+  const char *end = path + len;
+  incore *d = iget(ROOT_INO);
+  while (path < end && d) {
+    if (*path == '/') {
+      path++;
+      continue;
+    }
+    const char *name = path;
+    while (path < end && *path != '/')
+      path++;
+    dir_node *n = load_dir(d);
+    if (!n)
+      return S_ISDIR(d->in.mode) ? -EIO : -ENOTDIR;
+    int s = lookup(n, name, path - name);
+    if (s < 0)
+      return -ENOENT;
+    d = slot_inode(d, s);
+  }
+  return d ? d->ino : -EIO;
+}
+
+// this function finds the inode of the given file (path), walking the
+// directories from the root. The return values are as follows:
+// if >0 the return value is the inode of the file, to use with get_inode
+// and the file_* functions
+// if <0 the entry could not be found: -ENOENT, or -ENOTDIR if a directory
+// on the way is a file
+// Directories are read once and looked up through their hash index, so
+// this does not compare the name with every entry.
+int find_inode(const char *path) { return walk(path, strlen(path)); }
+
+// finds the directory that would hold path, and puts the last part of path
+// in *name. Returns the inode of the directory, or <0 like find_inode.
+int find_parent(const char *path, const char **name) {
+  const char *slash = strrchr(path, '/');
+  *name = slash ? slash + 1 : path;
+  return walk(path, slash ? slash - path : 0);
+}
+
+// returns the inode of the entry called name in directory dir, -ENOENT if
+// there is none, -ENOTDIR if dir is not a directory
+int find_entry(int dir, const char *name) {
+  incore *d = iget(dir);
+  dir_node *n = d ? load_dir(d) : NULL;
+  if (!n)
+    return d && S_ISDIR(d->in.mode) ? -EIO : -ENOTDIR;
+  int s = lookup(n, name, strlen(name));
+  if (s < 0)
+    return -ENOENT;
+  incore *ic = slot_inode(d, s);
+  return ic ? (int)ic->ino : -EIO;
+}
+
+// returns the directory holding the entry of directory dir, the root is its
+// own parent
+int dir_parent(int dir) {
+  incore *d = dir != ROOT_INO ? iget(dir) : NULL;
+  return d && d->dir ? (int)d->dir : ROOT_INO;
+}
+
+// adds a block of empty slots to the loaded directory d
+static int grow_dir(incore *d) {
+  dir_node *n = d->node;
+  unsigned int nblocks = n->nslots / DIR_ENTRIES_PER_BLOCK;
+  if (node_resize(n, nblocks + 1) < 0)
+    return -1;
+  if (file_resize(d->ino, nblocks + 1) < 0) {
+    file_resize(d->ino, nblocks);
+    n->nslots = nblocks * DIR_ENTRIES_PER_BLOCK;
+    return -1;
+  }
+  d->in.size_bytes = (nblocks + 1) * BLOCK_SIZE;
+  inode_dirty(d);
+  return hash_rebuild(n);
+}
+
+// returns an empty slot of the loaded directory d, which grows if it is
+// full. -1 if it cannot grow.
+static int empty_slot(incore *d) {
+  dir_node *n = d->node;
+  while (n->hint < n->nslots && !dir_entry_is_empty((*slot_entry(n, n->hint))))
+    n->hint++;
+  if (n->hint == n->nslots && grow_dir(d) < 0)
+    return -1;
+  return n->hint;
+}
+
+// takes the entry of inode ic out of its directory, leaving an empty slot
+static void clear_slot(incore *ic) {
+  dir_node *n = iget(ic->dir)->node;
+  hash_remove(n, ic->slot);
+  memset(slot_entry(n, ic->slot), 0, sizeof(dir_entry));
+  entry_dirty(n, ic->slot);
+  n->nused--;
+  if (ic->slot < n->hint)
+    n->hint = ic->slot;
+}
+
+// puts an entry for inode ic in the empty slot s of the loaded directory d,
+// under the given name
+static void fill_slot(incore *d, unsigned int s, incore *ic,
+                      const char *name) {
+  dir_node *n = d->node;
+  dir_entry *e = slot_entry(n, s);
+  strncpy(e->name, name, FS_NAME_LEN);
+  e->ino = ic->ino;
+  ic->dir = d->ino;
+  ic->slot = s;
+  n->nused++;
+  hash_insert(n, s);
+  entry_dirty(n, s);
+}
+
+// creates an entry called name in directory dir, for a new empty inode of
+// the given mode. Names longer than FS_NAME_LEN are cut. Returns the inode,
+// or -ENOTDIR, -ENOSPC. The caller sets the times, and saves it.
+int new_dir_entry(int dir, const char *name, mode_t mode) {
+  incore *d = iget(dir);
+  if (!d || !load_dir(d))
+    return -ENOTDIR;
+  int s = empty_slot(d);
+  incore *ic = s >= 0 ? alloc_inode() : NULL;
+  if (!ic)
+    return -ENOSPC;
+  ic->in.mode = mode;
+  fill_slot(d, s, ic, name);
+  return ic->ino;
+}
+
+// removes the entry of inode ino from its directory. A directory must be
+// empty. The inode and its blocks go back to the free space, once the file
+// is no longer open and the kernel has forgotten it.
+void remove_dir_entry(int ino) {
+  incore *ic = iget(ino);
+  clear_slot(ic);
+  if (ic->opens > 0 || ic->lookups > 0)
+    ic->unlinked = 1;
   else
-    return di;
-  // di contains the first empty entry in this block.
+    free_inode(ic);
+}
+
+// moves the entry of inode ino to directory dir, under the given name. Only
+// the entries change, the inode stays the same. An entry already called
+// name is removed first, it must be a file if ino is a file, an empty
+// directory if ino is a directory.
+// Returns -EINVAL if ino is a directory and dir is in it, -EISDIR, -ENOTDIR,
+// -ENOTEMPTY if the old entry cannot be replaced, -ENOTDIR or -ENOSPC if dir
+// cannot take the entry.
+int move_dir_entry(int ino, int dir, const char *name) {
+  if (ino == ROOT_INO)
+    return -EBUSY;
+  for (int p = dir; p != ROOT_INO; p = iget(p)->dir)
+    if (p == ino)
+      return -EINVAL;
+  incore *ic = iget(ino), *d = iget(dir);
+  dir_node *n = d ? load_dir(d) : NULL;
+  if (!n)
+    return -ENOTDIR;
+  int s = lookup(n, name, strlen(name));
+  if (s >= 0) {
+    incore *old = slot_inode(d, s);
+    if (old == ic)
+      return 0;
+    if (!old)
+      return -EIO;
+    int isdir = S_ISDIR(ic->in.mode);
+    if (S_ISDIR(old->in.mode)) {
+      if (!isdir)
+        return -EISDIR;
+      if (!dir_is_empty(old->ino))
+        return -ENOTEMPTY;
+    } else if (isdir) {
+      return -ENOTDIR;
+    }
+    remove_dir_entry(old->ino);
+  }
+  if (ic->dir == dir) { // same directory, just a new name
+    hash_remove(n, ic->slot);
+    strncpy(slot_entry(n, ic->slot)->name, name, FS_NAME_LEN);
+    hash_insert(n, ic->slot);
+    entry_dirty(n, ic->slot);
+    return 0;
+  }
+  s = empty_slot(d);
+  if (s < 0)
+    return -ENOSPC;
+  clear_slot(ic);
+  fill_slot(d, s, ic, name);
+  return 0;
 }
 
-// assuming the latest block is a directory, it returns a pointer to entry i
-dir_entry *index2dir_entry(unsigned short i) { return &bdir.directory[i]; }
+// returns the first entry of directory dir at or after slot *slot, and puts
+// its slot in *slot. Returns NULL when there are no more.
+const dir_entry *next_dir_entry(int dir, unsigned int *slot) {
+  incore *d = iget(dir);
+  dir_node *n = d ? load_dir(d) : NULL;
+  if (!n)
+    return NULL;
+  while (*slot < n->nslots && dir_entry_is_empty((*slot_entry(n, *slot))))
+    (*slot)++;
+  return *slot < n->nslots ? slot_entry(n, *slot) : NULL;
+}
+
+// returns 1 if directory dir has no entries
+int dir_is_empty(int dir) {
+  incore *d = iget(dir);
+  dir_node *n = d ? load_dir(d) : NULL;
+  return n && n->nused == 0;
+}
+
+// returns inode ino, NULL if it is free or cannot be read. It stays at the
+// same place in memory while the inode exists.
+inode *get_inode(int ino) {
+  incore *ic = ino > ITABLE_INO ? iget(ino) : NULL;
+  return ic && ic->in.mode ? &ic->in : NULL;
+}
+
+// marks inode ino as changed in the memory, it gets back on the disk at the
+// next flush. The inode must be locked for writing (or new, or fs_lock
+// held for a directory).
+void save_inode(int ino) {
+  incore *ic = ifind(ino);
+  if (ic)
+    inode_dirty(ic);
+}
+
+// notes that the file of inode ino is open, so it is kept until it is
+// released even if its entry is removed
+void open_inode(int ino) {
+  incore *ic = iget(ino);
+  if (ic)
+    ic->opens++;
+}
+
+// frees inode ic if its entry was removed and nothing refers to it anymore
+static void put_inode(incore *ic) {
+  if (ic->unlinked && ic->opens == 0 && ic->lookups == 0) {
+    free_inode(ic);
+    flush_if_due();
+  }
+}
 
-// writes latest block to disk - something changed it in the memory
-void save_directory() { writeBlock(ROOTDIR_BID, bdir.bytes); }
+// closes a handle to the file of inode ino. The last one frees the file if
+// its entry was removed while it was open.
+void release_inode(int ino) {
+  incore *ic = iget(ino);
+  if (!ic || ic->opens == 0)
+    return;
+  ic->opens--;
+  put_inode(ic);
+}
+
+// notes that the kernel got inode ino from a lookup (or a create), and
+// keeps it until the kernel forgets it
+void lookup_inode(int ino) {
+  incore *ic = iget(ino);
+  if (ic)
+    ic->lookups++;
+}
+
+// drops n of the lookups of inode ino. The last one frees the file if its
+// entry was removed meanwhile.
+void forget_inode(int ino, unsigned long n) {
+  incore *ic = iget(ino);
+  if (!ic)
+    return;
+  ic->lookups -= min(n, ic->lookups);
+  put_inode(ic);
+}
+
+// locks the directories and the inode table, for the functions working
+// with entries
+void lock_fs() { pthread_mutex_lock(&fs_lock); }
+
+void unlock_fs() { pthread_mutex_unlock(&fs_lock); }
+
+// locks the file of inode ino, for reading (shared) or writing (exclusive).
+// Returns it, or NULL if it is free.
+inode *lock_inode(int ino, int write) {
+  incore *ic = ifind(ino);
+  if (!ic && ino > ITABLE_INO) {
+    pthread_mutex_lock(&fs_lock);
+    ic = iget(ino);
+    pthread_mutex_unlock(&fs_lock);
+  }
+  if (!ic)
+    return NULL;
+  if (write)
+    pthread_rwlock_wrlock(&ic->lock);
+  else
+    pthread_rwlock_rdlock(&ic->lock);
+  if (!ic->in.mode) {
+    pthread_rwlock_unlock(&ic->lock);
+    return NULL;
+  }
+  return &ic->in;
+}
+
+void unlock_inode(int ino) {
+  incore *ic = ifind(ino);
+  if (ic)
+    pthread_rwlock_unlock(&ic->lock);
+}
+
+// returns a copy of the superblock, with the free counts up to date. The
+// blocks reserved for delayed blocks are not free, the freed blocks waiting
+// for a commit are (writes commit them when they run out of blocks).
+superblock get_super() {
+  pthread_mutex_lock(&fs_lock);
+  pthread_mutex_lock(&alloc_lock);
+  superblock copy = sb;
+  copy.free_blocks += freeing_blocks - reserved;
+  pthread_mutex_unlock(&alloc_lock);
+  pthread_mutex_unlock(&fs_lock);
+  return copy;
+}
+
+// fills stats with the counts of what the file system did since the mount
+void get_fs_stats(struct fs_stats *stats) {
+  pthread_mutex_lock(&alloc_lock);
+  stats->blocks_allocated = blocks_allocated;
+  stats->blocks_freed = blocks_freed;
+  pthread_mutex_unlock(&alloc_lock);
+  journal_get_stats(stats);
+}
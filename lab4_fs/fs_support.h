@@ -4,6 +4,7 @@
  **/
 
 #include "rawdisk.h"
+#include <stdint.h>
 #include <sys/stat.h>
 
 /**
@@ -46,51 +47,206 @@ you flush your modifications to the disk!!
 #define __FS_SUPPORT_H__
 
 #define DISK_FILE "RAWDISK_SSFS"
-// number of blocks in the file system
-#define FS_NBLOCKS 10
-// block map block id
-#define BLKMAP_BID 0
-// root directory block id
-#define ROOTDIR_BID 1
+// default number of blocks in the file system, format_myfs can be given
+// another size
+#define FS_NBLOCKS 2048
+// superblock block id, the rest of the layout is recorded in it
+#define SUPER_BID 0
+// identifies a formatted disk, and the version of its layout
+#define FS_MAGIC 0x53534653 // "SSFS"
+#define FS_VERSION 8
 // lenght of file name in chars
 #define FS_NAME_LEN 12
 // value meaning invalid or end of file block (no more blocks)
-#define EOF_BLOCK 0xFFFF
+#define EOF_BLOCK 0xFFFFFFFF
+// number of extents kept in the directory entry itself
+#define DIR_EXTENTS 3
+// bytes of data a small file keeps in its inode, instead of its extents
+#define INLINE_SIZE 84
+// seconds dirty metadata may stay in memory before it is written back
+#define FS_FLUSH_INTERVAL 5
+// blocks written past the end of a file are only allocated once this many
+// are waiting in memory for one file, or for all of them
+#define FS_DELAY_BLOCKS 2048
+#define FS_DELAY_TOTAL 16384
+// times a write out of blocks commits the blocks freed meanwhile and tries
+// again
+#define FS_RECLAIM_RETRIES 3
+
+// the disk is laid out as: superblock, group free counts, free space
+// bitmap (one bit per block, set if the block is in use), the journal of
+// the metadata (see journal.h), then the blocks of the files and
+// directories. A group is the blocks of one bitmap block, its free count
+// lets the allocator skip full groups without reading their bitmap.
+// Files and directories are described by inodes, kept in the inode table.
+// The table is itself a file (inode ITABLE_INO, whose inode is in the
+// superblock), so it grows a block at a time when it runs out of free
+// inodes. A directory is a file made of blocks of dir_entry, each one a
+// name and the inode it refers to. A regular file of at most INLINE_SIZE
+// bytes, without blocks, keeps its data in its inode (INODE_INLINE), so
+// reading it takes no block of its own.
+typedef uint32_t block_id;
+typedef uint32_t inode_id;
+
+// a run of consecutive blocks of a file. A run starting at HOLE_BLOCK is
+// a hole: its blocks have no place on the disk and read as zeros. A run
+// with EXTENT_UNWRITTEN in its length was preallocated (fallocate) but not
+// written yet, its blocks read as zeros too.
+typedef struct {
+  block_id start;  // first block of the run
+  uint32_t length; // number of blocks in the run
+} extent;
+
+#define HOLE_BLOCK EOF_BLOCK
+#define EXTENT_UNWRITTEN 0x80000000u
+// the largest file: its logical block numbers, and the lengths of its
+// extents, stay below EXTENT_UNWRITTEN
+#define FILE_MAX_BLOCKS (EXTENT_UNWRITTEN - 1)
+#define FILE_MAX_BYTES ((off_t)FILE_MAX_BLOCKS * BLOCK_SIZE)
 
 typedef struct {
-  char name[FS_NAME_LEN];
-  // ... some stats - say mode, owner, modtime
-  mode_t mode;
   unsigned long size_bytes;
-  unsigned short first_block;
   time_t mtime;
   time_t ctime;
   time_t atime;
+  union {
+    struct {
+      extent extents[DIR_EXTENTS]; // the file's blocks, in order
+      block_id ext_block; // block holding the extents past DIR_EXTENTS
+    };
+    char data[INLINE_SIZE]; // the file's data, if INODE_INLINE
+  };
+  mode_t mode;             // 0 if the inode is free
+  inode_id next_free;      // next free inode, if this one is free
+  unsigned short nextents; // number of extents of the file
+  unsigned short flags;
+} inode;
+
+#define INODE_INLINE 1 // the data is in the inode, the file has no extents
+
+typedef struct {
+  char name[FS_NAME_LEN];
+  inode_id ino; // 0 if the entry is empty
 } dir_entry;
 
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t block_size;
+  block_id nblocks;        // blocks in the file system, metadata included
+  uint32_t free_blocks;    // free blocks in the file system
+  block_id groups_start;   // first block of the group free counts
+  uint32_t groups_blocks;  // blocks in the group free counts
+  block_id bitmap_start;   // first block of the bitmap
+  uint32_t bitmap_blocks;  // blocks in the bitmap, one per group
+  block_id journal_start;  // first block of the journal
+  uint32_t journal_blocks; // blocks in the journal
+  uint32_t ninodes;        // inodes in the inode table
+  uint32_t free_inodes;    // free inodes in the inode table
+  inode_id free_inode;     // first free inode, the rest are chained, or 0
+  inode itable;            // the inode of the inode table
+} superblock;
+
 #define DIR_ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(dir_entry))
-#define BLOCKIDS_PER_BLOCK (BLOCK_SIZE / sizeof(unsigned short))
+#define INODES_PER_BLOCK (BLOCK_SIZE / sizeof(inode))
+#define BITS_PER_BLOCK (BLOCK_SIZE * 8)
+#define GROUPS_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t))
+#define EXTENTS_PER_BLOCK (BLOCK_SIZE / sizeof(extent))
+#define FILE_MAX_EXTENTS (DIR_EXTENTS + EXTENTS_PER_BLOCK)
 
 typedef union fs_block_t {
-  char bytes[BLOCK_SIZE];                      // bytewise access
-  unsigned short blockmap[BLOCKIDS_PER_BLOCK]; // FAT16 like
+  char bytes[BLOCK_SIZE]; // bytewise access
+  superblock super;
+  unsigned char bitmap[BLOCK_SIZE];  // bit b of byte i is block 8*i+b
+  uint64_t words[BLOCK_SIZE / 8];    // the same, by little endian words
+  uint32_t counts[GROUPS_PER_BLOCK]; // free blocks of each group
   // more possibilities... ?
   dir_entry directory[DIR_ENTRIES_PER_BLOCK];
+  inode inodes[INODES_PER_BLOCK];
+  extent extents[EXTENTS_PER_BLOCK]; // extent block of a file
 } fs_block;
 
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
 // some helpers
-// Working with the directory
-#define dir_entry_is_empty(d) (d.name[0] == 0)
-int load_directory();
-int find_dir_entry(const char *path);
-int first_empty_dir_entry();
-dir_entry *index2dir_entry(unsigned short);
-void save_directory();
-
-// Working with the block map
-unsigned short *load_blockmap();
-unsigned short alloc_block();
-unsigned short free_block(unsigned short bid);
+// Keeping the superblock, block map and directories in memory while mounted
+extern superblock sb;
+int fs_mount();
+int fs_flush();
+int fs_sync();
+int fs_unmount();
+superblock get_super();
+
+// what the file system did since it was mounted, for the statistics of ssfs
+struct fs_stats {
+  unsigned long blocks_allocated;
+  unsigned long blocks_freed;     // including the ones waiting for a commit
+  unsigned long commits;          // transactions written to the journal
+  unsigned long blocks_journaled; // metadata blocks in them
+  unsigned long checkpoints;      // times the journal was emptied
+};
+void get_fs_stats(struct fs_stats *stats);
+
+// Several threads can use the file system. The functions working with the
+// inodes and the directories need lock_fs, the ones working with the
+// blocks of a file need its inode locked with lock_inode (a directory also
+// needs lock_fs). lock_fs is taken before any inode lock.
+void lock_fs();
+void unlock_fs();
+inode *lock_inode(int ino, int write);
+void unlock_inode(int ino);
+
+// Working with the inodes. They are read when first used and stay in
+// memory, so the pointer from get_inode is valid while the inode exists.
+// Inode 0 is the inode table, so it never names a file. The inode numbers
+// are the ones the kernel sees, the root is 1 for FUSE as well.
+#define ITABLE_INO 0
+#define ROOT_INO 1
+inode *get_inode(int ino);
+void save_inode(int ino);
+void open_inode(int ino);
+void release_inode(int ino);
+void lookup_inode(int ino);
+void forget_inode(int ino, unsigned long n);
+
+// Working with the directories. Every inode but the root has exactly one
+// entry, in one directory.
+#define dir_entry_is_empty(d) (d.ino == 0)
+int find_inode(const char *path);
+int find_parent(const char *path, const char **name);
+int find_entry(int dir, const char *name);
+int dir_parent(int dir);
+int new_dir_entry(int dir, const char *name, mode_t mode);
+void remove_dir_entry(int ino);
+int move_dir_entry(int ino, int dir, const char *name);
+const dir_entry *next_dir_entry(int dir, unsigned int *slot);
+int dir_is_empty(int dir);
+
+// Working with the blocks of a file. The last blocks of a file may be
+// delayed: they are kept in memory, and get allocated and written in runs
+// by file_allocate. A small file may instead have its data inline, see
+// file_keep_inline. A file may have holes, and preallocated blocks, which
+// file_block and file_map give as EOF_BLOCK: they read as zeros, and get
+// their blocks from file_fill before they are written.
+block_id file_block(int ino, unsigned int lblk);
+int file_map(int ino, unsigned int lblk, int n, int *bids);
+unsigned int file_nblocks(int ino);
+int file_resize(int ino, unsigned int nblocks);
+int file_delay(int ino, unsigned int nblocks);
+char *file_delayed(int ino, unsigned int lblk);
+int file_allocate(int ino, int force);
+int file_hole(int ino, unsigned int nblocks);
+int file_fill(int ino, off_t offset, size_t size);
+int file_prealloc(int ino, unsigned int from, unsigned int to);
+char *file_inline(int ino);
+int file_keep_inline(int ino, off_t end);
+
+// Working with the block map (the free space bitmap). Freed blocks are
+// only free once the transaction freeing them is committed.
+int block_in_use(block_id bid);
+block_id alloc_run(block_id goal, uint32_t want, uint32_t *got);
+void free_run(block_id start, uint32_t length);
+int reclaim_blocks();
 void save_blockmap();
 
 #endif // __FS_SUPPORT_H__
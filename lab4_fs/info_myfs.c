@@ -1,59 +1,876 @@
 #include "fs_support.h"
+#include "journal.h"
 #include "rawdisk.h"
+#include <endian.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
-// Used to display information about the file system
-// Could be made even more detailed, by marking accessible blocks - and
-// detecting the missing ones this way.
+// Used to display information about the file system, and to check that it
+// is consistent: every block in use belongs to one file (or to the
+// metadata), the bitmap and the free counts agree with that, every inode
+// in use is reached from the root by exactly one entry, and the free
+// inodes are all chained. With -r, what is wrong gets repaired.
+// Usage: info_myfs [-r] [-q] [threads]
+// -q leaves out the listing of the files. The inodes, the directories and
+// the bitmap are checked by several threads, one per CPU by default.
+// Exits with 0 if the file system is consistent, 1 if it was repaired and
+// 4 if problems are left.
 
-int main(int argc, char *argv[]) {
-  if (openDisk(DISK_FILE, BLOCK_SIZE * FS_NBLOCKS) < 0) {
-    perror("open disk failure");
+// the superblock, the extents of the inode table and the table itself
+static superblock super;
+static extent itable[FILE_MAX_EXTENTS];
+static unsigned short itable_extents;
+static block_id *itable_bids; // the block of each INODES_PER_BLOCK inodes
+static uint32_t itable_blocks;
+static inode *inodes;
+static unsigned char *itable_dirty; // table blocks changed by a repair
+// the blocks before this one are the metadata
+static block_id data_start;
+
+// Each thread takes chunks of the inodes (or of the groups) in turn and
+// marks what it finds in bitmaps shared by all, with atomic operations.
+// owned has a bit per block set for the blocks of some file, shared for
+// those of more than one (cross-linked).
+static uint64_t *owned, *shared;
+static uint32_t *refs;       // entries referring to each inode
+static inode_id *parent;     // a directory holding one of those entries
+static unsigned char *flags; // what was found about each inode
+#define BAD_EXTENTS 1        // an extent is not in the data blocks
+#define CROSSLINKED 2        // some block also belongs to another file
+#define REACHED 4            // found from the root (by a repair, a listing)
+
+// what the check found, counted by all the threads
+static struct {
+  uint64_t usedblks;     // blocks of the files, extent blocks included
+  uint64_t usedinodes;   // inodes in use, the inode table excluded
+  uint64_t sharedblks;   // blocks of more than one file
+  uint64_t crosslinked;  // files with such blocks
+  uint64_t badextents;   // files with extents out of the data blocks
+  uint64_t badentries;   // entries referring to free inodes
+  uint64_t multilinked;  // inodes with more than one entry
+  uint64_t lost;         // inodes in use not reached from the root
+  uint64_t cycles;       // directories in each other, away from the root
+  uint64_t freeblks;     // free blocks in the bitmap
+  uint64_t leaked;       // used in the bitmap, but no file has them
+  uint64_t unmarked;     // blocks of a file free in the bitmap
+  uint64_t badcounts;    // free counts (of a group, or in all) that are wrong
+  uint64_t badchain;     // problems with the chain of free inodes
+} found;
+#define COUNT(field, n) __atomic_fetch_add(&found.field, n, __ATOMIC_RELAXED)
+
+static int nthreads;
+
+// runs fn on from..to-1, a chunk at a time, with nthreads threads
+typedef void (*range_fn)(uint32_t from, uint32_t to);
+static range_fn work_fn;
+static uint32_t work_next, work_end, work_chunk;
+
+static void *worker(void *arg) {
+  for (;;) {
+    uint32_t from =
+        __atomic_fetch_add(&work_next, work_chunk, __ATOMIC_RELAXED);
+    if (from >= work_end)
+      return NULL;
+    work_fn(from, min(from + work_chunk, work_end));
+  }
+}
+
+static void parallel(range_fn fn, uint32_t from, uint32_t to,
+                     uint32_t chunk) {
+  pthread_t threads[nthreads];
+  work_fn = fn;
+  work_next = from;
+  work_end = to;
+  work_chunk = chunk;
+  int n = 1;
+  while (n < nthreads && pthread_create(&threads[n], NULL, worker, NULL) == 0)
+    n++;
+  worker(NULL);
+  while (--n > 0)
+    pthread_join(threads[n], NULL);
+}
+
+static int test_bit(const uint64_t *bits, block_id b) {
+  return (bits[b / 64] >> (b % 64)) & 1;
+}
+
+static void set_bit(uint64_t *bits, block_id b) {
+  __atomic_fetch_or(&bits[b / 64], 1ULL << (b % 64), __ATOMIC_RELAXED);
+}
+
+// marks blocks start..start+length-1 as owned, a word at a time. The ones
+// some file owned already are marked shared. Returns how many there were.
+static uint32_t claim(block_id start, uint32_t length) {
+  uint32_t dups = 0;
+  for (block_id b = start, end = start + length; b < end;) {
+    unsigned int n = min(64 - b % 64, end - b);
+    uint64_t mask = (n == 64 ? ~0ULL : ((1ULL << n) - 1)) << (b % 64);
+    uint64_t old = __atomic_fetch_or(&owned[b / 64], mask, __ATOMIC_RELAXED);
+    if (old & mask) {
+      __atomic_fetch_or(&shared[b / 64], old & mask, __ATOMIC_RELAXED);
+      dups += __builtin_popcountll(old & mask);
+    }
+    b += n;
+  }
+  return dups;
+}
+
+// returns 1 if some of blocks start..start+length-1 are shared
+static int any_shared(block_id start, uint32_t length) {
+  for (block_id b = start; b < start + length; b++)
+    if (test_bit(shared, b))
+      return 1;
+  return 0;
+}
+
+// returns 1 if the length blocks from start are data blocks
+static int in_data(block_id start, uint32_t length) {
+  return start >= data_start && start < super.nblocks &&
+         length <= super.nblocks - start;
+}
+
+// returns 1 if the file of inode in has an extent block that can be read
+static int has_ext_block(const inode *in) {
+  return !(in->flags & INODE_INLINE) && in->nextents > DIR_EXTENTS &&
+         in_data(in->ext_block, 1);
+}
+
+// puts the extents of the file of inode in in exts, without
+// EXTENT_UNWRITTEN. Returns how many can be trusted: those before the
+// first one out of the data blocks (or an extent block out of them), or a
+// hole or unwritten extent that is not in a regular file. *bad is set if
+// that is not all of them. An inline file has none, *bad is set if it
+// should not be inline.
+static unsigned short file_extents(const inode *in, extent *exts, int *bad) {
+  fs_block extblk;
+  if (in->flags & INODE_INLINE) {
+    *bad = !S_ISREG(in->mode) || in->size_bytes > INLINE_SIZE ||
+           in->nextents > 0;
+    return 0;
+  }
+  unsigned short n = min(in->nextents, FILE_MAX_EXTENTS);
+  *bad = in->nextents > FILE_MAX_EXTENTS;
+  if (n > DIR_EXTENTS &&
+      (!has_ext_block(in) || readBlock(in->ext_block, extblk.bytes) < 0)) {
+    n = DIR_EXTENTS;
+    *bad = 1;
+  }
+  for (unsigned short e = 0; e < n; e++) {
+    exts[e] = e < DIR_EXTENTS ? in->extents[e] : extblk.extents[e - DIR_EXTENTS];
+    int unwritten = (exts[e].length & EXTENT_UNWRITTEN) != 0;
+    exts[e].length &= ~EXTENT_UNWRITTEN;
+    int hole = exts[e].start == HOLE_BLOCK;
+    if (((hole || unwritten) && !S_ISREG(in->mode)) ||
+        (!hole && !in_data(exts[e].start, exts[e].length))) {
+      *bad = 1;
+      return e;
+    }
+  }
+  return n;
+}
+
+// reads the inode table blocks from..to-1
+static void load_itable(uint32_t from, uint32_t to) {
+  fs_block blk;
+  for (uint32_t i = from; i < to; i++) {
+    if (readBlock(itable_bids[i], blk.bytes) < 0)
+      memset(blk.bytes, 0, BLOCK_SIZE);
+    memcpy(&inodes[i * INODES_PER_BLOCK], blk.inodes, sizeof(blk.inodes));
+  }
+}
+
+// claims the blocks of the inodes from..to-1
+static void check_inodes(uint32_t from, uint32_t to) {
+  extent exts[FILE_MAX_EXTENTS];
+  for (inode_id ino = from; ino < to; ino++) {
+    inode *in = &inodes[ino];
+    if (!in->mode)
+      continue;
+    if (ino != ITABLE_INO)
+      COUNT(usedinodes, 1);
+    int bad;
+    unsigned short n = file_extents(in, exts, &bad);
+    uint32_t dups = 0, used = 0;
+    if (has_ext_block(in)) {
+      dups += claim(in->ext_block, 1);
+      used++;
+    }
+    for (unsigned short e = 0; e < n; e++) {
+      if (exts[e].start == HOLE_BLOCK)
+        continue;
+      dups += claim(exts[e].start, exts[e].length);
+      used += exts[e].length;
+    }
+    COUNT(usedblks, used);
+    COUNT(sharedblks, dups);
+    if (bad) {
+      flags[ino] |= BAD_EXTENTS;
+      COUNT(badextents, 1);
+      printf(in->flags & INODE_INLINE
+                 ? "Inode %u: inline data it cannot have\n"
+                 : "Inode %u: extents out of the data blocks\n",
+             ino);
+    }
+  }
+}
+
+// finds the files of the inodes from..to-1 with shared blocks. All the
+// blocks have been claimed by then.
+static void find_crosslinked(uint32_t from, uint32_t to) {
+  extent exts[FILE_MAX_EXTENTS];
+  for (inode_id ino = from; ino < to; ino++) {
+    inode *in = &inodes[ino];
+    if (!in->mode)
+      continue;
+    int bad;
+    unsigned short n = file_extents(in, exts, &bad);
+    int cross = has_ext_block(in) && any_shared(in->ext_block, 1);
+    for (unsigned short e = 0; e < n && !cross; e++)
+      cross = exts[e].start != HOLE_BLOCK &&
+              any_shared(exts[e].start, exts[e].length);
+    if (cross) {
+      flags[ino] |= CROSSLINKED;
+      COUNT(crosslinked, 1);
+      printf("Inode %u: blocks shared with another file\n", ino);
+    }
+  }
+}
+
+// returns 1 if entry de refers to an inode in use (other than the table)
+static int entry_valid(const dir_entry *de) {
+  return de->ino != ITABLE_INO && de->ino < super.ninodes &&
+         inodes[de->ino].mode;
+}
+
+// counts the entries of the directories among the inodes from..to-1
+static void check_dirs(uint32_t from, uint32_t to) {
+  extent exts[FILE_MAX_EXTENTS];
+  fs_block blk;
+  for (inode_id dir = from; dir < to; dir++) {
+    if (dir == ITABLE_INO || !S_ISDIR(inodes[dir].mode))
+      continue;
+    int bad;
+    unsigned short n = file_extents(&inodes[dir], exts, &bad);
+    for (unsigned short e = 0; e < n; e++) {
+      for (block_id b = 0; b < exts[e].length; b++) {
+        if (readBlock(exts[e].start + b, blk.bytes) < 0)
+          continue;
+        for (unsigned int i = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
+          dir_entry *de = &blk.directory[i];
+          if (dir_entry_is_empty((*de)))
+            continue;
+          if (!entry_valid(de)) {
+            COUNT(badentries, 1);
+            printf("Directory %u: %.*s refers to free inode %u\n", dir,
+                   FS_NAME_LEN, de->name, de->ino);
+            continue;
+          }
+          __atomic_fetch_add(&refs[de->ino], 1, __ATOMIC_RELAXED);
+          __atomic_store_n(&parent[de->ino], dir, __ATOMIC_RELAXED);
+        }
+      }
+    }
+  }
+}
+
+// returns the bitmap word w as it should be: the blocks of the files and
+// the metadata in use, as well as those past the end of the disk
+static uint64_t expected_word(uint32_t w) {
+  if ((w + 1) * 64ULL <= data_start || w * 64ULL >= super.nblocks)
+    return ~0ULL;
+  uint64_t word = owned[w];
+  if (w * 64ULL >= data_start && (w + 1) * 64ULL <= super.nblocks)
+    return word;
+  for (unsigned int b = 0; b < 64; b++) {
+    block_id bid = w * 64 + b;
+    if (bid < data_start || bid >= super.nblocks)
+      word |= 1ULL << b;
+  }
+  return word;
+}
+
+// compares the bitmap of the groups from..to-1 with the owned blocks, and
+// the free counts of the groups with the bitmap
+static void check_groups(uint32_t from, uint32_t to) {
+  fs_block blk, counts;
+  for (uint32_t g = from; g < to; g++) {
+    if (readBlock(super.bitmap_start + g, blk.bytes) < 0 ||
+        readBlock(super.groups_start + g / GROUPS_PER_BLOCK, counts.bytes) <
+            0)
+      continue;
+    uint32_t groupfree = 0, leaked = 0, unmarked = 0;
+    for (int i = 0; i < BLOCK_SIZE / 8; i++) {
+      uint64_t used = le64toh(blk.words[i]);
+      uint64_t want = expected_word(g * (BITS_PER_BLOCK / 64) + i);
+      groupfree += __builtin_popcountll(~used);
+      leaked += __builtin_popcountll(used & ~want);
+      unmarked += __builtin_popcountll(want & ~used);
+    }
+    if (groupfree != counts.counts[g % GROUPS_PER_BLOCK]) {
+      printf("Group %u: %u free blocks in the bitmap, but counted %u\n", g,
+             groupfree, counts.counts[g % GROUPS_PER_BLOCK]);
+      COUNT(badcounts, 1);
+    }
+    COUNT(freeblks, groupfree);
+    COUNT(leaked, leaked);
+    COUNT(unmarked, unmarked);
+  }
+}
+
+// finds the inodes in use that the root does not lead to, following the
+// directory each one is in up to the root. A directory whose parents lead
+// back to it is in a cycle.
+static void check_tree() {
+  // 0 not seen yet, 1 on the way up, 2 reached, 3 not reached
+  unsigned char *state = calloc(super.ninodes, 1);
+  inode_id *path = malloc(super.ninodes * sizeof(inode_id));
+  if (!state || !path) {
+    free(state);
+    free(path);
+    return;
+  }
+  state[ROOT_INO] = 2;
+  if (!S_ISDIR(inodes[ROOT_INO].mode))
+    printf("The root is not a directory!\n");
+  for (inode_id ino = ROOT_INO; ino < super.ninodes; ino++) {
+    if (!inodes[ino].mode)
+      continue;
+    if (refs[ino] > 1 || (ino == ROOT_INO && refs[ino])) {
+      COUNT(multilinked, 1);
+      printf("Inode %u: %u entries refer to it\n", ino, refs[ino]);
+    }
+    uint32_t n = 0;
+    inode_id up = ino;
+    while (state[up] == 0 && refs[up]) {
+      state[up] = 1;
+      path[n++] = up;
+      up = parent[up];
+    }
+    unsigned char reached = state[up] == 2 ? 2 : 3;
+    if (state[up] == 1) {
+      COUNT(cycles, 1);
+      printf("Directory %u: in a cycle of directories\n", up);
+    }
+    while (n > 0)
+      state[path[--n]] = reached;
+    if (state[ino] == 0)
+      state[ino] = 3;
+    if (state[ino] == 3) {
+      COUNT(lost, 1);
+      printf("Inode %u: not reached from the root\n", ino);
+    }
+  }
+  free(state);
+  free(path);
+}
+
+// follows the chain of free inodes. Returns how long it is, and counts
+// what is wrong with it.
+static uint32_t check_chain() {
+  uint32_t freeinodes = 0, nfree = 0;
+  unsigned char *seen = calloc(super.ninodes, 1);
+  for (inode_id ino = super.free_inode; ino && seen; freeinodes++) {
+    if (ino <= ROOT_INO || ino >= super.ninodes || inodes[ino].mode ||
+        seen[ino]) {
+      printf("Free inode %u is not free!\n", ino);
+      COUNT(badchain, 1);
+      break;
+    }
+    seen[ino] = 1;
+    ino = inodes[ino].next_free;
+  }
+  free(seen);
+  for (inode_id ino = ROOT_INO + 1; ino < super.ninodes; ino++)
+    nfree += !inodes[ino].mode;
+  if (freeinodes != super.free_inodes || freeinodes != nfree) {
+    printf("Free inodes: %u in the chain, %u free, but counted %u\n",
+           freeinodes, nfree, super.free_inodes);
+    COUNT(badchain, 1);
+  }
+  return freeinodes;
+}
+
+// reads the superblock and the inode table, and sets up the bitmaps of the
+// check. Returns -1 if they cannot be read.
+static int load() {
+  fs_block blk;
+  if (readBlock(SUPER_BID, blk.bytes) < 0)
+    return -1;
+  super = blk.super;
+  if (super.magic != FS_MAGIC || super.version != FS_VERSION ||
+      super.block_size != BLOCK_SIZE) {
+    printf("Not a formatted disk, run format_myfs first.\n");
     return -1;
   }
+  data_start = super.journal_start + super.journal_blocks;
+  int bad;
+  itable_extents = file_extents(&super.itable, itable, &bad);
+  itable_blocks = 0;
+  for (unsigned short e = 0; e < itable_extents; e++)
+    itable_blocks += itable[e].length;
+  if (bad || itable_blocks * INODES_PER_BLOCK < super.ninodes ||
+      super.ninodes <= ROOT_INO) {
+    printf("The inode table is damaged, cannot check the files.\n");
+    return -1;
+  }
+  size_t words = (super.nblocks + 63) / 64;
+  itable_bids = malloc(itable_blocks * sizeof(block_id));
+  itable_dirty = calloc(itable_blocks, 1);
+  inodes = malloc((size_t)itable_blocks * INODES_PER_BLOCK * sizeof(inode));
+  owned = calloc(words, sizeof(uint64_t));
+  shared = calloc(words, sizeof(uint64_t));
+  refs = calloc(super.ninodes, sizeof(uint32_t));
+  parent = calloc(super.ninodes, sizeof(inode_id));
+  flags = calloc(super.ninodes, 1);
+  if (!itable_bids || !itable_dirty || !inodes || !owned || !shared ||
+      !refs || !parent || !flags) {
+    printf("Out of memory\n");
+    return -1;
+  }
+  uint32_t i = 0;
+  for (unsigned short e = 0; e < itable_extents; e++)
+    for (block_id b = 0; b < itable[e].length; b++)
+      itable_bids[i++] = itable[e].start + b;
+  parallel(load_itable, 0, itable_blocks, 64);
+  // inode 0 of the table is the table itself, whose inode is elsewhere
+  inodes[ITABLE_INO] = super.itable;
+  return 0;
+}
 
-  // first display the block map
-  fs_block blkmap;
-  readBlock(BLKMAP_BID, blkmap.blockmap);
-  // display list
-  for (unsigned short i = 0; i < FS_NBLOCKS; i++) {
-    if (i % 10)
-      printf("\n");
-    printf("%i:%u ", i, blkmap.blockmap[i]);
+static void unload() {
+  free(itable_bids);
+  free(itable_dirty);
+  free(inodes);
+  free(owned);
+  free(shared);
+  free(refs);
+  free(parent);
+  free(flags);
+  itable_bids = NULL;
+  itable_dirty = NULL;
+  inodes = NULL;
+  owned = shared = NULL;
+  refs = parent = NULL;
+  flags = NULL;
+}
+
+// checks the file system, returns the number of problems found
+static uint64_t check() {
+  memset(&found, 0, sizeof(found));
+  parallel(check_inodes, 0, super.ninodes, 256);
+  if (found.sharedblks)
+    parallel(find_crosslinked, 0, super.ninodes, 256);
+  parallel(check_dirs, 0, super.ninodes, 16);
+  check_tree();
+  parallel(check_groups, 0, super.bitmap_blocks, 1);
+  check_chain();
+  if (found.freeblks != super.free_blocks) {
+    printf("Free blocks: %lu in the bitmap, but counted %u\n",
+           (unsigned long)found.freeblks, super.free_blocks);
+    found.badcounts++;
   }
+  return found.sharedblks + found.crosslinked + found.badextents +
+         found.badentries + found.multilinked + found.lost + found.cycles +
+         found.leaked + found.unmarked + found.badcounts + found.badchain;
+}
+
+// displays the entry name of inode ino and its extents, and the entries
+// under it if it is a directory
+static void show_entry(const char *name, inode_id ino, int depth) {
+  inode *in = &inodes[ino];
+  extent exts[FILE_MAX_EXTENTS];
+  int bad;
+  unsigned short n = file_extents(in, exts, &bad);
+  printf("%*s%.*s%s inode:%u extents:%u", 2 * depth, "", FS_NAME_LEN, name,
+         S_ISDIR(in->mode) && depth ? "/" : "", ino, n);
+  for (unsigned short e = 0; e < n; e++)
+    if (exts[e].start == HOLE_BLOCK)
+      printf(" hole+%u", exts[e].length);
+    else
+      printf(" %u+%u", exts[e].start, exts[e].length);
+  if (in->flags & INODE_INLINE)
+    printf(" inline");
   printf("\n");
-  // let's get some statistics:
-  unsigned short usedblks = 0;
-  unsigned short freeblks = 0;
-  unsigned short crtfb = blkmap.blockmap[0];
-  while (crtfb != 0) {
-    crtfb = blkmap.blockmap[crtfb];
-    freeblks++;
-  }
-
-  fs_block blkdir;
-  // display the directory
-  readBlock(ROOTDIR_BID, blkdir.directory);
-  for (unsigned short i = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
-    if (!dir_entry_is_empty(blkdir.directory[i])) {
-      printf("%u -- %.20s starts:%u\n", i, blkdir.directory[i].name,
-             blkdir.directory[i].first_block);
-      // let's count the blocks used in this file
-      crtfb = blkdir.directory[i].first_block;
-      while (crtfb != EOF_BLOCK) {
-        crtfb = blkmap.blockmap[crtfb];
-        usedblks++;
+  if (!S_ISDIR(in->mode) || (flags[ino] & REACHED))
+    return;
+  flags[ino] |= REACHED; // listed once, even if it is in a cycle
+  int empty = 0;
+  for (unsigned short e = 0; e < n; e++) {
+    for (block_id b = 0; b < exts[e].length; b++) {
+      fs_block blkdir;
+      readBlock(exts[e].start + b, blkdir.directory);
+      for (unsigned int i = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
+        dir_entry *de = &blkdir.directory[i];
+        if (dir_entry_is_empty((*de)))
+          empty++;
+        else if (entry_valid(de))
+          show_entry(de->name, de->ino, depth + 1);
       }
-    } else {
-      printf("%u -- empty entry\n", i);
     }
   }
-  printf("Free blocks accounted for: %u\n", freeblks);
-  printf("Used blocks accounted for: %u\n", usedblks);
-  printf("Using 1 block for free map, 1 block for directory.\n");
-  printf("Missing blocks: %u\n", FS_NBLOCKS - freeblks - usedblks - 2);
+  if (empty)
+    printf("%*s(%d empty entries)\n", 2 * depth + 2, "", empty);
+}
 
+static void inode_dirty(inode_id ino) {
+  itable_dirty[ino / INODES_PER_BLOCK] = 1;
+}
+
+// cuts the file of inode ino to its first n extents, exts (as from
+// file_extents, the unwritten ones keep their mark). Bad inline data is
+// dropped.
+static void cut_file(inode_id ino, extent *exts, unsigned short n) {
+  inode *in = &inodes[ino];
+  unsigned long nblocks = 0;
+  fs_block extblk;
+  if (in->flags & INODE_INLINE) {
+    in->flags &= ~INODE_INLINE;
+    memset(in->data, 0, INLINE_SIZE);
+  }
+  if (n > DIR_EXTENTS && readBlock(in->ext_block, extblk.bytes) < 0)
+    memset(extblk.bytes, 0, BLOCK_SIZE);
+  for (unsigned short e = 0; e < n; e++) {
+    extent *x = e < DIR_EXTENTS ? &in->extents[e]
+                                : &extblk.extents[e - DIR_EXTENTS];
+    nblocks += exts[e].length;
+    x->length = exts[e].length | (x->length & EXTENT_UNWRITTEN);
+    x->start = exts[e].start;
+  }
+  if (n > DIR_EXTENTS) {
+    memset(extblk.extents + (n - DIR_EXTENTS), 0,
+           BLOCK_SIZE - (n - DIR_EXTENTS) * sizeof(extent));
+    writeBlock(in->ext_block, extblk.bytes);
+  } else {
+    in->ext_block = EOF_BLOCK;
+  }
+  in->nextents = n;
+  in->size_bytes = min(in->size_bytes, nblocks * BLOCK_SIZE);
+  inode_dirty(ino);
+  printf("Inode %u: cut to %lu block(s)\n", ino, nblocks);
+}
+
+// cuts the files with extents out of the data blocks before them, and the
+// files with shared blocks before the first one a file with a lower
+// number already has. The inode table and the root come first, so they
+// keep theirs.
+static void repair_files() {
+  size_t words = (super.nblocks + 63) / 64;
+  uint64_t *kept = calloc(words, sizeof(uint64_t));
+  extent exts[FILE_MAX_EXTENTS];
+  for (inode_id ino = ITABLE_INO; kept && ino < super.ninodes; ino++) {
+    if (!(flags[ino] & (BAD_EXTENTS | CROSSLINKED)) || !inodes[ino].mode)
+      continue;
+    int bad;
+    unsigned short n = file_extents(&inodes[ino], exts, &bad);
+    int cut = bad;
+    block_id ext = inodes[ino].ext_block;
+    if (has_ext_block(&inodes[ino]) && test_bit(shared, ext)) {
+      if (test_bit(kept, ext)) {
+        n = min(n, DIR_EXTENTS);
+        cut = 1;
+      } else {
+        set_bit(kept, ext);
+      }
+    }
+    for (unsigned short e = 0; e < n; e++) {
+      if (exts[e].start == HOLE_BLOCK)
+        continue;
+      for (block_id b = exts[e].start; b < exts[e].start + exts[e].length;
+           b++) {
+        if (!test_bit(shared, b))
+          continue;
+        if (!test_bit(kept, b)) {
+          set_bit(kept, b);
+          continue;
+        }
+        exts[e].length = b - exts[e].start;
+        n = e + (exts[e].length > 0);
+        cut = 1;
+        break;
+      }
+    }
+    if (!cut)
+      continue;
+    if (ino == ITABLE_INO)
+      printf("Cannot repair the inode table\n");
+    else
+      cut_file(ino, exts, n);
+  }
+  free(kept);
+}
+
+// goes through the directories from dir down, marking the inodes found as
+// reached. Entries to free inodes, and those to inodes already reached (a
+// second entry, or a cycle), are removed.
+static void reach(inode_id dir) {
+  inode_id *queue = malloc(super.ninodes * sizeof(inode_id));
+  uint32_t head = 0, tail = 0;
+  extent exts[FILE_MAX_EXTENTS];
+  fs_block blk;
+  flags[dir] |= REACHED;
+  if (queue)
+    queue[tail++] = dir;
+  while (head < tail) {
+    dir = queue[head++];
+    int bad;
+    unsigned short n = file_extents(&inodes[dir], exts, &bad);
+    for (unsigned short e = 0; e < n; e++) {
+      for (block_id b = exts[e].start; b < exts[e].start + exts[e].length;
+           b++) {
+        int changed = 0;
+        if (readBlock(b, blk.bytes) < 0)
+          continue;
+        for (unsigned int i = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
+          dir_entry *de = &blk.directory[i];
+          if (dir_entry_is_empty((*de)))
+            continue;
+          if (!entry_valid(de) || (flags[de->ino] & REACHED)) {
+            printf("Directory %u: removed %.*s (inode %u)\n", dir,
+                   FS_NAME_LEN, de->name, de->ino);
+            memset(de, 0, sizeof(*de));
+            changed = 1;
+            continue;
+          }
+          flags[de->ino] |= REACHED;
+          if (S_ISDIR(inodes[de->ino].mode))
+            queue[tail++] = de->ino;
+        }
+        if (changed)
+          writeBlock(b, blk.bytes);
+      }
+    }
+  }
+  free(queue);
+}
+
+// returns 1 if the root has an entry named name, 0 if not
+static int root_has(const char *name) {
+  extent exts[FILE_MAX_EXTENTS];
+  fs_block blk;
+  int bad;
+  unsigned short n = file_extents(&inodes[ROOT_INO], exts, &bad);
+  for (unsigned short e = 0; e < n; e++) {
+    for (block_id b = exts[e].start; b < exts[e].start + exts[e].length;
+         b++) {
+      if (readBlock(b, blk.bytes) < 0)
+        continue;
+      for (unsigned int i = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
+        dir_entry *de = &blk.directory[i];
+        if (!dir_entry_is_empty((*de)) &&
+            !strncmp(de->name, name, FS_NAME_LEN))
+          return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+// puts an entry for inode ino in an empty slot of the root, named after it:
+// #N, with N its number in base 36, or #N.K if an entry has that name
+// already. The names always fit in FS_NAME_LEN, and those of two inodes
+// never clash. Returns -1 if the root is full, or has all the names tried.
+static int reconnect(inode_id ino) {
+  static const char digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+  extent exts[FILE_MAX_EXTENTS];
+  fs_block blk;
+  char num[8], name[FS_NAME_LEN + 1];
+  int bad, k, len = 0, pos = sizeof(num) - 1;
+  num[pos] = '\0';
+  for (inode_id i = ino; pos == sizeof(num) - 1 || i > 0; i /= 36)
+    num[--pos] = digits[i % 36];
+  for (k = 0; k < 36; k++) {
+    if (k == 0)
+      len = snprintf(name, sizeof(name), "#%s", num + pos);
+    else
+      len = snprintf(name, sizeof(name), "#%s.%c", num + pos, digits[k]);
+    if (len > FS_NAME_LEN)
+      return -1;
+    if (!root_has(name))
+      break;
+  }
+  if (k == 36)
+    return -1;
+  unsigned short n = file_extents(&inodes[ROOT_INO], exts, &bad);
+  for (unsigned short e = 0; e < n; e++) {
+    for (block_id b = exts[e].start; b < exts[e].start + exts[e].length;
+         b++) {
+      if (readBlock(b, blk.bytes) < 0)
+        continue;
+      for (unsigned int i = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
+        dir_entry *de = &blk.directory[i];
+        if (!dir_entry_is_empty((*de)))
+          continue;
+        memset(de->name, 0, FS_NAME_LEN);
+        memcpy(de->name, name, len);
+        de->ino = ino;
+        writeBlock(b, blk.bytes);
+        printf("Inode %u: put in the root as %.*s\n", ino, FS_NAME_LEN,
+               de->name);
+        return 0;
+      }
+    }
+  }
+  return -1;
+}
+
+// repairs what the check found, then writes back the inode table, the
+// bitmap, the group free counts and the superblock as they should be
+static void repair_fs() {
+  fs_block blk;
+  repair_files();
+  // the entries, from the root. What it does not reach goes in the root,
+  // the directories first, so what is in them is not put there as well.
+  // Without room there, it stays allocated and is found again next time.
+  reach(ROOT_INO);
+  for (int dirs = 1; dirs >= 0; dirs--) {
+    for (inode_id ino = ROOT_INO + 1; ino < super.ninodes; ino++) {
+      if (!inodes[ino].mode || (flags[ino] & REACHED) ||
+          !S_ISDIR(inodes[ino].mode) != !dirs)
+        continue;
+      // left out of the root, a directory keeps what is in it
+      if (reconnect(ino) < 0)
+        printf("Inode %u: no room for it in the root, left as it is\n",
+               ino);
+      if (dirs)
+        reach(ino);
+      flags[ino] |= REACHED;
+    }
+  }
+  // the free inodes, chained in order
+  super.free_inode = 0;
+  super.free_inodes = 0;
+  for (inode_id ino = super.ninodes - 1; ino > ROOT_INO; ino--) {
+    if (inodes[ino].mode)
+      continue;
+    if (inodes[ino].next_free != super.free_inode) {
+      inodes[ino].next_free = super.free_inode;
+      inode_dirty(ino);
+    }
+    super.free_inode = ino;
+    super.free_inodes++;
+  }
+  for (uint32_t i = 0; i < itable_blocks; i++) {
+    if (!itable_dirty[i])
+      continue;
+    memset(blk.bytes, 0, BLOCK_SIZE);
+    memcpy(blk.inodes, &inodes[i * INODES_PER_BLOCK], sizeof(blk.inodes));
+    writeBlock(itable_bids[i], blk.bytes);
+  }
+  // the blocks of the files left, as the bitmap has them
+  memset(owned, 0, (super.nblocks + 63) / 64 * sizeof(uint64_t));
+  parallel(check_inodes, 0, super.ninodes, 256);
+  fs_block counts;
+  memset(counts.bytes, 0, BLOCK_SIZE);
+  super.free_blocks = 0;
+  for (uint32_t g = 0; g < super.bitmap_blocks; g++) {
+    uint32_t groupfree = 0;
+    for (int i = 0; i < BLOCK_SIZE / 8; i++) {
+      blk.words[i] = htole64(expected_word(g * (BITS_PER_BLOCK / 64) + i));
+      groupfree += __builtin_popcountll(~blk.words[i]);
+    }
+    writeBlock(super.bitmap_start + g, blk.bytes);
+    counts.counts[g % GROUPS_PER_BLOCK] = groupfree;
+    super.free_blocks += groupfree;
+    if ((g + 1) % GROUPS_PER_BLOCK == 0 || g + 1 == super.bitmap_blocks) {
+      writeBlock(super.groups_start + g / GROUPS_PER_BLOCK, counts.bytes);
+      memset(counts.bytes, 0, BLOCK_SIZE);
+    }
+  }
+  super.itable = inodes[ITABLE_INO];
+  memset(blk.bytes, 0, BLOCK_SIZE);
+  blk.super = super;
+  writeBlock(SUPER_BID, blk.bytes);
+  syncDisk();
+}
+
+int main(int argc, char *argv[]) {
+  int repair = 0, quiet = 0;
+  nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-r"))
+      repair = 1;
+    else if (!strcmp(argv[i], "-q"))
+      quiet = 1;
+    else if (atoi(argv[i]) > 0)
+      nthreads = atoi(argv[i]);
+    else {
+      printf("usage: %s [-r] [-q] [threads]\n", argv[0]);
+      return -1;
+    }
+  }
+  if (nthreads < 1)
+    nthreads = 1;
+  // the threads read all over the disk, straight from the file
+  setCacheSize(0);
+  if (openDisk(DISK_FILE, 0) < 0) {
+    perror("open disk failure");
+    return -1;
+  }
+
+  // first the superblock, to know where the rest is
+  if (load() < 0) {
+    closeDisk();
+    return 4;
+  }
+  printf("%u blocks of %u bytes: superblock %u, group counts %u+%u, bitmap "
+         "%u+%u\n",
+         super.nblocks, super.block_size, SUPER_BID, super.groups_start,
+         super.groups_blocks, super.bitmap_start, super.bitmap_blocks);
+  printf("Free blocks (superblock): %u\n", super.free_blocks);
+  // what the disk shows is what the next mount sees once it has replayed
+  // these
+  int pending = journal_pending(super.journal_start, super.journal_blocks);
+  printf("Journal %u+%u: %d transaction(s) to replay\n", super.journal_start,
+         super.journal_blocks, pending);
+  printf("Inode table: %u inodes, %u free (superblock), %u block(s)\n",
+         super.ninodes, super.free_inodes, itable_blocks);
+  printf("Checking with %d thread(s)\n", nthreads);
+
+  uint64_t problems = check();
+  if (!quiet) {
+    show_entry("/", ROOT_INO, 0);
+    for (inode_id ino = 0; ino < super.ninodes; ino++)
+      flags[ino] &= ~REACHED;
+  }
+  printf("Cross-linked blocks: %lu, in %lu file(s)\n",
+         (unsigned long)found.sharedblks, (unsigned long)found.crosslinked);
+  printf("Files with bad extents: %lu\n", (unsigned long)found.badextents);
+  printf("Entries to free inodes: %lu, inodes with several entries: %lu\n",
+         (unsigned long)found.badentries, (unsigned long)found.multilinked);
+  printf("Directory cycles: %lu\n", (unsigned long)found.cycles);
+  printf("Lost inodes: %lu\n", (unsigned long)found.lost);
+  printf("Leaked blocks: %lu, blocks in use marked free: %lu\n",
+         (unsigned long)found.leaked, (unsigned long)found.unmarked);
+
+  block_id metablks = data_start;
+  printf("Free blocks accounted for: %lu\n", (unsigned long)found.freeblks);
+  printf("Used blocks accounted for: %lu\n", (unsigned long)found.usedblks);
+  printf("Using 1 block for the superblock, %u for the group counts, %u for "
+         "the bitmap, %u for the journal.\n",
+         super.groups_blocks, super.bitmap_blocks, super.journal_blocks);
+  printf("Missing blocks: %d\n",
+         (int)(super.nblocks - found.freeblks - found.usedblks - metablks));
+
+  int res = problems ? 4 : 0;
+  if (problems && repair && pending > 0) {
+    printf("Mount the file system first, to replay the journal.\n");
+  } else if (problems && repair) {
+    printf("Repairing %lu problem(s)\n", (unsigned long)problems);
+    repair_fs();
+    unload();
+    if (load() == 0) {
+      problems = check();
+      printf("After the repair: %lu problem(s)\n", (unsigned long)problems);
+      res = problems ? 4 : 1;
+    }
+  } else if (problems) {
+    printf("%lu problem(s), run with -r to repair them\n",
+           (unsigned long)problems);
+  }
+  unload();
   closeDisk();
-  // should also write 0 in all other blocks to make it secure
+  return res;
 }
@@ -0,0 +1,389 @@
+#include "journal.h"
+#include "rawdisk.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// the blocks of a transaction, with a hash index from their ids to where
+// they are, so a block changed twice is only kept once
+typedef struct {
+  block_id *bids;
+  fs_block *blocks;
+  unsigned int count;
+  unsigned int max;    // room in bids and blocks
+  int *slots;          // index of each block, by hash, -1 if empty
+  unsigned int nslots; // power of 2, twice max
+} transaction;
+
+// where the journal is, where the next transaction goes and its number
+static block_id jstart;
+static uint32_t jblocks;
+static uint32_t head;
+static uint32_t sequence;
+// for journal_get_stats, which reads them without waiting for a commit
+static unsigned long commits, blocks_journaled, checkpoints;
+
+// the transaction collecting the changes, and the one being committed.
+// journal_lock covers both, commit_lock is held from journal_seal to the
+// end of journal_commit so there is one commit at a time.
+static transaction running;
+static transaction sealed;
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// returns the slot of block bid in the hash index of t
+static unsigned int tx_slot(transaction *t, block_id bid) {
+  unsigned int s = (bid * 2654435761u) & (t->nslots - 1);
+  while (t->slots[s] >= 0 && t->bids[t->slots[s]] != bid)
+    s = (s + 1) & (t->nslots - 1);
+  return s;
+}
+
+// returns the copy of block bid in t, or NULL if it is not there
+static fs_block *tx_find(transaction *t, block_id bid) {
+  if (t->count == 0)
+    return NULL;
+  int i = t->slots[tx_slot(t, bid)];
+  return i >= 0 ? &t->blocks[i] : NULL;
+}
+
+// makes room in t for twice as many blocks. Returns -1 if out of memory.
+static int tx_grow(transaction *t) {
+  unsigned int max = t->max ? 2 * t->max : 64;
+  block_id *bids = realloc(t->bids, max * sizeof(block_id));
+  if (bids)
+    t->bids = bids;
+  fs_block *blocks = realloc(t->blocks, max * sizeof(fs_block));
+  if (blocks)
+    t->blocks = blocks;
+  int *slots = malloc(2 * max * sizeof(int));
+  if (!bids || !blocks || !slots) {
+    free(slots);
+    return -1;
+  }
+  free(t->slots);
+  t->slots = slots;
+  t->nslots = 2 * max;
+  t->max = max;
+  memset(t->slots, 0xff, t->nslots * sizeof(int));
+  for (unsigned int i = 0; i < t->count; i++)
+    t->slots[tx_slot(t, t->bids[i])] = i;
+  return 0;
+}
+
+// puts a copy of block bid in t, replacing the one there if any
+static int tx_add(transaction *t, block_id bid, const void *block) {
+  fs_block *copy = tx_find(t, bid);
+  if (!copy) {
+    if (t->count == t->max && tx_grow(t) < 0)
+      return -1;
+    t->slots[tx_slot(t, bid)] = t->count;
+    t->bids[t->count] = bid;
+    copy = &t->blocks[t->count++];
+  }
+  memcpy(copy->bytes, block, BLOCK_SIZE);
+  return 0;
+}
+
+static void tx_clear(transaction *t) {
+  if (t->count)
+    memset(t->slots, 0xff, t->nslots * sizeof(int));
+  t->count = 0;
+}
+
+static void tx_free(transaction *t) {
+  free(t->bids);
+  free(t->blocks);
+  free(t->slots);
+  memset(t, 0, sizeof(*t));
+}
+
+// adds len bytes of data to the checksum sum (FNV-1a)
+static uint32_t checksum(uint32_t sum, const void *data, size_t len) {
+  const unsigned char *p = data;
+  for (size_t i = 0; i < len; i++)
+    sum = (sum ^ p[i]) * 16777619u;
+  return sum;
+}
+
+// writes n blocks from buf to the journal, from block pos of it. They go
+// straight to the disk file, so they do not push the metadata out of the
+// block cache.
+static int write_journal(uint32_t pos, const void *buf, uint32_t n) {
+  size_t len = (size_t)n * BLOCK_SIZE;
+  if (uncacheBlocks(jstart + pos, n, 1) < 0)
+    return -1;
+  return pwrite(diskFile(), buf, len, (off_t)(jstart + pos) * BLOCK_SIZE) ==
+                 (ssize_t)len
+             ? 0
+             : -1;
+}
+
+// syncs the disk, so the blocks already in place stay there, then lets
+// the transactions start over at the beginning of the journal
+static int checkpoint() {
+  journal_block hdr;
+  memset(hdr.bytes, 0, BLOCK_SIZE);
+  hdr.header.magic = JOURNAL_MAGIC;
+  hdr.header.sequence = sequence;
+  hdr.header.start = 1;
+  if (syncDisk() < 0 || write_journal(0, hdr.bytes, 1) < 0 || syncDisk() < 0)
+    return -1;
+  head = 1;
+  __atomic_add_fetch(&checkpoints, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+// reads the transaction with number seq at block pos of the journal into
+// t, if it was committed. Returns the block after it, or 0 if there is no
+// such transaction.
+static uint32_t read_transaction(uint32_t pos, uint32_t seq, transaction *t) {
+  journal_block rec;
+  fs_block blk;
+  uint32_t sum = 0, count = 0;
+  tx_clear(t);
+  while (pos < jblocks && readBlock(jstart + pos, rec.bytes) >= 0 &&
+         rec.record.magic == JOURNAL_MAGIC && rec.record.sequence == seq) {
+    if (rec.record.type == JOURNAL_COMMIT)
+      return rec.record.count == count && rec.record.checksum == sum ? pos + 1
+                                                                     : 0;
+    if (rec.record.type != JOURNAL_DESCRIPTOR ||
+        rec.record.count > JOURNAL_TAGS ||
+        pos + 1 + rec.record.count >= jblocks)
+      return 0;
+    sum = checksum(sum, rec.bytes, BLOCK_SIZE);
+    for (uint32_t i = 0; i < rec.record.count; i++) {
+      if (readBlock(jstart + pos + 1 + i, blk.bytes) < 0 ||
+          tx_add(t, rec.record.tags[i], blk.bytes) < 0)
+        return 0;
+      sum = checksum(sum, blk.bytes, BLOCK_SIZE);
+    }
+    count += rec.record.count;
+    pos += 1 + rec.record.count;
+  }
+  return 0;
+}
+
+// goes through the committed transactions of the journal, from the one
+// its header points at, and writes their blocks in place if apply is set.
+// Leaves head and sequence after the last one. Returns how many there
+// were, or -1 if the journal cannot be read.
+static int replay(int apply) {
+  journal_block hdr;
+  transaction t;
+  int n = 0;
+  if (readBlock(jstart, hdr.bytes) < 0 || hdr.header.magic != JOURNAL_MAGIC ||
+      hdr.header.start == 0 || hdr.header.start >= jblocks) {
+    printf("journal: no journal header at block %u\n", jstart);
+    return -1;
+  }
+  memset(&t, 0, sizeof(t));
+  head = hdr.header.start;
+  sequence = hdr.header.sequence;
+  for (uint32_t next; (next = read_transaction(head, sequence, &t)) != 0;) {
+    for (unsigned int i = 0; apply && i < t.count; i++)
+      if (writeBlock(t.bids[i], t.blocks[i].bytes) < 0)
+        n = -1;
+    if (n < 0)
+      break;
+    head = next;
+    sequence++;
+    n++;
+  }
+  tx_free(&t);
+  return n;
+}
+
+// sets up an empty journal of nblocks blocks from start
+int journal_format(block_id start, uint32_t nblocks) {
+  journal_block blk;
+  jstart = start;
+  jblocks = nblocks;
+  sequence = 1;
+  // no stale record may pass for the first transaction
+  memset(blk.bytes, 0, BLOCK_SIZE);
+  if (writeBlock(start + 1, blk.bytes) < 0)
+    return -1;
+  blk.header.magic = JOURNAL_MAGIC;
+  blk.header.sequence = sequence;
+  blk.header.start = 1;
+  return writeBlock(start, blk.bytes);
+}
+
+// opens the journal of nblocks blocks from start, replaying the committed
+// transactions. Returns how many there were, or -1.
+int journal_open(block_id start, uint32_t nblocks) {
+  jstart = start;
+  jblocks = nblocks;
+  int n = replay(1);
+  if (n < 0 || checkpoint() < 0)
+    return -1;
+  if (n > 0)
+    printf("journal: replayed %d transaction(s)\n", n);
+  return n;
+}
+
+// returns how many committed transactions the journal of nblocks blocks
+// from start has for the next mount to replay, or -1
+int journal_pending(block_id start, uint32_t nblocks) {
+  jstart = start;
+  jblocks = nblocks;
+  return replay(0);
+}
+
+// commits what is left, puts everything in place and empties the journal
+int journal_close() {
+  journal_seal();
+  int res = journal_commit(1);
+  if (checkpoint() < 0)
+    res = -1;
+  tx_free(&running);
+  tx_free(&sealed);
+  return res;
+}
+
+// puts block bid in the running transaction. It gets in place once the
+// transaction is committed.
+int journal_write(block_id bid, const void *block) {
+  pthread_mutex_lock(&journal_lock);
+  int res = tx_add(&running, bid, block);
+  pthread_mutex_unlock(&journal_lock);
+  if (res < 0)
+    printf("journal: out of memory for block %u\n", bid);
+  return res;
+}
+
+// reads block bid as the transactions not yet in place left it
+int journal_read(block_id bid, void *block) {
+  pthread_mutex_lock(&journal_lock);
+  fs_block *copy = tx_find(&running, bid);
+  if (!copy)
+    copy = tx_find(&sealed, bid);
+  if (copy)
+    memcpy(block, copy->bytes, BLOCK_SIZE);
+  pthread_mutex_unlock(&journal_lock);
+  return copy ? BLOCK_SIZE : readBlock(bid, block);
+}
+
+// returns the most blocks one transaction can hold, with its descriptors
+// and commit record in the journal after the header
+unsigned int journal_max_tx() {
+  return (jblocks - 2) * JOURNAL_TAGS / (JOURNAL_TAGS + 1);
+}
+
+// returns how many blocks the running transaction holds
+unsigned int journal_running() {
+  pthread_mutex_lock(&journal_lock);
+  unsigned int count = running.count;
+  pthread_mutex_unlock(&journal_lock);
+  return count;
+}
+
+void journal_seal() {
+  pthread_mutex_lock(&commit_lock);
+  pthread_mutex_lock(&journal_lock);
+  transaction t = sealed;
+  sealed = running;
+  running = t;
+  pthread_mutex_unlock(&journal_lock);
+}
+
+// writes the blocks of the sealed transaction to the journal as
+// transaction number sequence, then in place. The commit record goes last,
+// in a write and a sync of its own.
+static int log_blocks() {
+  unsigned int count = sealed.count;
+  unsigned int ndesc = (count + JOURNAL_TAGS - 1) / JOURNAL_TAGS;
+  uint32_t size = count + ndesc + 1, sum = 0;
+  if (head + size > jblocks && checkpoint() < 0)
+    return -1;
+  journal_block *buf = calloc(size, sizeof(journal_block));
+  if (!buf)
+    return -1;
+  // descriptors, each followed by its blocks, then the commit record
+  journal_block *rec = buf;
+  for (unsigned int i = 0; i < count; i += JOURNAL_TAGS) {
+    unsigned int n = min(count - i, JOURNAL_TAGS);
+    rec->record.magic = JOURNAL_MAGIC;
+    rec->record.type = JOURNAL_DESCRIPTOR;
+    rec->record.sequence = sequence;
+    rec->record.count = n;
+    memcpy(rec->record.tags, sealed.bids + i, n * sizeof(block_id));
+    memcpy(rec + 1, sealed.blocks + i, n * BLOCK_SIZE);
+    sum = checksum(sum, rec, (n + 1) * BLOCK_SIZE);
+    rec += n + 1;
+  }
+  rec->record.magic = JOURNAL_MAGIC;
+  rec->record.type = JOURNAL_COMMIT;
+  rec->record.sequence = sequence;
+  rec->record.count = count;
+  rec->record.checksum = sum;
+  // the file data written since the last commit reaches the disk with the
+  // blocks, before the commit record, so a replay never gives a file blocks
+  // still holding what was there before. The checksum catches torn writes.
+  int res = 0;
+  if (write_journal(head, buf, size - 1) < 0 || syncDisk() < 0 ||
+      write_journal(head + size - 1, rec, 1) < 0 || syncDisk() < 0)
+    res = -1;
+  free(buf);
+  if (res < 0)
+    return -1;
+  head += size;
+  sequence++;
+  __atomic_add_fetch(&commits, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&blocks_journaled, count, __ATOMIC_RELAXED);
+  // committed, the blocks can go in place (in the cache, the next sync or
+  // checkpoint gets them on the disk)
+  for (unsigned int i = 0; i < count; i++)
+    if (writeBlock(sealed.bids[i], sealed.blocks[i].bytes) < 0)
+      res = -1;
+  return res;
+}
+
+// puts the blocks of a sealed transaction too large for the journal in
+// place without it, after the ones before. A crash meanwhile may leave
+// them half written, so this is reported as an error.
+static int write_in_place() {
+  printf("journal: %u blocks do not fit in one transaction\n", sealed.count);
+  if (checkpoint() < 0)
+    return -1;
+  for (unsigned int i = 0; i < sealed.count; i++)
+    writeBlock(sealed.bids[i], sealed.blocks[i].bytes);
+  syncDisk();
+  return -1;
+}
+
+// forces the committed transactions in place and empties the journal, so
+// a replay does not write them again
+int journal_checkpoint() {
+  pthread_mutex_lock(&commit_lock);
+  int res = checkpoint();
+  pthread_mutex_unlock(&commit_lock);
+  return res;
+}
+
+void journal_get_stats(struct fs_stats *stats) {
+  stats->commits = __atomic_load_n(&commits, __ATOMIC_RELAXED);
+  stats->blocks_journaled =
+      __atomic_load_n(&blocks_journaled, __ATOMIC_RELAXED);
+  stats->checkpoints = __atomic_load_n(&checkpoints, __ATOMIC_RELAXED);
+}
+
+// commits the sealed transaction, as one. fs_flush keeps the transactions
+// within journal_max_tx, so they fit in the journal.
+int journal_commit(int sync) {
+  int res = 0;
+  if (sealed.count > journal_max_tx())
+    res = write_in_place();
+  else if (sealed.count > 0)
+    res = log_blocks();
+  else if (sync && syncDisk() < 0)
+    res = -1;
+  pthread_mutex_lock(&journal_lock);
+  tx_clear(&sealed);
+  pthread_mutex_unlock(&journal_lock);
+  pthread_mutex_unlock(&commit_lock);
+  return res;
+}
@@ -0,0 +1,86 @@
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include "fs_support.h"
+
+// The metadata journal, a region of the disk right after the bitmap. The
+// metadata blocks changed by the operations are not written in place
+// right away: they are collected in a transaction, which fs_flush commits
+// every few seconds (or on fsync). A commit writes all the blocks of the
+// transaction to the journal and syncs them, with the file data written
+// since the commit before, then writes and syncs a commit record, and only
+// then writes the blocks in place. Mounting replays the committed
+// transactions, so after a crash the metadata is as it was at the last
+// commit, with none of the operations after it half done. File data is not
+// journaled, but it is on the disk before the metadata giving it blocks.
+//
+// The first block of the journal is a header saying where the replay
+// starts. Then come the transactions, each one or more descriptor records
+// followed by the blocks they list, and a commit record with a checksum of
+// all of them. A transaction with a wrong sequence number or checksum, as
+// left by a crash while it was written, ends the replay.
+#define JOURNAL_MAGIC 0x4c4e524a // "JRNL"
+#define JOURNAL_DESCRIPTOR 1
+#define JOURNAL_COMMIT 2
+// blocks a descriptor record can list
+#define JOURNAL_TAGS ((BLOCK_SIZE - 5 * sizeof(uint32_t)) / sizeof(block_id))
+// format_myfs gives a 32nd of the disk to the journal, within these
+#define JOURNAL_MIN_BLOCKS 16
+#define JOURNAL_MAX_BLOCKS 8192
+// but never less than it takes for half a transaction to hold all of the
+// bitmap and group count blocks, which one operation may change (a file
+// spanning the disk removed), and this many more blocks of it
+#define JOURNAL_OP_BLOCKS 16
+
+typedef struct {
+  uint32_t magic;
+  uint32_t sequence; // number of the first transaction to replay
+  uint32_t start;    // where it is in the journal, after the header
+} journal_header;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t type;     // JOURNAL_DESCRIPTOR or JOURNAL_COMMIT
+  uint32_t sequence; // number of the transaction
+  uint32_t count;    // blocks listed, or in the whole transaction (commit)
+  uint32_t checksum; // of the descriptors and the blocks (commit)
+  block_id tags[JOURNAL_TAGS]; // where the blocks that follow go
+} journal_record;
+
+typedef union {
+  char bytes[BLOCK_SIZE];
+  journal_header header;
+  journal_record record;
+} journal_block;
+
+// Setting up the journal of nblocks blocks from start: empty when the disk
+// is formatted, replaying what was committed when it is mounted (returns
+// how many transactions), or only counting those (for info_myfs)
+int journal_format(block_id start, uint32_t nblocks);
+int journal_open(block_id start, uint32_t nblocks);
+int journal_pending(block_id start, uint32_t nblocks);
+int journal_close();
+
+// Working with the metadata blocks: journal_write adds a block to the
+// running transaction, journal_read sees the blocks not yet in place.
+int journal_write(block_id bid, const void *block);
+int journal_read(block_id bid, void *block);
+// the most blocks a transaction can hold, and how many the running one
+// holds. One larger than the journal cannot be committed, fs_flush commits
+// them well before.
+unsigned int journal_max_tx();
+unsigned int journal_running();
+
+// Committing, in two steps: journal_seal closes the running transaction
+// (waiting for the commit of the one before), while the changes it holds
+// are complete. journal_commit then writes it to the journal and in place.
+// With sync set, the disk is synced even if there was nothing to commit.
+void journal_seal();
+int journal_commit(int sync);
+// journal_checkpoint empties the journal, before blocks it may hold are
+// given to other files.
+int journal_checkpoint();
+// fills in the counts of the journal in stats
+void journal_get_stats(struct fs_stats *stats);
+
+#endif // __JOURNAL_H__
@@ -1,46 +1,971 @@
-
 #include "rawdisk.h"
+#include "uring.h"
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+/* Longest run of consecutive blocks moved by one system call */
+#define RUN_MAX_BLOCKS 256
+
 static int disk_fd = -1; /* file descriptor for the file emulating the disk */
-static int disk_bsize = -1; /* disk size in bytes */
-
-/* Open filename file as the raw disk. File size fixed at nbytes.
-   Creates a new one if it does not exist. */
-int openDisk(char *filename, int nbytes) {
-  /* attempt to open existing file */
-  disk_fd = open(filename, O_RDWR);
-  if (disk_fd < 0) {
-    /* file does not exist, create it */
-    disk_fd = open(filename, O_RDWR | O_CREAT);
-    if (disk_fd != -1) {
-      /* make sure the file is nbytes large. Just write garbage for now. */
-      disk_bsize = write(disk_fd, &disk_fd, nbytes);
+static off_t disk_bsize = -1; /* disk size in bytes */
+static char *disk_map = NULL; /* the mapped file, for the DISK_MMAP backend */
+
+/* A cached copy of one disk block. Slots are kept in a LRU list (most
+   recently used first) and in a hash table indexed by block number. */
+typedef struct cache_slot {
+  int blocknr; /* -1 if the slot holds no block */
+  int dirty;   /* the data differs from the disk file */
+  int loading; /* being read from the disk file, without the lock held */
+  struct cache_slot *prev, *next; /* LRU list */
+  struct cache_slot *hnext;       /* hash chain */
+  char data[BLOCK_SIZE];
+} cache_slot;
+
+static int cache_size = CACHE_NBLOCKS; /* slots to allocate at openDisk */
+static int cache_nslots = 0;           /* slots currently allocated */
+static cache_slot *cache_slots = NULL;
+static cache_slot **cache_hash = NULL;
+static unsigned cache_hmask = 0;
+static cache_slot *lru_first = NULL, *lru_last = NULL;
+static struct cache_stats cstats;
+
+/* The cache is shared by all threads. The lock is not held while a missing
+   block is read from the disk file, so one slow read does not hold up the
+   others: the slot is marked loading, and threads that want the same block
+   wait for cache_loaded. */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_loaded = PTHREAD_COND_INITIALIZER;
+
+/* Counters are also updated outside the lock */
+#define STAT_ADD(field, n)                                                     \
+  __atomic_add_fetch(&cstats.field, n, __ATOMIC_RELAXED)
+
+/* An asynchronous block request. Requests come from a fixed pool, so no
+   more than IO_QUEUE_DEPTH are ever in the ring. */
+typedef struct io_request {
+  int blocknr;
+  void *block;
+  int result;
+  block_callback cb;
+  void *arg;
+  struct iovec iov;
+  struct io_request *next; /* free list, or list of completed requests */
+} io_request;
+
+static int async_enabled = 1;
+static uring *ring = NULL; /* set up for the open disk, if available */
+static io_request io_pool[IO_QUEUE_DEPTH];
+static io_request *io_free = NULL;
+/* requests completed without the ring, waiting for reapBlocks */
+static io_request *io_done_first = NULL, *io_done_last = NULL;
+static int io_inflight = 0; /* requests handed to the ring */
+
+/* A run of consecutive blocks moved by one request of a batch. The
+   filesystem reads and writes several of them at once through the ring,
+   see ioRuns. */
+typedef struct {
+  int blocknr;
+  int write;
+  struct iovec *iov;
+  int iovcnt;
+  int result; /* bytes moved, or -1 */
+} io_run;
+
+/* Most runs of a batch, and of prefetches, in the ring at once. With the
+   requests of the pool, they do not overflow the completions. */
+#define IO_BATCH_RUNS (IO_QUEUE_DEPTH / 2)
+static int io_runs_left = 0; /* of the batch in the ring */
+static int io_advising = 0;  /* prefetches in the ring */
+/* The pool, the completed requests and the ring are shared by the threads
+   as well. io_lock is taken after cache_lock, and is not held while the
+   callbacks run, so they can submit more requests. A batch holds it until
+   its runs completed. */
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Reads the consecutive blocks starting at blocknr straight from the disk
+   file into the iovcnt buffers, with one system call. */
+static int rawReadv(int blocknr, struct iovec *iov, int iovcnt) {
+  off_t pos = (off_t)BLOCK_SIZE * blocknr;
+  if (disk_map) {
+    for (int i = 0; i < iovcnt; i++) {
+      if (pos < 0 || pos + iov[i].iov_len > disk_bsize)
+        return -1;
+      memcpy(iov[i].iov_base, disk_map + pos, iov[i].iov_len);
+      pos += iov[i].iov_len;
     }
-  } else {
-    /* file exists. let's assume is nbytes large */
-    disk_bsize = nbytes;
+    return pos - (off_t)BLOCK_SIZE * blocknr;
+  }
+  STAT_ADD(reads, 1);
+  return preadv(disk_fd, iov, iovcnt, pos);
+}
+
+/* Writes the iovcnt buffers to the consecutive blocks starting at blocknr,
+   straight to the disk file, with one system call. */
+static int rawWritev(int blocknr, struct iovec *iov, int iovcnt) {
+  off_t pos = (off_t)BLOCK_SIZE * blocknr;
+  if (disk_map) {
+    for (int i = 0; i < iovcnt; i++) {
+      if (pos < 0 || pos + iov[i].iov_len > disk_bsize)
+        return -1;
+      memcpy(disk_map + pos, iov[i].iov_base, iov[i].iov_len);
+      pos += iov[i].iov_len;
+    }
+    return pos - (off_t)BLOCK_SIZE * blocknr;
+  }
+  STAT_ADD(writes, 1);
+  return pwritev(disk_fd, iov, iovcnt, pos);
+}
+
+/* Reads block blocknr straight from the disk file. */
+static int rawRead(int blocknr, void *block) {
+  struct iovec iov = {block, BLOCK_SIZE};
+  return rawReadv(blocknr, &iov, 1);
+}
+
+/* Writes block blocknr straight to the disk file. */
+static int rawWrite(int blocknr, void *block) {
+  struct iovec iov = {block, BLOCK_SIZE};
+  return rawWritev(blocknr, &iov, 1);
+}
+
+static void lruUnlink(cache_slot *s) {
+  if (s->prev)
+    s->prev->next = s->next;
+  else
+    lru_first = s->next;
+  if (s->next)
+    s->next->prev = s->prev;
+  else
+    lru_last = s->prev;
+  s->prev = s->next = NULL;
+}
+
+static void lruPushFront(cache_slot *s) {
+  s->prev = NULL;
+  s->next = lru_first;
+  if (lru_first)
+    lru_first->prev = s;
+  lru_first = s;
+  if (!lru_last)
+    lru_last = s;
+}
+
+static cache_slot *cacheLookup(int blocknr) {
+  cache_slot *s = cache_hash[blocknr & cache_hmask];
+  while (s && s->blocknr != blocknr)
+    s = s->hnext;
+  return s;
+}
+
+static void hashRemove(cache_slot *s) {
+  cache_slot **p = &cache_hash[s->blocknr & cache_hmask];
+  while (*p != s)
+    p = &(*p)->hnext;
+  *p = s->hnext;
+  s->hnext = NULL;
+}
+
+/* Writes a dirty slot back to the disk file. */
+static int cacheWriteBack(cache_slot *s) {
+  if (!s->dirty)
+    return BLOCK_SIZE;
+  if (rawWrite(s->blocknr, s->data) != BLOCK_SIZE)
+    return -1;
+  s->dirty = 0;
+  STAT_ADD(writebacks, 1);
+  return BLOCK_SIZE;
+}
+
+/* Returns the slot of blocknr, waiting if it is being loaded, or NULL if it
+   is not cached. The lock is released while waiting. */
+static cache_slot *cacheGet(int blocknr) {
+  cache_slot *s;
+  while ((s = cacheLookup(blocknr)) && s->loading)
+    pthread_cond_wait(&cache_loaded, &cache_lock);
+  return s;
+}
+
+/* Takes the least recently used slot for blocknr, writing back its old
+   contents if needed. Returns NULL if the old block cannot be written, or
+   all slots are being loaded, then the caller goes to the disk file. */
+static cache_slot *cacheClaim(int blocknr) {
+  cache_slot *s = lru_last;
+  while (s && s->loading)
+    s = s->prev;
+  if (!s)
+    return NULL;
+  if (s->blocknr >= 0) {
+    if (cacheWriteBack(s) < 0)
+      return NULL;
+    hashRemove(s);
+    STAT_ADD(evictions, 1);
+  }
+  lruUnlink(s);
+  s->blocknr = blocknr;
+  s->hnext = cache_hash[blocknr & cache_hmask];
+  cache_hash[blocknr & cache_hmask] = s;
+  lruPushFront(s);
+  return s;
+}
+
+/* Gives the slot back to the free end of the LRU list. */
+static void cacheDrop(cache_slot *s) {
+  hashRemove(s);
+  s->blocknr = -1;
+  s->dirty = 0;
+  lruUnlink(s);
+  s->next = NULL;
+  s->prev = lru_last;
+  if (lru_last)
+    lru_last->next = s;
+  lru_last = s;
+  if (!lru_first)
+    lru_first = s;
+}
+
+static void cacheFree() {
+  free(cache_slots);
+  free(cache_hash);
+  cache_slots = NULL;
+  cache_hash = NULL;
+  cache_nslots = 0;
+  lru_first = lru_last = NULL;
+}
+
+static int cacheInit() {
+  cacheFree();
+  if (cache_size == 0)
+    return 0;
+  unsigned hsize = 1;
+  while (hsize < cache_size)
+    hsize <<= 1;
+  cache_slots = calloc(cache_size, sizeof(cache_slot));
+  cache_hash = calloc(hsize, sizeof(cache_slot *));
+  if (!cache_slots || !cache_hash) {
+    cacheFree();
+    return -1;
+  }
+  cache_hmask = hsize - 1;
+  cache_nslots = cache_size;
+  for (int i = 0; i < cache_nslots; i++) {
+    cache_slots[i].blocknr = -1;
+    lruPushFront(&cache_slots[i]);
+  }
+  return 0;
+}
+
+static void ioInit() {
+  io_free = NULL;
+  io_done_first = io_done_last = NULL;
+  io_inflight = 0;
+  for (int i = 0; i < IO_QUEUE_DEPTH; i++) {
+    io_pool[i].next = io_free;
+    io_free = &io_pool[i];
   }
-  return disk_bsize;
+  if (async_enabled && !disk_map)
+    ring = uringInit(IO_QUEUE_DEPTH);
+}
+
+static void ioExit() {
+  /* the requests left are lost if the ring fails */
+  while (io_inflight || io_done_first)
+    if (reapBlocks(io_inflight + 1) < 0)
+      break;
+  if (ring)
+    uringExit(ring);
+  ring = NULL;
+}
+
+int setCacheSize(int nblocks) {
+  if (nblocks < 0)
+    return -1;
+  cache_size = nblocks;
+  return cache_size;
+}
+
+/* Open filename file as the raw disk. File size fixed at nbytes, or the
+   size of the existing file if nbytes is 0. Creates a new one if it does
+   not exist. Returns the number of blocks of the disk. */
+int openDisk(char *filename, off_t nbytes) {
+  return openDiskWith(filename, nbytes, DISK_SYSCALL);
+}
+
+int openDiskWith(char *filename, off_t nbytes, int backend) {
+  struct stat st;
+  /* attempt to open existing file, or create it */
+  disk_fd = open(filename, O_RDWR | O_CREAT, 0644);
+  if (disk_fd < 0 || fstat(disk_fd, &st) < 0)
+    return -1;
+  if (nbytes == 0)
+    nbytes = st.st_size - st.st_size % BLOCK_SIZE;
+  if (nbytes / BLOCK_SIZE > INT_MAX)
+    return -1; /* block numbers are ints */
+  /* make sure the file is (at least) nbytes large. A new file reads as 0s */
+  if (st.st_size < nbytes && ftruncate(disk_fd, nbytes) < 0)
+    return -1;
+  disk_bsize = nbytes;
+  memset(&cstats, 0, sizeof(cstats));
+  if (backend == DISK_MMAP) {
+    disk_map =
+        mmap(NULL, nbytes, PROT_READ | PROT_WRITE, MAP_SHARED, disk_fd, 0);
+    if (disk_map == MAP_FAILED) {
+      disk_map = NULL;
+      return -1;
+    }
+    /* the page cache already holds the blocks, no need for another cache */
+    cacheFree();
+  } else if (cacheInit() < 0)
+    return -1;
+  ioInit();
+  return disk_bsize / BLOCK_SIZE;
+}
+
+void *blockAddress(int blocknr) {
+  if (!disk_map || blocknr < 0 || (off_t)blocknr * BLOCK_SIZE >= disk_bsize)
+    return NULL;
+  return disk_map + (off_t)blocknr * BLOCK_SIZE;
+}
+
+/* Marks a slot claimed for a read as loaded (or drops it if the read
+   failed), and wakes up the threads waiting for it. */
+static void cacheLoaded(cache_slot *s, int ok) {
+  s->loading = 0;
+  if (!ok)
+    cacheDrop(s);
+  pthread_cond_broadcast(&cache_loaded);
 }
 
 /* Reads raw block blocknr from the open disk and
    puts the data in the given buffer. */
 int readBlock(int blocknr, void *block) {
-  if (lseek(disk_fd, BLOCK_SIZE * blocknr, SEEK_SET) >= 0)
-    return read(disk_fd, block, BLOCK_SIZE);
-  else
-    return -1;
+  if (cache_nslots == 0)
+    return rawRead(blocknr, block);
+  pthread_mutex_lock(&cache_lock);
+  cache_slot *s = cacheGet(blocknr);
+  if (s) {
+    STAT_ADD(hits, 1);
+    lruUnlink(s);
+    lruPushFront(s);
+  } else {
+    STAT_ADD(misses, 1);
+    if (!(s = cacheClaim(blocknr))) {
+      pthread_mutex_unlock(&cache_lock);
+      return rawRead(blocknr, block);
+    }
+    s->loading = 1;
+    pthread_mutex_unlock(&cache_lock);
+    int ok = rawRead(blocknr, s->data) == BLOCK_SIZE;
+    pthread_mutex_lock(&cache_lock);
+    cacheLoaded(s, ok);
+    if (!ok) {
+      pthread_mutex_unlock(&cache_lock);
+      return -1;
+    }
+  }
+  memcpy(block, s->data, BLOCK_SIZE);
+  pthread_mutex_unlock(&cache_lock);
+  return BLOCK_SIZE;
 }
 
 /* Writes the raw block blocknr from the given buffer to the open disk. */
 int writeBlock(int blocknr, void *block) {
-  if (lseek(disk_fd, BLOCK_SIZE * blocknr, SEEK_SET) >= 0)
-    return write(disk_fd, block, BLOCK_SIZE);
+  if (cache_nslots == 0)
+    return rawWrite(blocknr, block);
+  pthread_mutex_lock(&cache_lock);
+  cache_slot *s = cacheGet(blocknr);
+  if (s) {
+    STAT_ADD(hits, 1);
+    lruUnlink(s);
+    lruPushFront(s);
+  } else {
+    /* the whole block is overwritten, no need to read it first */
+    STAT_ADD(misses, 1);
+    if (!(s = cacheClaim(blocknr))) {
+      pthread_mutex_unlock(&cache_lock);
+      return rawWrite(blocknr, block);
+    }
+  }
+  memcpy(s->data, block, BLOCK_SIZE);
+  s->dirty = 1;
+  pthread_mutex_unlock(&cache_lock);
+  return BLOCK_SIZE;
+}
+
+/* Moves run r with one system call, and returns the bytes moved or -1 */
+static int ioRunSync(io_run *r) {
+  return r->write ? rawWritev(r->blocknr, r->iov, r->iovcnt)
+                  : rawReadv(r->blocknr, r->iov, r->iovcnt);
+}
+
+/* Adds a completed request to the list for reapBlocks. Called with io_lock
+   held. */
+static void ioAppendDone(io_request *req) {
+  req->next = NULL;
+  if (io_done_last)
+    io_done_last->next = req;
   else
+    io_done_first = req;
+  io_done_last = req;
+}
+
+/* Hands the result res to the request of the ring with user_data data. A
+   request of the pool goes to the list for reapBlocks, a run of the batch
+   gets its result, a prefetch is done. Called with io_lock held. */
+static void ioComplete(void *data, int res) {
+  if (!data) {
+    io_advising--;
+  } else if ((io_request *)data >= io_pool &&
+             (io_request *)data < io_pool + IO_QUEUE_DEPTH) {
+    io_request *req = data;
+    req->result = res == BLOCK_SIZE ? BLOCK_SIZE : -1;
+    io_inflight--;
+    ioAppendDone(req);
+  } else {
+    ((io_run *)data)->result = res < 0 ? -1 : res;
+    io_runs_left--;
+  }
+}
+
+/* Takes one completion from the ring, if there is one, and returns 1.
+   Called with io_lock held. */
+static int ioReapOne() {
+  void *data;
+  int res;
+  if (!ring || !uringReap(ring, &data, &res))
+    return 0;
+  ioComplete(data, res);
+  return 1;
+}
+
+/* Waits until the runs of the batch are out of the ring, when the ring
+   fails: they point at memory of the caller. The requests the kernel did
+   not take yet are taken back and fail, those it took always complete.
+   Called with io_lock held. */
+static void ioDrain() {
+  void *data;
+  while (uringUnqueue(ring, &data))
+    ioComplete(data, -1);
+  while (io_runs_left > 0) {
+    while (ioReapOne())
+      ;
+    if (io_runs_left > 0 && uringSubmit(ring, 1) < 0 && errno != EINTR) {
+      struct timespec pause = {0, 100000};
+      nanosleep(&pause, NULL);
+    }
+  }
+}
+
+/* Moves the n runs, all at once through the ring, IO_BATCH_RUNS at a time,
+   or one after the other with a system call each when there is no ring.
+   The runs the ring could not move are moved that way too. Sets the result
+   of each run. Called without cache_lock held, or with it held
+   (cacheFlush), never with io_lock. */
+static void ioRuns(io_run *runs, int n) {
+  int i = 0;
+  if (ring) {
+    pthread_mutex_lock(&io_lock);
+    while (i < n) {
+      int queued = 0, failed = 0;
+      while (i + queued < n && queued < IO_BATCH_RUNS) {
+        io_run *r = &runs[i + queued];
+        if (uringQueue(ring, r->write, disk_fd, r->iov, r->iovcnt,
+                       (off_t)BLOCK_SIZE * r->blocknr, r) < 0) {
+          /* the ring is full of requests not sent yet */
+          if (uringSubmit(ring, 0) < 0 ||
+              uringQueue(ring, r->write, disk_fd, r->iov, r->iovcnt,
+                         (off_t)BLOCK_SIZE * r->blocknr, r) < 0)
+            break;
+        }
+        r->result = -1;
+        if (r->write)
+          STAT_ADD(writes, 1);
+        else
+          STAT_ADD(reads, 1);
+        queued++;
+      }
+      io_runs_left = queued;
+      while (io_runs_left > 0 && !failed) {
+        while (ioReapOne())
+          ;
+        if (io_runs_left > 0 && uringSubmit(ring, 1) < 0 && errno != EINTR)
+          failed = 1;
+      }
+      if (failed)
+        ioDrain();
+      /* the runs that failed are tried again without the ring */
+      for (int k = i; k < i + queued; k++)
+        if (runs[k].result < 0)
+          runs[k].result = ioRunSync(&runs[k]);
+      i += queued;
+      /* the rest is moved without the ring */
+      if (queued == 0 || failed)
+        break;
+    }
+    pthread_mutex_unlock(&io_lock);
+  }
+  for (; i < n; i++)
+    runs[i].result = ioRunSync(&runs[i]);
+}
+
+/* The runs of missing blocks readBlocks sends to the disk together. Short
+   runs are read into cache slots claimed for them, long ones straight into
+   the buffer so a big sequential read does not flush the whole cache. */
+typedef struct {
+  io_run runs[IO_BATCH_RUNS];
+  char *out[IO_BATCH_RUNS]; /* where the blocks of each run go */
+  int nblocks[IO_BATCH_RUNS];
+  int nslots[IO_BATCH_RUNS]; /* slots claimed by each run, 0 if none */
+  int nruns;
+  cache_slot **slots; /* the slots of all the runs, one after the other */
+  struct iovec *iov;  /* the buffers of all the runs */
+  int used_slots, used_iov;
+} read_batch;
+
+static int batchInit(read_batch *b) {
+  b->nruns = b->used_slots = b->used_iov = 0;
+  b->slots = malloc((cache_nslots + 1) * sizeof(cache_slot *));
+  b->iov = malloc((cache_nslots + IO_BATCH_RUNS) * sizeof(struct iovec));
+  if (b->slots && b->iov)
+    return 0;
+  free(b->slots);
+  free(b->iov);
+  return -1;
+}
+
+/* Adds the nblocks blocks from blocknr, missing from the cache, to the
+   batch. Called with the lock held, if there is a cache. */
+static void batchAdd(read_batch *b, int blocknr, int nblocks, char *out) {
+  int k = b->nruns++, claimed = 0;
+  io_run *r = &b->runs[k];
+  cache_slot **slots = b->slots + b->used_slots;
+  r->blocknr = blocknr;
+  r->write = 0;
+  r->iov = b->iov + b->used_iov;
+  b->out[k] = out;
+  b->nblocks[k] = nblocks;
+  if (cache_nslots && nblocks <= cache_nslots / 2)
+    while (claimed < nblocks &&
+           (slots[claimed] = cacheClaim(blocknr + claimed)))
+      slots[claimed++]->loading = 1;
+  if (claimed < nblocks) { /* not enough slots, read around the cache */
+    for (int i = 0; i < claimed; i++)
+      cacheLoaded(slots[i], 0);
+    claimed = 0;
+    r->iov[0].iov_base = out;
+    r->iov[0].iov_len = nblocks * BLOCK_SIZE;
+    r->iovcnt = 1;
+  } else {
+    for (int i = 0; i < nblocks; i++) {
+      r->iov[i].iov_base = slots[i]->data;
+      r->iov[i].iov_len = BLOCK_SIZE;
+    }
+    r->iovcnt = nblocks;
+  }
+  b->nslots[k] = claimed;
+  b->used_slots += claimed;
+  b->used_iov += r->iovcnt;
+}
+
+/* Reads the runs of the batch, all at once, and empties it. Called with the
+   lock held, if there is a cache, which is released during the reads. */
+static int batchRead(read_batch *b) {
+  int res = 0;
+  if (cache_nslots)
+    pthread_mutex_unlock(&cache_lock);
+  ioRuns(b->runs, b->nruns);
+  if (cache_nslots)
+    pthread_mutex_lock(&cache_lock);
+  cache_slot **slots = b->slots;
+  for (int k = 0; k < b->nruns; k++) {
+    int ok = b->runs[k].result == b->nblocks[k] * BLOCK_SIZE;
+    for (int i = 0; i < b->nslots[k]; i++) {
+      if (ok)
+        memcpy(b->out[k] + i * BLOCK_SIZE, slots[i]->data, BLOCK_SIZE);
+      cacheLoaded(slots[i], ok);
+    }
+    slots += b->nslots[k];
+    if (!ok)
+      res = -1;
+  }
+  b->nruns = b->used_slots = b->used_iov = 0;
+  return res;
+}
+
+int readBlocks(const int *blocknrs, int nblocks, void *buf) {
+  char *out = buf;
+  read_batch b;
+  int i = 0, res = 0;
+  if (batchInit(&b) < 0)
+    return -1;
+  if (cache_nslots)
+    pthread_mutex_lock(&cache_lock);
+  while (i < nblocks) {
+    cache_slot *s = cache_nslots ? cacheLookup(blocknrs[i]) : NULL;
+    if (s && s->loading && b.nruns > 0) { /* maybe by this batch */
+      if (batchRead(&b) < 0)
+        res = -1;
+      continue;
+    }
+    if (s && (s = cacheGet(blocknrs[i]))) {
+      STAT_ADD(hits, 1);
+      lruUnlink(s);
+      lruPushFront(s);
+      memcpy(out + i * BLOCK_SIZE, s->data, BLOCK_SIZE);
+      i++;
+      continue;
+    }
+    /* extend the run while the next block follows and is not cached */
+    int run = 1;
+    while (i + run < nblocks && run < RUN_MAX_BLOCKS &&
+           blocknrs[i + run] == blocknrs[i] + run &&
+           !(cache_nslots && cacheLookup(blocknrs[i + run])))
+      run++;
+    if (cache_nslots)
+      STAT_ADD(misses, run);
+    if (b.nruns == IO_BATCH_RUNS && batchRead(&b) < 0)
+      res = -1;
+    batchAdd(&b, blocknrs[i], run, out + i * BLOCK_SIZE);
+    i += run;
+  }
+  if (b.nruns > 0 && batchRead(&b) < 0)
+    res = -1;
+  if (cache_nslots)
+    pthread_mutex_unlock(&cache_lock);
+  free(b.slots);
+  free(b.iov);
+  return res < 0 ? -1 : nblocks * BLOCK_SIZE;
+}
+
+int writeBlocks(const int *blocknrs, int nblocks, const void *buf) {
+  char *in = (char *)buf;
+  struct iovec iov;
+  int i = 0;
+  while (i < nblocks) {
+    if (cache_nslots) {
+      /* write-back: the runs are formed again when the cache is flushed */
+      if (writeBlock(blocknrs[i], in + i * BLOCK_SIZE) < 0)
+        return -1;
+      i++;
+      continue;
+    }
+    int run = 1;
+    while (i + run < nblocks && run < RUN_MAX_BLOCKS &&
+           blocknrs[i + run] == blocknrs[i] + run)
+      run++;
+    iov.iov_base = in + i * BLOCK_SIZE;
+    iov.iov_len = run * BLOCK_SIZE;
+    if (rawWritev(blocknrs[i], &iov, 1) != run * BLOCK_SIZE)
+      return -1;
+    i += run;
+  }
+  return nblocks * BLOCK_SIZE;
+}
+
+static int compareSlots(const void *a, const void *b) {
+  return (*(cache_slot **)a)->blocknr - (*(cache_slot **)b)->blocknr;
+}
+
+/* Writes back all dirty slots in block order, one request per run of
+   consecutive blocks, all sent at once. Called with the lock held. */
+static int cacheFlush() {
+  cache_slot **dirty = malloc(cache_nslots * sizeof(cache_slot *));
+  struct iovec *iov = malloc(cache_nslots * sizeof(struct iovec));
+  io_run *runs = malloc(cache_nslots * sizeof(io_run));
+  int ndirty = 0, nruns = 0, res = 0;
+  if (!dirty || !iov || !runs) {
+    free(dirty);
+    free(iov);
+    free(runs);
     return -1;
+  }
+  for (int i = 0; i < cache_nslots; i++)
+    if (cache_slots[i].blocknr >= 0 && cache_slots[i].dirty)
+      dirty[ndirty++] = &cache_slots[i];
+  qsort(dirty, ndirty, sizeof(cache_slot *), compareSlots);
+  for (int i = 0; i < ndirty; nruns++) {
+    io_run *r = &runs[nruns];
+    r->blocknr = dirty[i]->blocknr;
+    r->write = 1;
+    r->iov = iov + i;
+    r->iovcnt = 0;
+    do {
+      iov[i].iov_base = dirty[i]->data;
+      iov[i].iov_len = BLOCK_SIZE;
+      r->iovcnt++;
+      i++;
+    } while (i < ndirty && r->iovcnt < RUN_MAX_BLOCKS &&
+             dirty[i]->blocknr == r->blocknr + r->iovcnt);
+  }
+  ioRuns(runs, nruns);
+  for (int k = 0, i = 0; k < nruns; i += runs[k++].iovcnt) {
+    if (runs[k].result != runs[k].iovcnt * BLOCK_SIZE) {
+      res = -1;
+      continue;
+    }
+    for (int j = i; j < i + runs[k].iovcnt; j++)
+      dirty[j]->dirty = 0;
+    STAT_ADD(writebacks, runs[k].iovcnt);
+  }
+  free(dirty);
+  free(iov);
+  free(runs);
+  return res;
+}
+
+int setAsyncDisk(int enable) {
+  async_enabled = enable;
+  return async_enabled;
+}
+
+int asyncDisk() { return ring != NULL; }
+
+/* Takes a request from the pool, waiting for completions if it is empty. */
+static io_request *ioGetRequest(int blocknr, void *block, block_callback cb,
+                                void *arg) {
+  pthread_mutex_lock(&io_lock);
+  while (!io_free) {
+    pthread_mutex_unlock(&io_lock);
+    if (reapBlocks(1) < 0)
+      return NULL;
+    pthread_mutex_lock(&io_lock);
+  }
+  io_request *req = io_free;
+  io_free = req->next;
+  pthread_mutex_unlock(&io_lock);
+  req->blocknr = blocknr;
+  req->block = block;
+  req->cb = cb;
+  req->arg = arg;
+  req->iov.iov_base = block;
+  req->iov.iov_len = BLOCK_SIZE;
+  req->next = NULL;
+  return req;
+}
+
+/* Queues a request that completed without the ring. */
+static void ioDone(io_request *req, int result) {
+  req->result = result == BLOCK_SIZE ? BLOCK_SIZE : -1;
+  pthread_mutex_lock(&io_lock);
+  ioAppendDone(req);
+  pthread_mutex_unlock(&io_lock);
+}
+
+/* Puts the request in the ring, sending what is queued first if it is
+   full (of prefetches). */
+static void ioQueue(io_request *req, int write) {
+  off_t off = (off_t)BLOCK_SIZE * req->blocknr;
+  pthread_mutex_lock(&io_lock);
+  if (uringQueue(ring, write, disk_fd, &req->iov, 1, off, req) < 0 &&
+      (uringSubmit(ring, 0) < 0 ||
+       uringQueue(ring, write, disk_fd, &req->iov, 1, off, req) < 0)) {
+    pthread_mutex_unlock(&io_lock);
+    ioDone(req, -1);
+    return;
+  }
+  io_inflight++;
+  pthread_mutex_unlock(&io_lock);
+  if (write)
+    STAT_ADD(writes, 1);
+  else
+    STAT_ADD(reads, 1);
+}
+
+/* Takes the completed requests, up to IO_QUEUE_DEPTH, copying them into
+   done and returning them to the pool. Returns how many there were.
+   Called with io_lock held. */
+static int ioCollect(io_request *done) {
+  int n = 0;
+  while (ioReapOne())
+    ;
+  while (io_done_first && n < IO_QUEUE_DEPTH) {
+    io_request *req = io_done_first;
+    io_done_first = req->next;
+    if (!io_done_first)
+      io_done_last = NULL;
+    done[n++] = *req;
+    req->next = io_free;
+    io_free = req;
+  }
+  return n;
+}
+
+int submitReadBlock(int blocknr, void *block, block_callback cb, void *arg) {
+  io_request *req = ioGetRequest(blocknr, block, cb, arg);
+  if (!req)
+    return -1;
+  pthread_mutex_lock(&cache_lock);
+  cache_slot *s = cache_nslots ? cacheGet(blocknr) : NULL;
+  if (s) {
+    STAT_ADD(hits, 1);
+    memcpy(block, s->data, BLOCK_SIZE);
+  }
+  pthread_mutex_unlock(&cache_lock);
+  if (s) {
+    ioDone(req, BLOCK_SIZE);
+  } else if (ring) {
+    ioQueue(req, 0);
+  } else {
+    ioDone(req, rawRead(blocknr, block));
+  }
+  return 0;
+}
+
+int submitWriteBlock(int blocknr, void *block, block_callback cb, void *arg) {
+  io_request *req = ioGetRequest(blocknr, block, cb, arg);
+  if (!req)
+    return -1;
+  pthread_mutex_lock(&cache_lock);
+  cache_slot *s = cache_nslots ? cacheGet(blocknr) : NULL;
+  if (s) {
+    /* kept dirty and written back, like writeBlock. A request of its own
+       could fail, or land after a newer copy, with the slot clean. */
+    STAT_ADD(hits, 1);
+    memcpy(s->data, block, BLOCK_SIZE);
+    s->dirty = 1;
+  }
+  pthread_mutex_unlock(&cache_lock);
+  if (s)
+    ioDone(req, BLOCK_SIZE);
+  else if (ring)
+    ioQueue(req, 1);
+  else
+    ioDone(req, rawWrite(blocknr, block));
+  return 0;
+}
+
+int submitBlocks() {
+  if (!ring)
+    return 0;
+  pthread_mutex_lock(&io_lock);
+  int res = uringSubmit(ring, 0);
+  pthread_mutex_unlock(&io_lock);
+  return res;
+}
+
+int reapBlocks(int min) {
+  io_request done[IO_QUEUE_DEPTH];
+  int total = 0;
+  for (;;) {
+    int n, res = 0;
+    pthread_mutex_lock(&io_lock);
+    while ((n = ioCollect(done)) == 0 && io_inflight > 0 && total < min)
+      if (uringSubmit(ring, 1) < 0) {
+        res = -1;
+        break;
+      }
+    pthread_mutex_unlock(&io_lock);
+    /* the requests are back in the pool, the callbacks may take them */
+    for (int i = 0; i < n; i++)
+      if (done[i].cb)
+        done[i].cb(done[i].blocknr, done[i].block, done[i].result,
+                   done[i].arg);
+    total += n;
+    if (res < 0)
+      return -1;
+    if (n == 0 || total >= min)
+      return total;
+  }
+}
+
+int diskFile() { return disk_fd; }
+
+/* Writes back (and drops, for a write) the cached copy of one block. */
+static int uncacheSlot(cache_slot *s, int write) {
+  if (cacheWriteBack(s) < 0)
+    return -1;
+  if (write)
+    cacheDrop(s);
+  return 0;
+}
+
+int uncacheBlocks(int blocknr, int nblocks, int write) {
+  int res = 0;
+  if (cache_nslots == 0)
+    return 0;
+  pthread_mutex_lock(&cache_lock);
+  if (nblocks <= cache_nslots) {
+    for (int i = 0; i < nblocks; i++) {
+      cache_slot *s = cacheGet(blocknr + i);
+      if (s && uncacheSlot(s, write) < 0)
+        res = -1;
+    }
+  } else { /* a long run, look at each slot instead of each block */
+    for (int i = 0; i < cache_nslots; i++) {
+      cache_slot *s = &cache_slots[i];
+      while (s->loading && s->blocknr >= blocknr &&
+             s->blocknr < blocknr + nblocks)
+        pthread_cond_wait(&cache_loaded, &cache_lock);
+      if (s->blocknr >= blocknr && s->blocknr < blocknr + nblocks &&
+          uncacheSlot(s, write) < 0)
+        res = -1;
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return res;
+}
+
+int prefetchBlocks(int blocknr, int nblocks) {
+  off_t pos = (off_t)blocknr * BLOCK_SIZE, len = (off_t)nblocks * BLOCK_SIZE;
+  if (blocknr < 0 || nblocks <= 0 || pos + len > disk_bsize)
+    return -1;
+  STAT_ADD(prefetched, nblocks);
+  if (ring && len <= UINT_MAX) { /* sent with the next requests */
+    pthread_mutex_lock(&io_lock);
+    while (ioReapOne())
+      ;
+    int queued = io_advising < IO_BATCH_RUNS &&
+                 uringAdvise(ring, disk_fd, pos, len, POSIX_FADV_WILLNEED,
+                             NULL) == 0;
+    if (queued)
+      io_advising++;
+    pthread_mutex_unlock(&io_lock);
+    if (queued)
+      return 0;
+  }
+  if (disk_map) { /* madvise wants whole pages */
+    off_t page = sysconf(_SC_PAGESIZE), skip = pos % page;
+    return madvise(disk_map + pos - skip, len + skip, MADV_WILLNEED);
+  }
+  return posix_fadvise(disk_fd, pos, len, POSIX_FADV_WILLNEED) ? -1 : 0;
+}
+
+/* Writes all dirty cached blocks back and forces them to disk. */
+int syncDisk() {
+  pthread_mutex_lock(&cache_lock);
+  int res = cache_nslots ? cacheFlush() : 0;
+  pthread_mutex_unlock(&cache_lock);
+  if (disk_map && msync(disk_map, disk_bsize, MS_SYNC) < 0)
+    res = -1;
+  else if (!disk_map && fsync(disk_fd) < 0)
+    res = -1;
+  return res;
+}
+
+void getCacheStats(struct cache_stats *stats) {
+  pthread_mutex_lock(&cache_lock);
+  *stats = cstats;
+  pthread_mutex_unlock(&cache_lock);
 }
 
 /* Closes the disk file. Forces outstanding writes to disk. */
-int closeDisk() { return close(disk_fd); }
+int closeDisk() {
+  ioExit();
+  int res = syncDisk();
+  cacheFree();
+  if (disk_map) {
+    munmap(disk_map, disk_bsize);
+    disk_map = NULL;
+  }
+  if (close(disk_fd) < 0)
+    res = -1;
+  return res;
+}
@@ -1,23 +1,126 @@
-
 #ifndef __RAWDISK_H__
 #define __RAWDISK_H__
 
+#include <sys/types.h>
+
 /* Let's set the block size to 512 bytes */
 #define BLOCK_SIZE 512
 
+/* Ways of accessing the disk file, selected at openDisk time */
+#define DISK_SYSCALL 0 /* read/write system calls, through the block cache */
+#define DISK_MMAP 1    /* the file is mapped in memory, blocks are memcpy'd */
+
+/* Default number of blocks kept in the write-back block cache */
+#define CACHE_NBLOCKS 64
+
+/* Most asynchronous block requests in flight at the same time */
+#define IO_QUEUE_DEPTH 64
+
+/* Block cache counters, to help sizing the cache for a workload */
+struct cache_stats {
+  unsigned long hits;       /* block found in the cache */
+  unsigned long misses;     /* block not in the cache */
+  unsigned long evictions;  /* blocks dropped to make room for others */
+  unsigned long writebacks; /* dirty blocks written to the disk file */
+  unsigned long reads;      /* read requests issued to the disk file */
+  unsigned long writes;     /* write requests issued to the disk file */
+  unsigned long prefetched; /* blocks read ahead with prefetchBlocks */
+};
+
 /* All functions return -1 on failure, and various positive values on success */
 
-/* Open filename file as the raw disk. File size fixed at nbytes.
-   Creates a new one if it does not exist. */
-int openDisk(char *filename, int nbytes);
+/* Sets the number of blocks held by the block cache. Takes effect at the
+   next openDisk. 0 disables caching, so every access goes to the file. */
+int setCacheSize(int nblocks);
+
+/* Open filename file as the raw disk. File size fixed at nbytes, or the
+   size of the existing file if nbytes is 0. Creates a new one if it does
+   not exist. Returns the number of blocks of the disk. */
+int openDisk(char *filename, off_t nbytes);
+
+/* Same as openDisk, but accessing the file with the given backend
+   (DISK_SYSCALL or DISK_MMAP). */
+int openDiskWith(char *filename, off_t nbytes, int backend);
 
 /* Reads raw block blocknr from the open disk and
    puts the data in the given buffer. */
 int readBlock(int blocknr, void *block);
 
-/* Writes the raw block blocknr from the given buffer to the open disk. */
+/* Writes the raw block blocknr from the given buffer to the open disk.
+   The block stays dirty in the cache until evicted or synced. */
 int writeBlock(int blocknr, void *block);
 
+/* Reads the nblocks blocks listed in blocknrs into buf, one after the
+   other. Runs of consecutive block numbers are read with one request, and
+   the requests are sent together through io_uring when it is enabled. */
+int readBlocks(const int *blocknrs, int nblocks, void *buf);
+
+/* Writes nblocks blocks from buf to the blocks listed in blocknrs. Runs of
+   consecutive block numbers are written with one request. */
+int writeBlocks(const int *blocknrs, int nblocks, const void *buf);
+
+/* Called when an asynchronous request completes. result is BLOCK_SIZE on
+   success and -1 on failure. Several threads may submit and reap requests,
+   the callbacks run in the thread that reaps them. */
+typedef void (*block_callback)(int blocknr, void *block, int result,
+                               void *arg);
+
+/* Enables or disables io_uring for the asynchronous requests. Takes effect
+   at the next openDisk. Without it (or when the kernel does not support it)
+   requests are carried out synchronously, when submitted. */
+int setAsyncDisk(int enable);
+
+/* Returns 1 if asynchronous requests are served by io_uring, 0 if not. */
+int asyncDisk();
+
+/* Queues an asynchronous read of block blocknr into block. Cached blocks
+   complete at once. cb is called by reapBlocks after the data arrived.
+   Waits for a completion if IO_QUEUE_DEPTH requests are in flight. */
+int submitReadBlock(int blocknr, void *block, block_callback cb, void *arg);
+
+/* Queues an asynchronous write of block to block blocknr. A cached block
+   is updated in the cache and completes at once, it reaches the disk when
+   written back, as with writeBlock. The buffer must stay untouched until
+   cb is called. */
+int submitWriteBlock(int blocknr, void *block, block_callback cb, void *arg);
+
+/* Sends all queued requests to the disk with one system call.
+   Returns the number of requests sent. */
+int submitBlocks();
+
+/* Calls the callbacks of completed requests, waiting until at least min
+   completed (or none are left). Returns the number of completions. */
+int reapBlocks(int min);
+
+/* Returns the address of block blocknr in the mapped disk, for zero-copy
+   access, or NULL if the disk is not mapped (DISK_SYSCALL backend).
+   Changes made through it are forced to disk by syncDisk. */
+void *blockAddress(int blocknr);
+
+/* Returns the file descriptor of the disk file, so data can be moved
+   between it and another file without copying it (with splice). Blocks
+   accessed that way must first go through uncacheBlocks. */
+int diskFile();
+
+/* Gets the nblocks blocks from blocknr ready to be accessed through
+   diskFile, around the cache: their dirty cached copies are written back,
+   and also dropped if write is set, since the file will hold newer data. */
+int uncacheBlocks(int blocknr, int nblocks, int write);
+
+/* Starts reading nblocks blocks from blocknr into memory in the
+   background (the page cache of the disk file), so that a later access,
+   through the cache or diskFile, does not wait for the device. Returns at
+   once. With io_uring, the request is queued and goes to the kernel with
+   the next submitBlocks, so several prefetches take one system call. */
+int prefetchBlocks(int blocknr, int nblocks);
+
+/* Writes all dirty cached blocks back, one request per run, sent together
+   like those of readBlocks, and forces them to disk. */
+int syncDisk();
+
+/* Copies the current cache counters into stats. */
+void getCacheStats(struct cache_stats *stats);
+
 /* Closes the disk file. Forces outstanding writes to disk. */
 int closeDisk();
 
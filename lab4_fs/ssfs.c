@@ -17,8 +17,14 @@
 
 #include "fs_support.h"
 #include "rawdisk.h"
+#include "trace.h"
+#include "stats.h"
 #include <errno.h>
-#include <fuse.h>
+#include <fcntl.h>
+#include <fuse_lowlevel.h>
+#include <linux/falloc.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -26,14 +32,156 @@
 #include <time.h>
 #include <unistd.h>
 
-#define min(a, b) ((a) < (b) ? (a) : (b))
+// fills st with the attributes kept in inode in, number ino
+static void entry_stat(int ino, const inode *in, struct stat *st) {
+  memset(st, 0, sizeof(*st));
+  st->st_ino = ino;
+  st->st_uid = getuid(); // The owner of the file/directory is the user who
+                         // mounted the filesystem
+  st->st_gid = getgid(); // The group of the file/directory is the same as the
+                         // group of the user who mounted the filesystem
+  st->st_mode = in->mode;
+  // Why "two" hardlinks instead of "one" for directories? The answer is
+  // here: http://unix.stackexchange.com/a/101536
+  st->st_nlink = S_ISDIR(in->mode) ? 2 : 1;
+  st->st_size = in->size_bytes;
+  st->st_atime = in->atime;
+  st->st_ctime = in->ctime;
+  st->st_mtime = in->mtime;
+}
+
+// fills st with the attributes of inode ino, with the inode locked so a
+// write does not change them half way. fs_lock must be held.
+static int locked_stat(int ino, struct stat *st) {
+  inode *in = lock_inode(ino, 0);
+  if (!in)
+    return -ENOENT;
+  entry_stat(ino, in, st);
+  unlock_inode(ino);
+  return 0;
+}
+
+// How long the kernel may keep the names it looked up, and the attributes
+// of the inodes, before asking again. Nothing changes the file system behind
+// the kernel's back, so these only limit how stale a cached entry may get.
+// Set with SSFS_ENTRY_TIMEOUT and SSFS_ATTR_TIMEOUT, in seconds.
+static double entry_timeout = 1.0;
+static double attr_timeout = 1.0;
+
+// fills e with inode ino for the kernel, which keeps it until it forgets
+// it. fs_lock must be held.
+static int fill_entry(int ino, struct fuse_entry_param *e) {
+  memset(e, 0, sizeof(*e));
+  e->ino = ino;
+  e->attr_timeout = attr_timeout;
+  e->entry_timeout = entry_timeout;
+  int res = locked_stat(ino, &e->attr);
+  if (res == 0)
+    lookup_inode(ino);
+  return res;
+}
+
+// Counts an operation in the statistics, and traces it, once it is replied
+// to. start is the stats_clock() of when it started, result as in
+// trace_event.
+static void op_done(int op, fuse_ino_t ino, off_t offset, size_t size,
+                    int result, uint64_t start) {
+  uint64_t latency = stats_clock() - start;
+  stats_op(op, result, latency);
+  trace_op(op, ino, offset, size, result, start, latency);
+}
+
+// The statistics can be read from a file of their own in the root,
+// STATS_NAME. Lookup finds it, but it is not listed with the entries of the
+// root. Its inode number is the largest one, which the inode table never
+// gets to, so the functions of fs_support find no inode with it. Each open
+// gets the statistics of that moment.
+#define STATS_NAME ".ssfs_stats"
+#define STATS_INO ((fuse_ino_t)UINT32_MAX)
+#define is_stats(dir, name) ((dir) == ROOT_INO && !strcmp(name, STATS_NAME))
+
+// fills st with the attributes of the statistics, a read-only file the
+// kernel sees as empty (the handles are direct_io, so it reads them anyway)
+static void stats_stat(struct stat *st) {
+  memset(st, 0, sizeof(*st));
+  st->st_ino = STATS_INO;
+  st->st_uid = getuid();
+  st->st_gid = getgid();
+  st->st_mode = S_IFREG | 0444;
+  st->st_nlink = 1;
+  st->st_atime = st->st_ctime = st->st_mtime = time(0);
+}
+
+// fills st with the attributes of inode ino, or of the statistics
+static int ino_stat(fuse_ino_t ino, struct stat *st) {
+  if (ino == STATS_INO) {
+    stats_stat(st);
+    return 0;
+  }
+  lock_fs();
+  int res = locked_stat(ino, st);
+  unlock_fs();
+  return res;
+}
+
+// Finds the entry name in directory parent. The kernel keeps the inode it
+// gets (and its attributes) for the timeouts above, so it does not come
+// back for every access to the same path.
+static void do_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  uint64_t start = stats_clock();
+  struct fuse_entry_param e;
+  if (is_stats(parent, name)) {
+    memset(&e, 0, sizeof(e));
+    e.ino = STATS_INO;
+    e.attr_timeout = attr_timeout;
+    e.entry_timeout = entry_timeout;
+    stats_stat(&e.attr);
+    fuse_reply_entry(req, &e);
+    op_done(TRACE_LOOKUP, parent, 0, 0, 0, start);
+    return;
+  }
+  lock_fs();
+  int ino = find_entry(parent, name);
+  int res = ino < 0 ? ino : fill_entry(ino, &e);
+  unlock_fs();
+  if (res < 0)
+    fuse_reply_err(req, -res);
+  else
+    fuse_reply_entry(req, &e);
+  op_done(TRACE_LOOKUP, parent, 0, 0, res < 0 ? res : ino, start);
+}
+
+// The kernel is done with nlookup of the lookups of inode ino. A removed
+// file is freed with the last one (and its last handle).
+static void do_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+  uint64_t start = stats_clock();
+  lock_fs();
+  forget_inode(ino, nlookup);
+  unlock_fs();
+  save_blockmap();
+  fuse_reply_none(req);
+  op_done(TRACE_FORGET, ino, 0, nlookup, 0, start);
+}
+
+static void do_forget_multi(fuse_req_t req, size_t count,
+                            struct fuse_forget_data *forgets) {
+  uint64_t start = stats_clock();
+  lock_fs();
+  for (size_t i = 0; i < count; i++)
+    forget_inode(forgets[i].ino, forgets[i].nlookup);
+  unlock_fs();
+  save_blockmap();
+  fuse_reply_none(req);
+  // one event for all of them, with how many inodes as the size
+  op_done(TRACE_FORGET, 0, 0, count, 0, start);
+}
 
 // The attributes should come from the directory entry.
 // TODO: [DIR_ENTRY] add last "m"odification time to the entry and handle it
 // properly
-static int do_getattr(const char *path, struct stat *st) {
-  	printf( "[getattr] Called\n" );
-  	printf( "\tAttributes of %s requested\n", path );
+static void do_getattr(fuse_req_t req, fuse_ino_t ino,
+                       struct fuse_file_info *fi) {
+  uint64_t start = stats_clock();
 
   // GNU's definitions of the attributes
   // (http://www.gnu.org/software/libc/manual/html_node/Attribute-Meanings.html):
@@ -52,388 +200,714 @@ static int do_getattr(const char *path, struct stat *st) {
   //meaningful. For symbolic links this specifies the length of the file name
   //the link refers to.
 
-  st->st_uid = getuid(); // The owner of the file/directory is the user who
-                         // mounted the filesystem
-  st->st_gid = getgid(); // The group of the file/directory is the same as the
-                         // group of the user who mounted the filesystem
+  // the inodes are kept in memory once read
+  struct stat st;
+  int res = ino_stat(ino, &st);
+  if (res < 0)
+    fuse_reply_err(req, -res);
+  else
+    fuse_reply_attr(req, &st, attr_timeout);
+  op_done(TRACE_GETATTR, ino, 0, 0, res, start);
+}
 
-  if (strcmp(path, "/") == 0) {
-    st->st_mode = S_IFDIR | 0755;
-    st->st_nlink = 2; // Why "two" hardlinks instead of "one"? The answer is
-                      // here: http://unix.stackexchange.com/a/101536
-  } else {
-    st->st_mode = S_IFREG | 0644;
-    st->st_nlink = 1;
-    st->st_size = 1024;
-
-    // skip the "/" in the begining
-    const char *fn = &path[1];
-    // load directory info
-    load_directory();
-    int di = find_dir_entry(fn);
-    if (di >= 0) {
-      dir_entry *de = index2dir_entry(di);
-      printf("  -- %d > %.*s\n", di, FS_NAME_LEN, de->name);
-      st->st_size = de->size_bytes;
-      st->st_mode = de->mode;
-      st->st_atime = de->atime;
-      st->st_ctime = de->ctime;
-      st->st_mtime = de->mtime;
-    } else {
-      printf("  -- find_dir_entry cannot find %s\n", fn);
-      // this could be a new file. let it through?
-      return -ENOENT; // no such file or dir
-    }
+// adds an entry to the size bytes of buffer, after the *used already
+// there. Returns 1 if it does not fit.
+static int fill_dir(fuse_req_t req, char *buffer, size_t size, size_t *used,
+                    const char *name, const struct stat *st, off_t off) {
+  size_t len = fuse_add_direntry(req, buffer + *used, size - *used, name, st,
+                                 off);
+  if (len > size - *used)
+    return 1;
+  *used += len;
+  return 0;
+}
+
+// Lists the entries of directory ino that fit in size bytes, starting after
+// offset. "." and ".." have offsets 1 and 2, the entry in slot s of the
+// directory has offset s + 3. Slots do not move when other entries are
+// added or removed, so a listing can stop when the buffer is full and go on
+// from the offset of the last entry.
+static void do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                       off_t offset, struct fuse_file_info *fi) {
+  uint64_t start = stats_clock();
+  char *buffer = malloc(size);
+  if (!buffer) {
+    fuse_reply_err(req, ENOMEM);
+    op_done(TRACE_READDIR, ino, offset, size, -ENOMEM, start);
+    return;
+  }
+  lock_fs();
+  inode *dir = get_inode(ino);
+  if (!dir || !S_ISDIR(dir->mode)) {
+    unlock_fs();
+    free(buffer);
+    fuse_reply_err(req, dir ? ENOTDIR : ENOENT);
+    op_done(TRACE_READDIR, ino, offset, size, dir ? -ENOTDIR : -ENOENT,
+             start);
+    return;
   }
 
-  return 0;
+  // only the inode and the type of each entry are passed on, the kernel
+  // gets the other attributes from lookup
+  struct stat st;
+  size_t used = 0;
+  memset(&st, 0, sizeof(st));
+  st.st_mode = S_IFDIR;
+  st.st_ino = ino;
+  if (offset < 1 && fill_dir(req, buffer, size, &used, ".", &st, 1))
+    goto full; // Current Directory
+  st.st_ino = dir_parent(ino);
+  if (offset < 2 && fill_dir(req, buffer, size, &used, "..", &st, 2))
+    goto full; // Parent Directory
+
+  // go through the entries after offset and add them to the list, skipping
+  // the holes left by removed files, until the buffer is full
+  unsigned int slot = offset < 2 ? 0 : offset - 2;
+  for (const dir_entry *de; (de = next_dir_entry(ino, &slot)); slot++) {
+    inode *in = get_inode(de->ino);
+    char bnr[FS_NAME_LEN + 1];
+    snprintf(bnr, sizeof(bnr), "%.*s", FS_NAME_LEN, de->name);
+    if (!in)
+      continue;
+    st.st_ino = de->ino;
+    st.st_mode = in->mode;
+    if (fill_dir(req, buffer, size, &used, bnr, &st, slot + 3))
+      break;
+  }
+
+full:
+  unlock_fs();
+  fuse_reply_buf(req, buffer, used);
+  free(buffer);
+  op_done(TRACE_READDIR, ino, offset, size, used, start);
 }
 
-// Loads the unique flat directory (one block) and fills the buffer with
-// the right names.
-static int do_readdir(const char *path, void *buffer, fuse_fill_dir_t filler,
-                      off_t offset, struct fuse_file_info *fi) {
-  printf("--> Getting The List of Files of %s\n", path);
-
-  filler(buffer, ".", NULL, 0);  // Current Directory
-  filler(buffer, "..", NULL, 0); // Parent Directory
-
-  if (strcmp(path, "/") ==
-      0) // If the user is trying to show the files/directories of the root
-         // directory show the following
-  {
-    // load root directory (block 0 is the block list, block 1 root dir)
-    fs_block rootb;
-    readBlock(ROOTDIR_BID, rootb.bytes);
-
-    // go through all entries and add them to the list with "filler"
-    // note that the number of entries is limited to one block!
-    // TODO: [LARGE_DIR] Extend the FS to allow directories larger than one
-    // block Hint: linked block lists again
-    for (int i = 0;
-         i < DIR_ENTRIES_PER_BLOCK && !(dir_entry_is_empty(rootb.directory[i]));
-         i++) {
-      char bnr[FS_NAME_LEN];
-      snprintf(bnr, FS_NAME_LEN, "%s", rootb.directory[i].name);
-      // printf("   > %d-%s\n",i,bnr);
-      filler(buffer, bnr, NULL, 0);
+// Readahead: when a handle reads a file sequentially, the blocks after the
+// read are prefetched, so the next reads find them in memory. The window
+// starts at RA_MIN_BLOCKS and doubles with every sequential read, up to
+// RA_MAX_BLOCKS. A read somewhere else stops it.
+#define RA_MIN_BLOCKS 16
+#define RA_MAX_BLOCKS 1024
+
+// an open handle, what fi->fh points at
+typedef struct {
+  pthread_mutex_t lock; // reads of the same handle can run at the same time
+  off_t next;           // where a sequential read would start
+  off_t ra_end;         // end of the blocks prefetched so far
+  unsigned int window;  // blocks to keep prefetched, 0 if not sequential
+  char *text;           // the statistics, for a handle of STATS_NAME
+  size_t text_size;
+} open_file;
+
+// sequential reads, how many of them were prefetched, for do_destroy
+static unsigned long ra_reads, ra_hits;
+
+// zeros, for the holes of the files, ZERO_BLOCKS blocks at a time
+#define ZERO_BLOCKS 128
+static char zeros[ZERO_BLOCKS * BLOCK_SIZE];
+
+// returns how many of the n blocks in bids from b on go together: the
+// blocks that follow each other on the disk, or up to ZERO_BLOCKS of the
+// holes (EOF_BLOCK, from file_map)
+static int run_length(int *bids, int n, int b) {
+  int run = 1;
+  if (bids[b] == (int)EOF_BLOCK)
+    while (b + run < n && bids[b + run] == (int)EOF_BLOCK && run < ZERO_BLOCKS)
+      run++;
+  else
+    while (b + run < n && bids[b + run] == bids[b] + run)
+      run++;
+  return run;
+}
+
+// prefetches the blocks of the file of inode ino covering bytes from..to-1,
+// one request per run of consecutive blocks, all sent with one system call
+// when the disk has io_uring. The inode must be locked.
+static void prefetch_file(int ino, off_t from, off_t to) {
+  int bids[RA_MAX_BLOCKS];
+  unsigned int first = from / BLOCK_SIZE;
+  int n = file_map(ino, first, min((to - 1) / BLOCK_SIZE - first + 1,
+                                   RA_MAX_BLOCKS), bids);
+  for (int b = 0, run; b < n; b += run) {
+    run = run_length(bids, n, b);
+    // the holes have nothing to read
+    if (bids[b] != (int)EOF_BLOCK)
+      prefetchBlocks(bids[b], run);
+  }
+  submitBlocks();
+}
+
+// notes a read of size bytes at offset through the handle in fi, and
+// prefetches what comes next if the handle reads sequentially. Another
+// part is prefetched once the reader gets within half a window of the end
+// of what was. The inode must be locked.
+static void read_ahead(struct fuse_file_info *fi, int ino, off_t offset,
+                       size_t size, off_t file_size) {
+  open_file *of = (open_file *)(uintptr_t)fi->fh;
+  off_t end = offset + size, from = 0, to = 0;
+  if (!of)
+    return;
+  pthread_mutex_lock(&of->lock);
+  if (offset == of->next) {
+    __atomic_add_fetch(&ra_reads, 1, __ATOMIC_RELAXED);
+    if (end <= of->ra_end)
+      __atomic_add_fetch(&ra_hits, 1, __ATOMIC_RELAXED);
+    of->window = of->window ? min(2 * of->window, RA_MAX_BLOCKS)
+                            : RA_MIN_BLOCKS;
+    off_t ahead = (off_t)of->window * BLOCK_SIZE;
+    if (of->ra_end < end + ahead / 2) {
+      from = of->ra_end > end ? of->ra_end : end;
+      to = min(end + ahead, file_size);
+      of->ra_end = end + ahead;
     }
   } else {
-    // it's a subdirectory. Should locate it and display its contents.
-    return -1;
+    of->window = 0;
+    of->ra_end = 0;
   }
-
-  return 0;
+  of->next = end;
+  pthread_mutex_unlock(&of->lock);
+  if (from < to)
+    prefetch_file(ino, from, to);
 }
 
-// Reads size bytes from the file path, from given offset (not yet!) and
-// puts them in the buffer.
-// TODO: [READ_OFFSET] get to the right offset (navigate the file blocks) to
-// read the size It works ok even if you read no more than one block at the time
-// but make sure you return the right number of bytes you read.
-static int do_read(const char *path, char *buffer, size_t size, off_t offset,
-                   struct fuse_file_info *fi) {
-                     printf("--> Trying to read %s, %ld, %zu\n", path, offset, size);
-
-                     // skip the "/" in the begining
-                     const char *fn = &path[1];
-                     // let's figure out the dir entry for the path
-                     load_directory();
-                     int di = find_dir_entry(fn);
-                     if (di < 0) {
-                       // no such file
-                       printf("    no such file\n");
-                       return -ENOENT;
-                     }
-                     dir_entry *de = index2dir_entry(di);
-                     unsigned bid = de->first_block;
-                     //de->atime = time(0);
-                     //save_directory();
-
-                     char bcache[BLOCK_SIZE];
-                     unsigned short *bmap = load_blockmap();
-
-                     unsigned int byte_offset = offset % BLOCK_SIZE;
-                     unsigned int block_offset = offset / BLOCK_SIZE;
-
-                     for (int i = 0; i < block_offset;i++) {
-                         bid = bmap[bid];
-                     }
-
-                     if (bid == EOF_BLOCK) return 0;
-                     // ... //
-                     // reads the block into the cache
-                     readBlock(bid, bcache);
-                     // cannot read all maybe?
-                     size_t rsize = min(size, BLOCK_SIZE - byte_offset);
-                     memcpy(buffer, bcache + byte_offset, rsize);
-                     // ... //
-                     size -= rsize;
-                     bid = bmap[bid];
-                     while(size >= BLOCK_SIZE && bid != EOF_BLOCK) {
-                       readBlock(bid, bcache);
-                       memcpy(buffer + rsize, bcache, BLOCK_SIZE);
-                       bid = bmap[bid];
-                       size -= BLOCK_SIZE;
-                       rsize += BLOCK_SIZE;
-                     }
-                     if(size > 0 && bid != EOF_BLOCK) {
-                       readBlock(bid,bcache);
-                       memcpy(buffer + rsize, bcache, size);
-                       rsize += size;
-                     }
-                     // we now fill the buffer with this block contents
-                     // TODO: [READ_OFFSET] account for the offset! May need to traverse the blocks
-                     // of this file until the block holding the right offset. Have a look at
-                     // do_write.
-                     // how much did we read?
-                     return rsize;
-}
-
-// Writes buffer to file, at given offset. Should extend the file if necessary
-// which could mean allocating blocks. Expects to write the full size.
-// TODO: [LARGE_WRITE] As is, it does not allow for writes extending over
-// several blocks. fix that.
-static int do_write(const char *path, const char *buffer, size_t size,
-                    off_t offset, struct fuse_file_info *fi) {
-  printf("--> Trying to write %s, %ld, %zu\n", path, offset, size);
-
-  // let's figure out the dir entry
-  // skip the "/" in the begining
-  const char *fn = &path[1];
-  // let's figure out the dir entry for the path
-  load_directory();
-  int di = find_dir_entry(fn);
-  if (di < 0) { // no such file
-    printf("    no such file\n");
-    return -ENOENT;
+// Returns the size bytes of the file of inode ino from offset as buffers of
+// the disk file, one per run of consecutive blocks, so FUSE can move the
+// data between the disk file and the kernel without copying it through
+// our memory (with splice, when the kernel has it). The cached copies of
+// the blocks are written back first, and dropped if write is set. The
+// delayed blocks at the end of the file are one more buffer, in memory.
+// The holes (and the preallocated blocks) read from zeros, a write must
+// get them blocks with file_fill first. Covers less than size if the file
+// does not have the blocks. NULL if the blocks cannot be mapped.
+static struct fuse_bufvec *file_bufs(int ino, size_t size, off_t offset,
+                                     int write) {
+  unsigned int byte_offset = offset % BLOCK_SIZE;
+  unsigned int block_offset = offset / BLOCK_SIZE;
+  int nblocks = (byte_offset + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+  // collect the ids of the blocks, straight from the file's extents. There
+  // is at most one buffer per block, and one for the delayed ones.
+  int *bids = malloc(nblocks * sizeof(int));
+  struct fuse_bufvec *bufv =
+      malloc(sizeof(*bufv) + (nblocks + 1) * sizeof(struct fuse_buf));
+  if (!bids || !bufv) {
+    free(bids);
+    free(bufv);
+    return NULL;
   }
-  dir_entry *de = index2dir_entry(di);
-
-  // load the block map
-  unsigned short *bmap = load_blockmap();
-
-  // do we need to extend the file size?
-  if (offset + size > de->size_bytes) {
-    // file needs to grow
-    printf("   file needs to grow by %lu bytes\n",
-           offset + size - de->size_bytes);
-    // allocate blocks and write it
-    if (de->first_block == EOF_BLOCK) {
-      // this is an empty file! start by allocating a new block
-      de->first_block = alloc_block();
-      if (de->first_block == EOF_BLOCK) {
-        printf("   no more free blocks!\n");
-        return -ENOSPC;
-      }
+  int n = file_map(ino, block_offset, nblocks, bids);
+  char *delayed = n < nblocks ? file_delayed(ino, block_offset + n) : NULL;
+  int covered = delayed ? nblocks : n;
+  size = covered > 0 ? min(size, covered * BLOCK_SIZE - byte_offset) : 0;
+  *bufv = FUSE_BUFVEC_INIT(0);
+  bufv->count = 0;
+  for (int b = 0, run; b < n && size > 0; b += run) {
+    int hole = bids[b] == (int)EOF_BLOCK;
+    run = run_length(bids, n, b);
+    if (hole ? write : uncacheBlocks(bids[b], run, write) < 0) {
+      free(bids);
+      free(bufv);
+      return NULL;
     }
-    // update the size of the file
-    de->size_bytes = offset + size;
-    de->mtime = time(0);
-    de->atime = time(0);
-    de->ctime = time(0);
-
-    // flush back the directory, since the file info changed
-    save_directory();
-  }
-  // first figure out where the write starts (offset in blocks)
-  unsigned short blkoffs = offset / BLOCK_SIZE;
-  // offset within that block
-  unsigned short byteoffs = offset % BLOCK_SIZE;
-  // how many bytes to write in this block
-  unsigned short crtsize = min(size, BLOCK_SIZE - byteoffs);
-
-  // Depending on how the blocks in a files are organized, blkoffs needs to
-  // be mapped to a physical disk block. 3rd block in a contiguous mapped file
-  // means the third block in line from the first block. For a file allocated
-  // as a linked list of blocks, this is something like this:
-  unsigned short crtblk = de->first_block;
-  // navigate to the proper block
-  while (blkoffs) {
-    // not yet in the right block.
-    if (bmap[crtblk] != EOF_BLOCK) {
-      // follow the link
-      crtblk = bmap[crtblk];
-    } else {
-      // past the ends of the blocks, need to allocate a new one
-      unsigned short nblk = alloc_block();
-      if (nblk == EOF_BLOCK) {
-        // cannot allocate more, failed
-        printf("   out of free blocks!\n");
-        return -ENOSPC;
-      }
-      // add the new block to the list
-      bmap[crtblk] = nblk;
-      // advance to it
-      crtblk = nblk;
+    struct fuse_buf *buf = &bufv->buf[bufv->count++];
+    if (hole) {
+      buf->flags = 0;
+      buf->mem = zeros;
+      buf->size = run * BLOCK_SIZE;
+      continue;
     }
-    blkoffs--;
-  }
-  // here crtblk should point to the right block
-  printf(" --: start writing at block %u", crtblk);
-
-  char bcache[BLOCK_SIZE];
-  // reads the block into the cache
-  readBlock(crtblk, bcache);
-  // modifies it by writing some bytes from the buffer
-  // TODO: [LARGE_WRITE] this only writes one block! needs to be modified to
-  // write all, if there are more than 1. Consider a while loop around this.
-  // Consider also allocating all new blocks from the start, and then come
-  // back to write them.
-  memcpy(bcache + byteoffs, buffer, crtsize);
-  // write it back
-  writeBlock(crtblk, bcache);
-
-  // ... //
-  // make sure to update the blockl map
-  save_blockmap();
+    buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+    buf->fd = diskFile();
+    buf->mem = NULL;
+    buf->pos = (off_t)bids[b] * BLOCK_SIZE;
+    buf->size = run * BLOCK_SIZE;
+  }
+  free(bids);
+  if (delayed && size > 0) {
+    struct fuse_buf *buf = &bufv->buf[bufv->count++];
+    buf->flags = 0;
+    buf->mem = delayed;
+    buf->size = (nblocks - n) * BLOCK_SIZE;
+  }
 
-  // how much did we write? lie here to get this running for one block
-  // TODO: [LARGE_WRITE] must make sure to write the full size bytes, which
-  // might mean several blocks
-  return size;
+  // the first buffer starts inside its block, the last one may end inside
+  if (bufv->count > 0) {
+    if (bufv->buf[0].flags & FUSE_BUF_IS_FD)
+      bufv->buf[0].pos += byte_offset;
+    else
+      bufv->buf[0].mem = (char *)bufv->buf[0].mem + byte_offset;
+    bufv->buf[0].size -= byte_offset;
+    bufv->buf[bufv->count - 1].size -= fuse_buf_size(bufv) - size;
+  }
+  return bufv;
 }
 
-// Called when the FS is dismounted
-static void do_destroy(void *priv_data) {
-  closeDisk();
-  printf("--> FS closed.\n");
+// Reads size bytes from the file of inode ino, from given offset. The
+// reply points at the blocks in the disk file, so they are not copied
+// into a buffer first. The data of a small file comes from its inode.
+static void do_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+                    off_t offset, struct fuse_file_info *fi) {
+  uint64_t start = stats_clock();
+  if (ino == STATS_INO) {
+    open_file *of = (open_file *)(uintptr_t)fi->fh;
+    size_t n = (size_t)offset < of->text_size
+                   ? min(size, of->text_size - offset)
+                   : 0;
+    fuse_reply_buf(req, of->text + offset, n);
+    op_done(TRACE_READ, ino, offset, size, n, start);
+    return;
+  }
+  // other readers can go on at the same time, writers wait
+  inode *de = lock_inode(ino, 0);
+  if (!de) {
+    fuse_reply_err(req, ENOENT);
+    op_done(TRACE_READ, ino, offset, size, -ENOENT, start);
+    return;
+  }
+  if (S_ISDIR(de->mode) || offset >= de->size_bytes) {
+    int res = S_ISDIR(de->mode) ? EISDIR : 0;
+    unlock_inode(ino);
+    if (res)
+      fuse_reply_err(req, res);
+    else
+      fuse_reply_buf(req, NULL, 0);
+    op_done(TRACE_READ, ino, offset, size, -res, start);
+    return;
+  }
+  // de->atime = time(0);
+  // save_inode(ino);
+
+  // never read past the end of the file
+  size_t asked = size;
+  size = min(size, de->size_bytes - offset);
+  char *data = file_inline(ino);
+  if (data) {
+    // a small file is all in its inode, there are no blocks to read
+    fuse_reply_buf(req, data + offset, size);
+    unlock_inode(ino);
+    op_done(TRACE_READ, ino, offset, asked, size, start);
+    return;
+  }
+  read_ahead(fi, ino, offset, size, de->size_bytes);
+  struct fuse_bufvec *bufv = file_bufs(ino, size, offset, 0);
+  // the blocks must not change until the data is sent
+  if (bufv)
+    fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+  else
+    fuse_reply_err(req, EIO);
+  unlock_inode(ino);
+  op_done(TRACE_READ, ino, offset, asked, bufv ? (int)size : -EIO, start);
+  free(bufv);
 }
 
-// needed for "cp" and creating new files
-static int do_chmod(const char *path, mode_t mo) {
-  printf("--> Trying to chmod %s, %hu\n", path, mo);
-  return 0;
+// gets the blocks of the file of inode ino ready for a write of size bytes
+// at offset: a write past the end leaves a hole before the block it starts
+// in, the missing blocks at the end are added, for now in memory, and the
+// holes (or preallocated blocks) written to get their blocks. Returns -1
+// if there is no room.
+static int write_room(int ino, off_t offset, size_t size) {
+  unsigned int lastblk = (offset + size - 1) / BLOCK_SIZE;
+  if (file_hole(ino, offset / BLOCK_SIZE) < 0)
+    return -1;
+  if (file_nblocks(ino) <= lastblk && file_delay(ino, lastblk + 1) < 0)
+    return -1;
+  return file_fill(ino, offset, size);
 }
 
-// may be needed. for now just used to monitor
-static int do_chown(const char *path, uid_t uid, gid_t gid) {
-  printf("--> Trying to chown %s, %u, %u\n", path, uid, gid);
-  return 0;
+// Writes the data in bufv to the file of inode ino, at given offset.
+// Extends the file if necessary, with a hole up to the write and delayed
+// blocks up to its end, which stay in memory until enough of them are
+// there to allocate them in a few large runs. The data for the other
+// blocks goes straight from the request to the blocks in the disk file,
+// without being copied into a buffer first. A small file gets its data in
+// its inode, until it grows past INLINE_SIZE.
+static void do_write_buf(fuse_req_t req, fuse_ino_t ino,
+                         struct fuse_bufvec *bufv, off_t offset,
+                         struct fuse_file_info *fi) {
+  uint64_t start = stats_clock();
+  size_t size = fuse_buf_size(bufv);
+  if (size == 0) {
+    fuse_reply_write(req, 0);
+    op_done(TRACE_WRITE, ino, offset, 0, 0, start);
+    return;
+  }
+  if (offset > FILE_MAX_BYTES || size > (size_t)(FILE_MAX_BYTES - offset)) {
+    fuse_reply_err(req, EFBIG);
+    op_done(TRACE_WRITE, ino, offset, size, -EFBIG, start);
+    return;
+  }
+  // one writer at a time, and no readers in between
+  inode *de;
+  int retries = 0;
+again:
+  de = lock_inode(ino, 1);
+  if (!de || S_ISDIR(de->mode)) {
+    if (de)
+      unlock_inode(ino);
+    fuse_reply_err(req, de ? EISDIR : ENOENT);
+    op_done(TRACE_WRITE, ino, offset, size, de ? -EISDIR : -ENOENT, start);
+    return;
+  }
+
+  // a small file keeps its data in its inode, otherwise the blocks are
+  // made ready for the write
+  int in_inode = file_keep_inline(ino, offset + size);
+  if (in_inode < 0 || (!in_inode && write_room(ino, offset, size) < 0)) {
+    unlock_inode(ino);
+    // the blocks freed since the last commit may be enough
+    if (retries++ < FS_RECLAIM_RETRIES && reclaim_blocks())
+      goto again;
+    save_blockmap();
+    fuse_reply_err(req, ENOSPC);
+    op_done(TRACE_WRITE, ino, offset, size, -ENOSPC, start);
+    return;
+  }
+
+  ssize_t written;
+  if (in_inode) {
+    struct fuse_bufvec out = FUSE_BUFVEC_INIT(size);
+    out.buf[0].mem = file_inline(ino) + offset;
+    written = fuse_buf_copy(&out, bufv, 0);
+  } else {
+    struct fuse_bufvec *out = file_bufs(ino, size, offset, 1);
+    written = out ? fuse_buf_copy(out, bufv, 0) : -EIO;
+    free(out);
+  }
+  if (written > 0 && offset + written > de->size_bytes)
+    de->size_bytes = offset + written; // update the size of the file
+  de->mtime = time(0);
+  de->ctime = time(0);
+
+  // make sure to update the block map and the inode. The delayed blocks
+  // get allocated if there are too many, otherwise on fsync or release.
+  // Failing that is reported there, the data is still in memory.
+  file_allocate(ino, 0);
+  save_inode(ino);
+  unlock_inode(ino);
+  save_blockmap();
+  if (written > 0)
+    fuse_reply_write(req, written);
+  else
+    fuse_reply_err(req, written < 0 ? -written : EIO);
+  op_done(TRACE_WRITE, ino, offset, size, written != 0 ? written : -EIO,
+           start);
 }
-static int do_utimens(const char *path, const struct timespec tv[2]) {
-  printf("--> Trying to utimens %s\n", path);
-  return 0;
+
+// Forces the cached blocks of the file system to the disk, after giving
+// the delayed blocks of the file their place on it
+static void do_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                     struct fuse_file_info *fi) {
+  uint64_t start = stats_clock();
+  int res = 0;
+  if (lock_inode(ino, 1)) {
+    res = file_allocate(ino, 1);
+    unlock_inode(ino);
+  }
+  if (fs_sync() < 0)
+    res = -1;
+  fuse_reply_err(req, res < 0 ? EIO : 0);
+  op_done(TRACE_FSYNC, ino, 0, 0, res < 0 ? -EIO : 0, start);
 }
 
-// Truncates and existing file down to 0. If no such file exists, it allocates
-// a new dir entry and sets its size to 0 ???
-// TODO: [TRUNC_FREE] If the file exists, you need to free its blocks properly,
-// or there will be space leaking from the disk.
-static int do_truncate(const char *path, off_t offset) {
-  printf("--> Trying to truncate %s, %ld\n", path, offset);
-
-  // locate file
-  // skip the "/" in the begining
-  const char *fn = &path[1];
-  // let's figure out the dir entry for the path
-  load_directory();
-  int di = find_dir_entry(fn);
-  if (di < 0) {
-    // no such file - do nothing?!
-    printf("  > No such file exists.");
-    return -ENOENT;
-  } else {
-    // file found! must alter both the Directory
-    // and free the blocks of the file to the free blocks
-    printf("  > file exits. truncate it.");
+// Reports the size and free space of the file system (df). The free
+// blocks are counted in the superblock as they are allocated, so this does
+// not look at the bitmap.
+static void do_statfs(fuse_req_t req, fuse_ino_t ino) {
+  uint64_t start = stats_clock();
+  superblock s = get_super();
+  struct statvfs st;
+  memset(&st, 0, sizeof(st));
+  st.f_bsize = BLOCK_SIZE;
+  st.f_frsize = BLOCK_SIZE;
+  st.f_blocks = s.nblocks;
+  st.f_bfree = s.free_blocks;
+  st.f_bavail = s.free_blocks;
+  // the inode table grows into the free blocks when it is full
+  st.f_files = s.ninodes + (fsfilcnt_t)s.free_blocks * INODES_PER_BLOCK;
+  st.f_ffree = s.free_inodes + (fsfilcnt_t)s.free_blocks * INODES_PER_BLOCK;
+  st.f_favail = st.f_ffree;
+  st.f_namemax = FS_NAME_LEN;
+  fuse_reply_statfs(req, &st);
+  op_done(TRACE_STATFS, ino, 0, 0, 0, start);
+}
 
-    dir_entry *de = index2dir_entry(di);
-    de->size_bytes = offset;
+// prints the statistics of the operations, and what the block cache, the
+// readahead, the allocator and the journal did
+static void print_stats(FILE *f) {
+  struct cache_stats cs;
+  struct fs_stats fs;
+  getCacheStats(&cs);
+  get_fs_stats(&fs);
+  stats_print(f);
+  fprintf(f, "block cache: %lu hits, %lu misses, %lu evictions, %lu "
+             "writebacks\n",
+          cs.hits, cs.misses, cs.evictions, cs.writebacks);
+  fprintf(f, "readahead: %lu sequential reads, %lu already prefetched, %lu "
+             "blocks prefetched\n",
+          __atomic_load_n(&ra_reads, __ATOMIC_RELAXED),
+          __atomic_load_n(&ra_hits, __ATOMIC_RELAXED), cs.prefetched);
+  fprintf(f, "blocks: %lu allocated, %lu freed\n", fs.blocks_allocated,
+          fs.blocks_freed);
+  fprintf(f, "journal: %lu commits, %lu blocks, %lu checkpoints\n",
+          fs.commits, fs.blocks_journaled, fs.checkpoints);
+}
 
-    unsigned short *bmap = load_blockmap();
-    unsigned int block_offset = offset / BLOCK_SIZE;
-    unsigned short cur = de->first_block;
+// Called when the FS is dismounted
+static void do_destroy(void *priv_data) {
+  fs_unmount();
+  printf("--> FS closed.\n");
+  print_stats(stdout);
+  closeDisk();
+  if (trace_close() < 0)
+    perror("cannot write the trace");
+}
 
-    //free_block(de->first_block);
-    if (cur == EOF_BLOCK && block_offset > 0) {
-        cur = alloc_block();
-        de->first_block = cur;
-    }
-    // TODO: [TRUNC_FREE] also free the blocks of this file!
-    // load block map
-    for (int i = 0; i < block_offset;i++) {
-      if (cur == EOF_BLOCK && (block_offset - i) != 1) {
-        bmap[cur] = alloc_block();
-      }
-      if (cur != EOF_BLOCK) {
-        cur = bmap[cur];
-      }
-    }
+// Truncates the file of inode ino to the given size, freeing the blocks
+// past the end, or growing it with a hole. A small file stays inline.
+static int resize_file(int ino, off_t offset) {
+  inode *de;
+  int retries = 0;
+again:
+  if (offset > FILE_MAX_BYTES)
+    return -EFBIG;
+  de = lock_inode(ino, 1);
+  if (!de)
+    return -ENOENT;
+  if (S_ISDIR(de->mode)) {
+    unlock_inode(ino);
+    return -EISDIR;
+  }
+  // file found! must alter both the inode
+  // and the blocks of the file
 
-    unsigned short last = cur;
-    if (cur != EOF_BLOCK)
-      cur = bmap[cur];
-
-    if (cur != EOF_BLOCK && bmap[cur] != EOF_BLOCK) {
-      /* code */
-      while(cur != EOF_BLOCK) {
-        unsigned short new = bmap[cur];
-        free_block(cur);
-        cur = bmap[cur];
-        cur = new;
-      }
-      if(last != EOF_BLOCK) {
-        bmap[last] = EOF_BLOCK;
-      }
-    }
+  int in_inode = file_keep_inline(ino, offset);
+  unsigned int nblocks = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  int res = in_inode;
+  if (!in_inode)
+    res = offset >= de->size_bytes ? file_hole(ino, nblocks)
+                                   : file_resize(ino, nblocks);
+  if (res < 0) {
+    unlock_inode(ino);
+    if (retries++ < FS_RECLAIM_RETRIES && reclaim_blocks())
+      goto again;
     save_blockmap();
-    // save block map
-
-    // for now just cut loose all blocks! block leak!
-    de->first_block = EOF_BLOCK;
-    // must save directory changes to disk!
-    save_directory();
+    return -ENOSPC;
+  }
+  // bytes past the end of the file must read as 0s if it grows again
+  if (in_inode && offset < de->size_bytes) {
+    memset(file_inline(ino) + offset, 0, INLINE_SIZE - offset);
+  } else if (!in_inode && offset < de->size_bytes && offset % BLOCK_SIZE) {
+    char bcache[BLOCK_SIZE];
+    char *delayed = file_delayed(ino, nblocks - 1);
+    block_id last = file_block(ino, nblocks - 1);
+    if (delayed) {
+      memset(delayed + offset % BLOCK_SIZE, 0,
+             BLOCK_SIZE - offset % BLOCK_SIZE);
+    } else if (last != EOF_BLOCK) { // a hole is zeros already
+      readBlock(last, bcache);
+      memset(bcache + offset % BLOCK_SIZE, 0,
+             BLOCK_SIZE - offset % BLOCK_SIZE);
+      writeBlock(last, bcache);
+    }
   }
+  de->size_bytes = offset;
+  de->mtime = time(0);
+  de->ctime = time(0);
+
+  // must save inode changes to disk!
+  save_inode(ino);
+  unlock_inode(ino);
+  save_blockmap();
   return 0;
 }
 
-// TODO: [RENAME] implement this!
-static int do_rename(const char *opath, const char *npath) {
-  printf("--> Trying to rename %s to %s\n", opath, npath);
-  const char *fn = &opath[1];
-  int di = find_dir_entry(fn);
-  if (di < 0) {
-    printf("No such file: %s\n", opath);
+// Changes the attributes of inode ino. Only the size is kept: truncate, or
+// ftruncate with fi. The mode, owner and times are accepted and ignored, as
+// needed for "cp" and creating new files.
+static void do_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                       int to_set, struct fuse_file_info *fi) {
+  uint64_t start = stats_clock();
+  int res = 0;
+  if (to_set & FUSE_SET_ATTR_SIZE)
+    res = ino == STATS_INO ? -EACCES : resize_file(ino, attr->st_size);
+  struct stat st;
+  if (res == 0)
+    res = ino_stat(ino, &st);
+  if (res < 0)
+    fuse_reply_err(req, -res);
+  else
+    fuse_reply_attr(req, &st, attr_timeout);
+  // a truncate has the new size as its offset
+  op_done(TRACE_SETATTR, ino,
+           to_set & FUSE_SET_ATTR_SIZE ? attr->st_size : 0, 0, res, start);
+}
+
+// gives the file of inode ino blocks for bytes offset..end-1, see
+// do_fallocate. Grows the file to end unless keep_size is set.
+static int preallocate(int ino, int keep_size, off_t offset, off_t end) {
+  inode *de;
+  int retries = 0;
+again:
+  de = lock_inode(ino, 1);
+  if (!de)
     return -ENOENT;
-  } else {
-    dir_entry *de = index2dir_entry(di);
-    printf("changing name from %s to %s\n", de->name, npath);
-    if (npath[0] == '/') {
-      char * newpath = strdup(npath);
-      memmove(newpath,newpath+1,strlen(newpath));
-      printf("new path: %s\n", newpath);
-      strcpy(de->name, newpath);
-    } else {
-      strcpy(de->name, npath);
-    }
-    save_directory();
+  if (S_ISDIR(de->mode)) {
+    unlock_inode(ino);
+    return -EISDIR;
+  }
+  // a small file needs no blocks
+  int in_inode = file_keep_inline(ino, end);
+  if (in_inode < 0 ||
+      (!in_inode && file_prealloc(ino, offset / BLOCK_SIZE,
+                                  (end + BLOCK_SIZE - 1) / BLOCK_SIZE) < 0)) {
+    unlock_inode(ino);
+    if (retries++ < FS_RECLAIM_RETRIES && reclaim_blocks())
+      goto again;
+    save_blockmap();
+    return -ENOSPC;
+  }
+  if (!keep_size && end > de->size_bytes) {
+    de->size_bytes = end;
+    de->mtime = time(0);
   }
-  return 0; // reports success, but does nothing
+  de->ctime = time(0);
+  save_inode(ino);
+  unlock_inode(ino);
+  save_blockmap();
+  return 0;
 }
 
-// TODO: [REMOVE] implement this!
-static int do_unlink(const char *path) {
-  printf("--> Trying to remove %s\n", path);
-  const char *fn = &path[1];
-  int di = find_dir_entry(fn);
-  if (di < 0) {
-    printf("No such file: %s\n", path);
-    return -ENOENT;
-  } else {
-    dir_entry *de = index2dir_entry(di);
-    unsigned short cur = de->first_block;
-    unsigned short *bmap = load_blockmap();
-    while(cur != EOF_BLOCK) {
-      unsigned short new = bmap[cur];
-      free_block(cur);
-      cur = bmap[cur];
-      cur = new;
-    }
-    strcpy(de->name, "");
-    save_directory();
+// Preallocates the blocks of the file of inode ino for length bytes from
+// offset, in as few runs as the free space allows, so a file made to be
+// written later (a database) is cheap to create and laid out in order.
+// The blocks stay unwritten: they read as zeros without being zeroed
+// first. The file grows unless mode has FALLOC_FL_KEEP_SIZE, the other
+// modes (punching holes...) are not supported. Past FILE_MAX_BYTES, the
+// extents could not address the blocks.
+static void do_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+                         off_t offset, off_t length,
+                         struct fuse_file_info *fi) {
+  uint64_t start = stats_clock();
+  int res;
+  if (mode & ~FALLOC_FL_KEEP_SIZE)
+    res = -EOPNOTSUPP;
+  else if (ino == STATS_INO)
+    res = -EACCES;
+  else if (offset < 0 || length <= 0)
+    res = -EINVAL;
+  else if (offset > FILE_MAX_BYTES || length > FILE_MAX_BYTES - offset)
+    res = -EFBIG;
+  else
+    res = preallocate(ino, mode & FALLOC_FL_KEEP_SIZE, offset,
+                      offset + length);
+  fuse_reply_err(req, -res);
+  op_done(TRACE_FALLOCATE, ino, offset, length, res, start);
+}
+
+// Renames a file or directory, possibly moving it to another directory.
+// Replaces the file (or empty directory) with the new name if there is one.
+// Only the directory entries change, the inode and its open handles stay.
+static void do_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                      fuse_ino_t newparent, const char *newname) {
+  uint64_t start = stats_clock();
+  lock_fs();
+  int ino = find_entry(parent, name);
+  if (is_stats(parent, name) || is_stats(newparent, newname))
+    ino = -EACCES;
+  if (ino < 0) {
+    unlock_fs();
+    fuse_reply_err(req, -ino);
+    op_done(TRACE_RENAME, parent, 0, 0, ino, start);
+    return;
   }
-  return 0; // reports success, but does nothing
+  int res = move_dir_entry(ino, newparent, newname);
+  if (res == 0) {
+    lock_inode(ino, 1)->ctime = time(0);
+    save_inode(ino);
+    unlock_inode(ino);
+  }
+  unlock_fs();
+  save_blockmap();
+  fuse_reply_err(req, -res);
+  op_done(TRACE_RENAME, parent, 0, 0, res, start);
+}
+
+// Removes a file, its blocks go back to the free space once it is closed
+// and the kernel has forgotten it
+static void do_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  uint64_t start = stats_clock();
+  lock_fs();
+  int ino = find_entry(parent, name), res = ino < 0 ? ino : 0;
+  if (is_stats(parent, name))
+    res = -EACCES;
+  else if (ino >= 0 && S_ISDIR(get_inode(ino)->mode))
+    res = -EISDIR;
+  else if (ino >= 0)
+    remove_dir_entry(ino);
+  unlock_fs();
+  save_blockmap();
+  fuse_reply_err(req, -res);
+  op_done(TRACE_UNLINK, parent, 0, 0, res, start);
+}
+
+// Removes an empty directory
+static void do_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  uint64_t start = stats_clock();
+  lock_fs();
+  int ino = find_entry(parent, name), res = 0;
+  if (ino < 0)
+    res = ino;
+  else if (ino == ROOT_INO)
+    res = -EBUSY;
+  else if (!S_ISDIR(get_inode(ino)->mode))
+    res = -ENOTDIR;
+  else if (!dir_is_empty(ino))
+    res = -ENOTEMPTY;
+  else
+    remove_dir_entry(ino);
+  unlock_fs();
+  save_blockmap();
+  fuse_reply_err(req, -res);
+  op_done(TRACE_RMDIR, parent, 0, 0, res, start);
+}
+
+// adds an entry called name to directory dir, a new empty file or directory
+// with mode m, and fills e with it for the kernel. Returns its inode.
+// fs_lock must be held.
+static int add_entry(int dir, const char *name, mode_t m,
+                     struct fuse_entry_param *e) {
+  int old = is_stats(dir, name) ? 0 : find_entry(dir, name);
+  if (old != -ENOENT)
+    return old < 0 ? old : -EEXIST;
+  int ino = new_dir_entry(dir, name, m);
+  if (ino < 0) // no room for the entry
+    return ino;
+  // nobody else can see the new inode before fs_lock is released
+  inode *de = get_inode(ino);
+  de->size_bytes = 0; // no blocks yet
+  de->atime = time(0);
+  de->mtime = time(0);
+  de->ctime = time(0);
+
+  // must save inode and directory changes to disk!
+  save_inode(ino);
+  fill_entry(ino, e);
+  return ino;
+}
+
+static void do_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                     mode_t m) {
+  uint64_t start = stats_clock();
+  struct fuse_entry_param e;
+  lock_fs();
+  int ino = add_entry(parent, name, S_IFDIR | (m & 07777), &e);
+  unlock_fs();
+  save_blockmap();
+  if (ino < 0)
+    fuse_reply_err(req, -ino);
+  else
+    fuse_reply_entry(req, &e);
+  op_done(TRACE_MKDIR, parent, 0, 0, ino, start);
 }
 
 /*
@@ -443,39 +917,113 @@ static int do_mknod(const char *path, mode_t m, dev_t dv) {
 }
 */
 
-static int do_create(const char *path, mode_t m, struct fuse_file_info *ffi) {
-  printf("XXXX> Trying to create %s mode:%u\n", path, m);
-
-  // locate file
-  // skip the "/" in the begining
-  const char *fn = &path[1];
-  load_directory();
-  int ni = first_empty_dir_entry();
-  if (ni < 0) { // cannot do anything
-    printf("  > no empty entries\n");
-    return -ENFILE;
-  }
-  dir_entry *de = index2dir_entry(ni);
-
-  // paths start with "/", skip that
-  strncpy(de->name, fn, FS_NAME_LEN);
-  de->mode = m; // S_IFREG | 0644;
-  de->size_bytes = 0;
-  de->first_block = EOF_BLOCK; // end of file block
-  de->atime = time(0);
-  de->mtime = time(0);
-  de->ctime = time(0);
+// sets up the handle of a file being opened in fi. Returns -ENOMEM if it
+// cannot.
+static int new_handle(struct fuse_file_info *fi) {
+  open_file *of = calloc(1, sizeof(open_file));
+  if (!of)
+    return -ENOMEM;
+  pthread_mutex_init(&of->lock, NULL);
+  fi->fh = (uintptr_t)of;
+  return 0;
+}
 
-  // must save directory changes to disk!
-  save_directory();
+// Creates a file and opens it
+static void do_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                      mode_t m, struct fuse_file_info *ffi) {
+  uint64_t start = stats_clock();
+  struct fuse_entry_param e;
+  lock_fs();
+  int ino = new_handle(ffi);
+  if (ino == 0) {
+    ino = add_entry(parent, name, m, &e); // S_IFREG | 0644;
+    if (ino >= 0)
+      open_inode(ino);
+    else {
+      free((void *)(uintptr_t)ffi->fh);
+      ffi->fh = 0;
+    }
+  }
+  unlock_fs();
+  save_blockmap();
+  if (ino < 0)
+    fuse_reply_err(req, -ino);
+  else
+    fuse_reply_create(req, &e, ffi);
+  op_done(TRACE_CREATE, parent, 0, 0, ino, start);
+}
 
+// opens the statistics, for reading only. They are printed into the handle,
+// the reads get that copy.
+static int open_stats(struct fuse_file_info *fi) {
+  if ((fi->flags & O_ACCMODE) != O_RDONLY)
+    return -EACCES;
+  int res = new_handle(fi);
+  if (res < 0)
+    return res;
+  open_file *of = (open_file *)(uintptr_t)fi->fh;
+  FILE *f = open_memstream(&of->text, &of->text_size);
+  if (!f) {
+    pthread_mutex_destroy(&of->lock);
+    free(of);
+    fi->fh = 0;
+    return -ENOMEM;
+  }
+  print_stats(f);
+  fclose(f);
+  fi->direct_io = 1;
   return 0;
 }
-/*
-static int do_open(const char *path, struct fuse_file_info *ffi) {
-  printf("ZZZZ> Trying to open %s \n", path);
-  return -1;
+
+// Opens a file. The file stays while it is open even if it is removed or
+// renamed.
+static void do_open(fuse_req_t req, fuse_ino_t ino,
+                    struct fuse_file_info *ffi) {
+  uint64_t start = stats_clock();
+  if (ino == STATS_INO) {
+    int res = open_stats(ffi);
+    if (res < 0)
+      fuse_reply_err(req, -res);
+    else
+      fuse_reply_open(req, ffi);
+    op_done(TRACE_OPEN, ino, 0, 0, res, start);
+    return;
+  }
+  lock_fs();
+  inode *in = get_inode(ino);
+  int res = !in ? -ENOENT : S_ISDIR(in->mode) ? -EISDIR : new_handle(ffi);
+  if (res == 0)
+    open_inode(ino);
+  unlock_fs();
+  if (res < 0)
+    fuse_reply_err(req, -res);
+  else
+    fuse_reply_open(req, ffi);
+  op_done(TRACE_OPEN, ino, 0, 0, res, start);
+}
+
+// Closes a handle from open or create, allocating the delayed blocks of
+// the file. A removed file is freed with its last handle, once the kernel
+// has forgotten it too.
+static void do_release(fuse_req_t req, fuse_ino_t ino,
+                       struct fuse_file_info *ffi) {
+  uint64_t start = stats_clock();
+  open_file *of = (open_file *)(uintptr_t)ffi->fh;
+  pthread_mutex_destroy(&of->lock);
+  free(of->text);
+  free(of);
+  if (lock_inode(ino, 1)) {
+    file_allocate(ino, 1);
+    unlock_inode(ino);
+  }
+  lock_fs();
+  release_inode(ino);
+  unlock_fs();
+  save_blockmap();
+  fuse_reply_err(req, 0);
+  op_done(TRACE_RELEASE, ino, 0, 0, 0, start);
 }
+/*
 
 static int do_access(const char *path, int ai) {
   printf("--> Trying to access %s %d\n", path, ai);
@@ -483,31 +1031,98 @@ static int do_access(const char *path, int ai) {
 }
 */
 
-static struct fuse_operations operations = {
+// The low-level operations work with inode numbers, which the kernel gets
+// from lookup (and create, mkdir) and keeps until it calls forget.
+static struct fuse_lowlevel_ops operations = {
+    .lookup = do_lookup,
+    .forget = do_forget,
+    .forget_multi = do_forget_multi,
     .getattr = do_getattr,
     .readdir = do_readdir,
     .read = do_read,
     .destroy = do_destroy,
-    .write = do_write,
-    // just monitoring these for now
-    .chown = do_chown,
-    .utimens = do_utimens,
-    // to make write work
-    .chmod = do_chmod,
-    // needed for write, also called before open on creation
-    .truncate = do_truncate,
-    // to implement
+    .write_buf = do_write_buf,
+    // truncate, ftruncate, and chmod, chown, utimens to make write work
+    .setattr = do_setattr,
     .rename = do_rename,
     .unlink = do_unlink, // implements remove
-                         //  .mknod = do_mknod,
+    .mkdir = do_mkdir,
+    .rmdir = do_rmdir,
+    //  .mknod = do_mknod,
     .create = do_create,
-    //  .open = do_open,
+    .fsync = do_fsync,
+    .statfs = do_statfs,
+    .open = do_open,
+    .release = do_release,
+    .fallocate = do_fallocate,
     //  .access = do_access,
 };
 
+// mounts the file system on the mount point in the arguments, and serves
+// the requests of the kernel until it is unmounted. The requests are
+// handled by several threads, unless -s is given.
+static int serve(int argc, char *argv[]) {
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  struct fuse_chan *ch;
+  struct fuse_session *se;
+  char *mountpoint;
+  int multithreaded, foreground, res = -1;
+  if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) < 0 ||
+      !(ch = fuse_mount(mountpoint, &args))) {
+    fuse_opt_free_args(&args);
+    return -1;
+  }
+  se = fuse_lowlevel_new(&args, &operations, sizeof(operations), NULL);
+  if (se && fuse_set_signal_handlers(se) == 0) {
+    fuse_session_add_chan(se, ch);
+    fuse_daemonize(foreground);
+    res = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+    fuse_remove_signal_handlers(se);
+    fuse_session_remove_chan(ch);
+  }
+  // calls do_destroy, if the kernel got to send init
+  if (se)
+    fuse_session_destroy(se);
+  fuse_unmount(mountpoint, ch);
+  free(mountpoint);
+  fuse_opt_free_args(&args);
+  return res;
+}
+
 int main(int argc, char *argv[]) {
-  if (openDisk(DISK_FILE, BLOCK_SIZE * FS_NBLOCKS) < 0) {
+  // the cache size can be tuned per workload, in blocks
+  char *cache_blocks = getenv("SSFS_CACHE_BLOCKS");
+  if (cache_blocks)
+    setCacheSize(atoi(cache_blocks));
+  // SSFS_DISK=mmap maps the disk file instead of using read/write calls
+  char *disk = getenv("SSFS_DISK");
+  int backend = disk && !strcmp(disk, "mmap") ? DISK_MMAP : DISK_SYSCALL;
+  // how long the kernel may cache entries and attributes, 0 to not cache
+  char *timeout = getenv("SSFS_ENTRY_TIMEOUT");
+  if (timeout)
+    entry_timeout = atof(timeout);
+  timeout = getenv("SSFS_ATTR_TIMEOUT");
+  if (timeout)
+    attr_timeout = atof(timeout);
+  // SSFS_TRACE=[trace file] records the operations, for trace_decode
+  char *trace = getenv("SSFS_TRACE");
+  if (trace && trace_open(trace) < 0) {
+    perror(trace);
+    return -1;
+  }
+  // the disk is as large as the file format_myfs made, the superblock says
+  // how much of it the file system uses
+  int nblocks = openDiskWith(DISK_FILE, 0, backend);
+  if (nblocks < 0) {
     perror("open disk failure");
+    return -1;
+  } else if (fs_mount() < 0) {
+    perror("cannot load the file system metadata");
+    return -1;
+  } else if (sb.nblocks > nblocks) {
+    printf("the disk is smaller than its file system (%d < %u blocks)\n",
+           nblocks, sb.nblocks);
+    return -1;
   } else
-    return fuse_main(argc, argv, &operations, NULL);
+    return serve(argc, argv);
 }
@@ -0,0 +1,107 @@
+#include "stats.h"
+#include "trace.h"
+#include <time.h>
+
+typedef struct {
+  uint64_t count;
+  uint64_t errors;
+  uint64_t bytes;
+  uint64_t total; // ns, for the mean
+  uint64_t max;   // ns
+  uint64_t buckets[STATS_BUCKETS];
+} op_stats;
+
+static op_stats ops[TRACE_NOPS];
+static uint64_t started; // stats_clock() of the first operation
+
+uint64_t stats_clock() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// returns the bucket of latency v. Below STATS_SUB_BUCKETS there is one per
+// ns, above, v's highest bit gives the power of 2 and the bits below it
+// the bucket within it.
+static unsigned int bucket(uint64_t v) {
+  if (v < STATS_SUB_BUCKETS)
+    return v;
+  unsigned int e = 63 - __builtin_clzll(v);
+  return (e - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS +
+         ((v >> (e - STATS_SUB_BITS)) & (STATS_SUB_BUCKETS - 1));
+}
+
+// returns the largest latency counted in bucket b
+static uint64_t bucket_top(unsigned int b) {
+  if (b < STATS_SUB_BUCKETS)
+    return b;
+  unsigned int e = b / STATS_SUB_BUCKETS + STATS_SUB_BITS - 1;
+  uint64_t sub = STATS_SUB_BUCKETS + b % STATS_SUB_BUCKETS;
+  return ((sub + 1) << (e - STATS_SUB_BITS)) - 1;
+}
+
+void stats_op(int op, int result, uint64_t latency) {
+  op_stats *s = &ops[op];
+  uint64_t zero = 0;
+  if (!__atomic_load_n(&started, __ATOMIC_RELAXED))
+    __atomic_compare_exchange_n(&started, &zero, stats_clock() - latency, 0,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&s->count, 1, __ATOMIC_RELAXED);
+  if (result < 0)
+    __atomic_add_fetch(&s->errors, 1, __ATOMIC_RELAXED);
+  else if (op == TRACE_READ || op == TRACE_WRITE)
+    __atomic_add_fetch(&s->bytes, result, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&s->total, latency, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&s->buckets[bucket(latency)], 1, __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&s->max, __ATOMIC_RELAXED);
+  while (latency > max &&
+         !__atomic_compare_exchange_n(&s->max, &max, latency, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+// returns the latency of the one at fraction p of the n counted in
+// buckets (the top of its bucket, at most max)
+static uint64_t percentile(const uint64_t *buckets, uint64_t n, double p,
+                           uint64_t max) {
+  uint64_t rank = p * n, seen = 0;
+  if (rank < p * n || rank == 0)
+    rank++;
+  for (unsigned int b = 0; b < STATS_BUCKETS; b++) {
+    seen += buckets[b];
+    if (seen >= rank)
+      return bucket_top(b) < max ? bucket_top(b) : max;
+  }
+  return max;
+}
+
+void stats_print(FILE *f) {
+  uint64_t since = __atomic_load_n(&started, __ATOMIC_RELAXED);
+  double seconds = since ? (stats_clock() - since) / 1e9 : 0;
+  fprintf(f, "operations in %.3f s, latencies in us:\n", seconds);
+  fprintf(f, "%-8s %10s %7s %12s %10s %10s %10s %10s %10s %10s\n", "op",
+          "count", "errors", "bytes", "ops/s", "mean", "p50", "p99", "p99.9",
+          "max");
+  // a copy of the buckets of each operation, while the threads go on
+  // counting
+  uint64_t buckets[STATS_BUCKETS];
+  for (int op = 0; op < TRACE_NOPS; op++) {
+    op_stats *s = &ops[op];
+    uint64_t count = 0;
+    for (unsigned int b = 0; b < STATS_BUCKETS; b++)
+      count += buckets[b] = __atomic_load_n(&s->buckets[b], __ATOMIC_RELAXED);
+    if (count == 0)
+      continue;
+    uint64_t max = __atomic_load_n(&s->max, __ATOMIC_RELAXED);
+    fprintf(f, "%-8s %10lu %7lu %12lu %10.1f %10.3f %10.3f %10.3f %10.3f "
+               "%10.3f\n",
+            trace_op_names[op], (unsigned long)count,
+            (unsigned long)__atomic_load_n(&s->errors, __ATOMIC_RELAXED),
+            (unsigned long)__atomic_load_n(&s->bytes, __ATOMIC_RELAXED),
+            seconds > 0 ? count / seconds : 0,
+            __atomic_load_n(&s->total, __ATOMIC_RELAXED) / 1e3 / count,
+            percentile(buckets, count, 0.5, max) / 1e3,
+            percentile(buckets, count, 0.99, max) / 1e3,
+            percentile(buckets, count, 0.999, max) / 1e3, max / 1e3);
+  }
+}
@@ -0,0 +1,30 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Statistics of the operations of ssfs, kept all the time: for each
+// operation (numbered as in trace.h) how many there were, how many failed,
+// the bytes read or written and a histogram of the latencies. The
+// histograms have buckets of HDR style: the latencies from 2^e to 2^(e+1)
+// ns are split into STATS_SUB_BUCKETS buckets, so a percentile is within
+// 1/STATS_SUB_BUCKETS of the true one, from ns to hours, with about a
+// thousand counters per operation. Everything is counted with atomic adds,
+// no lock is taken.
+#define STATS_SUB_BITS 4
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS ((64 - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS)
+
+// the time in ns (CLOCK_MONOTONIC), when an operation starts and ends
+uint64_t stats_clock();
+
+// counts operation op, which took latency ns. result is as in trace_event:
+// bytes read or written, or -errno if it failed.
+void stats_op(int op, int result, uint64_t latency);
+
+// prints a table of the operations, with the percentiles of their
+// latencies, and how long since the first statistics were counted
+void stats_print(FILE *f);
+
+#endif // __STATS_H__
@@ -0,0 +1,198 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Runs threads against a mounted file system at the same time, to check
+// that the locking holds up and to see how the throughput scales. Each
+// writer works on its own file (write, read back, truncate, rename) and the
+// readers all read one shared file that a writer keeps rewriting.
+// Usage: stress_fs [mount point] [threads] [seconds]
+
+// bytes per write, and the largest size the files get
+#define CHUNK 4096
+#define MAX_SIZE (16 * CHUNK)
+// the file all the readers read
+#define SHARED "shared"
+
+static const char *mount_point = "mnt";
+static volatile int stop;
+static int failures;
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct {
+  int id;
+  unsigned int seed;
+  long ops;
+  long bytes;
+} worker;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(worker *w, const char *what, const char *path) {
+  pthread_mutex_lock(&report_lock);
+  printf("thread %d: %s %s: %s\n", w->id, what, path, strerror(errno));
+  failures++;
+  stop = 1;
+  pthread_mutex_unlock(&report_lock);
+}
+
+// writes, reads back and checks a file of its own, then shrinks or renames
+// it. The names fit in the 12 characters of an entry.
+static void *writer(void *arg) {
+  worker *w = arg;
+  char path[2][256], *buf = malloc(CHUNK), *check = malloc(CHUNK);
+  snprintf(path[0], sizeof(path[0]), "%s/w%da", mount_point, w->id);
+  snprintf(path[1], sizeof(path[1]), "%s/w%db", mount_point, w->id);
+  int cur = 0;
+  while (!stop) {
+    int fd = open(path[cur], O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+      fail(w, "open", path[cur]);
+      break;
+    }
+    off_t off = rand_r(&w->seed) % (MAX_SIZE / CHUNK) * CHUNK;
+    memset(buf, 'a' + rand_r(&w->seed) % 26, CHUNK);
+    if (pwrite(fd, buf, CHUNK, off) != CHUNK)
+      fail(w, "write", path[cur]);
+    else if (pread(fd, check, CHUNK, off) != CHUNK)
+      fail(w, "read", path[cur]);
+    else if (memcmp(buf, check, CHUNK)) {
+      errno = EIO;
+      fail(w, "compare", path[cur]);
+    }
+    w->bytes += 2 * CHUNK;
+    switch (rand_r(&w->seed) % 8) {
+    case 0:
+      if (ftruncate(fd, rand_r(&w->seed) % MAX_SIZE) < 0)
+        fail(w, "truncate", path[cur]);
+      break;
+    case 1:
+      if (rename(path[cur], path[!cur]) < 0)
+        fail(w, "rename", path[cur]);
+      cur = !cur;
+      break;
+    }
+    close(fd);
+    w->ops++;
+  }
+  unlink(path[cur]);
+  free(buf);
+  free(check);
+  return NULL;
+}
+
+// reads chunks of the shared file, which never gets shorter
+static void *reader(void *arg) {
+  worker *w = arg;
+  char path[256], *buf = malloc(CHUNK);
+  snprintf(path, sizeof(path), "%s/%s", mount_point, SHARED);
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    fail(w, "open", path);
+  while (!stop && fd >= 0) {
+    off_t off = rand_r(&w->seed) % (MAX_SIZE / CHUNK) * CHUNK;
+    if (pread(fd, buf, CHUNK, off) != CHUNK) {
+      fail(w, "read", path);
+      break;
+    }
+    w->bytes += CHUNK;
+    w->ops++;
+  }
+  if (fd >= 0)
+    close(fd);
+  free(buf);
+  return NULL;
+}
+
+// keeps rewriting the chunks of the shared file under the readers
+static void *rewriter(void *arg) {
+  worker *w = arg;
+  char path[256], *buf = malloc(CHUNK);
+  snprintf(path, sizeof(path), "%s/%s", mount_point, SHARED);
+  int fd = open(path, O_WRONLY);
+  if (fd < 0)
+    fail(w, "open", path);
+  while (!stop && fd >= 0) {
+    off_t off = rand_r(&w->seed) % (MAX_SIZE / CHUNK) * CHUNK;
+    memset(buf, 'A' + rand_r(&w->seed) % 26, CHUNK);
+    if (pwrite(fd, buf, CHUNK, off) != CHUNK) {
+      fail(w, "write", path);
+      break;
+    }
+    w->bytes += CHUNK;
+    w->ops++;
+  }
+  if (fd >= 0)
+    close(fd);
+  free(buf);
+  return NULL;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc > 1)
+    mount_point = argv[1];
+  int nthreads = argc > 2 ? atoi(argv[2]) : 4;
+  int seconds = argc > 3 ? atoi(argv[3]) : 5;
+  if (nthreads < 1 || seconds < 1) {
+    printf("usage: %s [mount point] [threads] [seconds]\n", argv[0]);
+    return 1;
+  }
+
+  // the shared file starts out with all its chunks, so reads are full
+  char path[256], buf[CHUNK];
+  snprintf(path, sizeof(path), "%s/%s", mount_point, SHARED);
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror(path);
+    return 1;
+  }
+  memset(buf, 'A', CHUNK);
+  for (int i = 0; i < MAX_SIZE / CHUNK; i++)
+    if (write(fd, buf, CHUNK) != CHUNK) {
+      perror(path);
+      return 1;
+    }
+  close(fd);
+
+  // as many writers as readers, plus the one rewriting the shared file
+  int n = 2 * nthreads + 1;
+  pthread_t *threads = malloc(n * sizeof(pthread_t));
+  worker *workers = calloc(n, sizeof(worker));
+  double start = now();
+  for (int i = 0; i < n; i++) {
+    workers[i].id = i;
+    workers[i].seed = i + 1;
+    void *(*run)(void *) = i == 0 ? rewriter : i % 2 ? writer : reader;
+    pthread_create(&threads[i], NULL, run, &workers[i]);
+  }
+  sleep(seconds);
+  stop = 1;
+  long ops[2] = {0, 0}, bytes[2] = {0, 0};
+  for (int i = 0; i < n; i++) {
+    pthread_join(threads[i], NULL);
+    int writing = i == 0 || i % 2;
+    ops[writing] += workers[i].ops;
+    bytes[writing] += workers[i].bytes;
+  }
+  double secs = now() - start;
+  unlink(path);
+
+  printf("%d writers, %d readers, %.1f s\n", nthreads, nthreads, secs);
+  printf("writers: %9.0f ops/s %8.1f MiB/s\n", ops[1] / secs,
+         bytes[1] / secs / 1048576);
+  printf("readers: %9.0f ops/s %8.1f MiB/s\n", ops[0] / secs,
+         bytes[0] / secs / 1048576);
+  printf("%d failures\n", failures);
+  free(threads);
+  free(workers);
+  return failures != 0;
+}
@@ -0,0 +1,108 @@
+#include "trace.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+const char *trace_op_names[TRACE_NOPS] = {
+    "lookup", "forget", "getattr", "readdir", "read",  "write",
+    "fsync",  "statfs", "setattr", "rename",  "unlink", "rmdir",
+    "mkdir",  "create", "open",    "release", "falloc",
+};
+
+// The events of a thread. Only the thread writes to it, head is read by
+// trace_close once the threads are done. The rings stay for as long as the
+// process, a thread keeps using its ring after a trace_close.
+typedef struct trace_ring {
+  trace_event events[TRACE_EVENTS];
+  uint64_t head; // events recorded, the next goes in events[head % size]
+  uint16_t thread;
+  struct trace_ring *next;
+} trace_ring;
+
+#ifndef SSFS_NO_TRACE
+int trace_on;
+#endif
+
+// the rings of all threads, rings_lock is only taken when a thread records
+// its first event
+static __thread trace_ring *ring;
+static trace_ring *rings;
+static uint16_t nrings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *trace_file;
+
+int trace_open(const char *path) {
+#ifdef SSFS_NO_TRACE
+  fprintf(stderr, "ssfs is built without tracing\n");
+  return -1;
+#else
+  trace_file = fopen(path, "w");
+  if (trace_file == NULL)
+    return -1;
+  trace_on = 1;
+  return 0;
+#endif
+}
+
+// gives the thread its ring
+static trace_ring *new_ring() {
+  trace_ring *r = malloc(sizeof(trace_ring));
+  if (r == NULL)
+    return NULL;
+  r->head = 0;
+  pthread_mutex_lock(&rings_lock);
+  r->thread = nrings++;
+  r->next = rings;
+  rings = r;
+  pthread_mutex_unlock(&rings_lock);
+  return r;
+}
+
+void trace_record(int op, uint64_t ino, int64_t offset, uint32_t size,
+                  int result, uint64_t start, uint64_t latency) {
+  trace_ring *r = ring;
+  if (r == NULL && (r = ring = new_ring()) == NULL)
+    return;
+  trace_event *e = &r->events[r->head & (TRACE_EVENTS - 1)];
+  e->start = start;
+  e->ino = ino;
+  e->offset = offset;
+  e->size = size;
+  e->latency = latency > UINT32_MAX ? UINT32_MAX : latency;
+  e->result = result;
+  e->op = op;
+  e->thread = r->thread;
+  __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+int trace_close() {
+  if (trace_file == NULL)
+    return 0;
+#ifndef SSFS_NO_TRACE
+  trace_on = 0;
+#endif
+  pthread_mutex_lock(&rings_lock);
+  trace_header h = {TRACE_MAGIC, TRACE_VERSION, sizeof(trace_event), nrings};
+  int res = fwrite(&h, sizeof(h), 1, trace_file) == 1 ? 0 : -1;
+  for (trace_ring *r = rings; r != NULL; r = r->next) {
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    uint64_t first = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+    trace_ring_header rh = {r->thread, head - first, first};
+    if (fwrite(&rh, sizeof(rh), 1, trace_file) != 1)
+      res = -1;
+    // oldest first: from where the ring wraps to the end, then the start
+    unsigned int at = first & (TRACE_EVENTS - 1);
+    unsigned int n = head - first;
+    unsigned int tail = n < TRACE_EVENTS - at ? n : TRACE_EVENTS - at;
+    if (fwrite(&r->events[at], sizeof(trace_event), tail, trace_file) != tail ||
+        fwrite(r->events, sizeof(trace_event), n - tail, trace_file) !=
+            n - tail)
+      res = -1;
+    r->head = 0;
+  }
+  pthread_mutex_unlock(&rings_lock);
+  if (fclose(trace_file) != 0)
+    res = -1;
+  trace_file = NULL;
+  return res;
+}
@@ -0,0 +1,90 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+
+// Tracing of the operations of ssfs. Each operation is recorded as a binary
+// event (what it was, the inode, offset and size, the result and how long
+// it took) in a ring buffer of the thread serving it, so recording takes no
+// lock and does no I/O. The rings are written to a file when the file
+// system is unmounted, for trace_decode to read. Only the last TRACE_EVENTS
+// events of each thread are kept.
+//
+// Tracing is off unless ssfs is started with SSFS_TRACE=[trace file], and
+// then costs a test of trace_on per operation. Built with -DSSFS_NO_TRACE,
+// it is not even that.
+#define TRACE_MAGIC 0x52545353 // "SSTR"
+#define TRACE_VERSION 1
+#define TRACE_EVENTS (1 << 16)
+
+// the operations, the requests of the kernel
+enum {
+  TRACE_LOOKUP,
+  TRACE_FORGET,
+  TRACE_GETATTR,
+  TRACE_READDIR,
+  TRACE_READ,
+  TRACE_WRITE,
+  TRACE_FSYNC,
+  TRACE_STATFS,
+  TRACE_SETATTR,
+  TRACE_RENAME,
+  TRACE_UNLINK,
+  TRACE_RMDIR,
+  TRACE_MKDIR,
+  TRACE_CREATE,
+  TRACE_OPEN,
+  TRACE_RELEASE,
+  TRACE_FALLOCATE,
+  TRACE_NOPS
+};
+extern const char *trace_op_names[TRACE_NOPS];
+
+typedef struct {
+  uint64_t start;   // when it started, in ns (CLOCK_MONOTONIC)
+  uint64_t ino;     // the inode (or the parent directory, for a name)
+  int64_t offset;   // in the file or directory
+  uint32_t size;    // bytes asked for
+  uint32_t latency; // ns until the reply, at most 4 s
+  int32_t result;   // bytes read or listed, or written, the inode looked
+                    // up or made, or 0. -errno if it failed.
+  uint16_t op;      // TRACE_*
+  uint16_t thread;  // the ring it is from
+} trace_event;
+
+// The trace file: a trace_header, then for each ring a trace_ring_header
+// followed by its events, the oldest first.
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t event_size; // sizeof(trace_event)
+  uint32_t nrings;
+} trace_header;
+
+typedef struct {
+  uint32_t thread;
+  uint32_t count;   // events that follow
+  uint64_t dropped; // older events the ring had no room for
+} trace_ring_header;
+
+// Starting and stopping: trace_open turns tracing on, trace_close writes
+// the rings to the trace file and turns it off.
+int trace_open(const char *path);
+int trace_close();
+
+// Recording an operation once it is replied to, with when it started and
+// how long it took (timed with stats_clock, it is counted in the stats too)
+void trace_record(int op, uint64_t ino, int64_t offset, uint32_t size,
+                  int result, uint64_t start, uint64_t latency);
+#ifdef SSFS_NO_TRACE
+#define trace_on 0
+#else
+extern int trace_on;
+#endif
+#define trace_op(op, ino, offset, size, result, start, latency)                \
+  do {                                                                         \
+    if (trace_on)                                                              \
+      trace_record(op, ino, offset, size, result, start, latency);             \
+  } while (0)
+
+#endif // __TRACE_H__
@@ -0,0 +1,131 @@
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Reads a trace written by ssfs (started with SSFS_TRACE=[trace file]) and
+// prints its events in the order they started, with the time since the
+// first one, then for each operation how many there were and how long they
+// took. With -s only the summary is printed.
+// Usage: trace_decode [-s] [trace file]
+
+static int by_start(const void *a, const void *b) {
+  const trace_event *x = a, *y = b;
+  return x->start < y->start ? -1 : x->start > y->start;
+}
+
+static int by_latency(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// reads the events of all rings into one array, returns the count or -1
+static long load(FILE *f, trace_event **events, uint64_t *dropped) {
+  trace_header h;
+  if (fread(&h, sizeof(h), 1, f) != 1 || h.magic != TRACE_MAGIC) {
+    printf("not a trace\n");
+    return -1;
+  }
+  if (h.version != TRACE_VERSION || h.event_size != sizeof(trace_event)) {
+    printf("trace version %u, this reads %u\n", h.version, TRACE_VERSION);
+    return -1;
+  }
+  long count = 0;
+  *events = NULL;
+  *dropped = 0;
+  for (uint32_t i = 0; i < h.nrings; i++) {
+    trace_ring_header rh;
+    if (fread(&rh, sizeof(rh), 1, f) != 1)
+      goto short_trace;
+    trace_event *more = realloc(*events, (count + rh.count) * sizeof(**events));
+    if (more == NULL && count + rh.count > 0) {
+      printf("out of memory\n");
+      return -1;
+    }
+    *events = more;
+    if (fread(*events + count, sizeof(**events), rh.count, f) != rh.count)
+      goto short_trace;
+    count += rh.count;
+    *dropped += rh.dropped;
+  }
+  return count;
+short_trace:
+  printf("the trace is cut short\n");
+  return -1;
+}
+
+static void print_events(trace_event *events, long count) {
+  for (long i = 0; i < count; i++) {
+    trace_event *e = &events[i];
+    printf("%12.3f us  t%-3u %-8s ino %-8lu off %-10ld size %-8u -> %-6d "
+           "%9.3f us\n",
+           (e->start - events[0].start) / 1e3, e->thread,
+           e->op < TRACE_NOPS ? trace_op_names[e->op] : "?",
+           (unsigned long)e->ino, (long)e->offset, e->size, e->result,
+           e->latency / 1e3);
+  }
+}
+
+static void print_summary(trace_event *events, long count) {
+  uint32_t *latencies = malloc(count * sizeof(uint32_t) + 1);
+  printf("%-8s %10s %8s %12s %12s %12s %12s\n", "op", "count", "errors",
+         "mean us", "p50 us", "p99 us", "max us");
+  for (int op = 0; op < TRACE_NOPS; op++) {
+    long n = 0, errors = 0;
+    double total = 0;
+    for (long i = 0; i < count; i++) {
+      if (events[i].op != op)
+        continue;
+      latencies[n++] = events[i].latency;
+      total += events[i].latency;
+      if (events[i].result < 0)
+        errors++;
+    }
+    if (n == 0)
+      continue;
+    qsort(latencies, n, sizeof(uint32_t), by_latency);
+    printf("%-8s %10ld %8ld %12.3f %12.3f %12.3f %12.3f\n",
+           trace_op_names[op], n, errors, total / n / 1e3,
+           latencies[n / 2] / 1e3, latencies[n * 99 / 100] / 1e3,
+           latencies[n - 1] / 1e3);
+  }
+  free(latencies);
+}
+
+int main(int argc, char *argv[]) {
+  int summary_only = 0;
+  const char *path = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-s"))
+      summary_only = 1;
+    else if (path == NULL)
+      path = argv[i];
+    else
+      path = "";
+  }
+  if (path == NULL || !*path) {
+    printf("usage: %s [-s] [trace file]\n", argv[0]);
+    return 1;
+  }
+
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    perror(path);
+    return 1;
+  }
+  trace_event *events;
+  uint64_t dropped;
+  long count = load(f, &events, &dropped);
+  fclose(f);
+  if (count < 0)
+    return 1;
+
+  qsort(events, count, sizeof(trace_event), by_start);
+  if (!summary_only)
+    print_events(events, count);
+  if (dropped > 0)
+    printf("%lu older events were overwritten\n", (unsigned long)dropped);
+  print_summary(events, count);
+  free(events);
+  return 0;
+}
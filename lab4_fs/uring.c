@@ -0,0 +1,152 @@
+#include "uring.h"
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// the kernel and this process share the ring indexes, so they are read and
+// published with acquire/release ordering
+#define load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+struct uring {
+  int fd;
+  // submission ring
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned sqe_tail;    // next entry to hand out
+  unsigned sqe_entries; // size of the submission ring
+  // completion ring
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  // mappings, to unmap on exit
+  void *sq_ptr, *cq_ptr;
+  size_t sq_size, cq_size, sqes_size;
+};
+
+uring *uringInit(unsigned entries) {
+  struct io_uring_params p;
+  uring *r = calloc(1, sizeof(uring));
+  if (!r)
+    return NULL;
+  memset(&p, 0, sizeof(p));
+  r->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (r->fd < 0) {
+    free(r);
+    return NULL;
+  }
+
+  r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+  r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sq_ptr == MAP_FAILED || r->cq_ptr == MAP_FAILED ||
+      r->sqes == MAP_FAILED) {
+    uringExit(r);
+    return NULL;
+  }
+
+  char *sq = r->sq_ptr, *cq = r->cq_ptr;
+  r->sq_head = (unsigned *)(sq + p.sq_off.head);
+  r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)(sq + p.sq_off.array);
+  r->sqe_entries = p.sq_entries;
+  r->sqe_tail = *r->sq_tail;
+  r->cq_head = (unsigned *)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return r;
+}
+
+// returns the next free submission entry, cleared, or NULL if the ring is
+// full
+static struct io_uring_sqe *next_sqe(uring *r) {
+  if (r->sqe_tail - load_acquire(r->sq_head) >= r->sqe_entries)
+    return NULL;
+  unsigned idx = r->sqe_tail & *r->sq_mask;
+  struct io_uring_sqe *sqe = &r->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  r->sq_array[idx] = idx;
+  r->sqe_tail++;
+  return sqe;
+}
+
+int uringQueue(uring *r, int write, int fd, struct iovec *iov, int iovcnt,
+               off_t off, void *user_data) {
+  struct io_uring_sqe *sqe = next_sqe(r);
+  if (!sqe)
+    return -1;
+  sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+  sqe->fd = fd;
+  sqe->off = off;
+  sqe->addr = (uintptr_t)iov;
+  sqe->len = iovcnt;
+  sqe->user_data = (uintptr_t)user_data;
+  return 0;
+}
+
+int uringAdvise(uring *r, int fd, off_t off, off_t len, int advice,
+                void *user_data) {
+  struct io_uring_sqe *sqe = next_sqe(r);
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_FADVISE;
+  sqe->fd = fd;
+  sqe->off = off;
+  sqe->len = len;
+  sqe->fadvise_advice = advice;
+  sqe->user_data = (uintptr_t)user_data;
+  return 0;
+}
+
+int uringSubmit(uring *r, unsigned wait_nr) {
+  unsigned to_submit = r->sqe_tail - *r->sq_tail;
+  store_release(r->sq_tail, r->sqe_tail);
+  if (to_submit == 0 && wait_nr == 0)
+    return 0;
+  return syscall(__NR_io_uring_enter, r->fd, to_submit, wait_nr,
+                 wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+int uringUnqueue(uring *r, void **user_data) {
+  if (r->sqe_tail == load_acquire(r->sq_head))
+    return 0;
+  r->sqe_tail--;
+  // the kernel only takes entries up to the published tail
+  if ((int)(*r->sq_tail - r->sqe_tail) > 0)
+    store_release(r->sq_tail, r->sqe_tail);
+  *user_data = (void *)(uintptr_t)r->sqes[r->sqe_tail & *r->sq_mask].user_data;
+  return 1;
+}
+
+int uringReap(uring *r, void **user_data, int *res) {
+  unsigned head = *r->cq_head;
+  if (head == load_acquire(r->cq_tail))
+    return 0;
+  struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+  *user_data = (void *)(uintptr_t)cqe->user_data;
+  *res = cqe->res;
+  store_release(r->cq_head, head + 1);
+  return 1;
+}
+
+void uringExit(uring *r) {
+  if (r->sq_ptr && r->sq_ptr != MAP_FAILED)
+    munmap(r->sq_ptr, r->sq_size);
+  if (r->cq_ptr && r->cq_ptr != MAP_FAILED)
+    munmap(r->cq_ptr, r->cq_size);
+  if (r->sqes && r->sqes != MAP_FAILED)
+    munmap(r->sqes, r->sqes_size);
+  close(r->fd);
+  free(r);
+}
@@ -0,0 +1,43 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <sys/uio.h>
+
+/* A minimal io_uring wrapper talking to the kernel with the raw system
+   calls, so the disk does not depend on liburing. Used by rawdisk.c.
+   The kernel headers are kept out of here on purpose: linux/fs.h has its
+   own BLOCK_SIZE. */
+
+typedef struct uring uring;
+
+/* Sets up a ring with room for entries requests. Returns NULL if io_uring
+   is not available. */
+uring *uringInit(unsigned entries);
+
+/* Queues a vectored read (or write, if write is set) of the iovcnt buffers
+   of iov at byte offset off of fd. Returns -1 if the ring is full and needs
+   to be submitted. */
+int uringQueue(uring *r, int write, int fd, struct iovec *iov, int iovcnt,
+               off_t off, void *user_data);
+
+/* Queues a posix_fadvise of len bytes at byte offset off of fd. Returns -1
+   if the ring is full. */
+int uringAdvise(uring *r, int fd, off_t off, off_t len, int advice,
+                void *user_data);
+
+/* Sends the queued requests to the kernel, and waits for wait_nr
+   completions. Returns the number of requests submitted or -1. */
+int uringSubmit(uring *r, unsigned wait_nr);
+
+/* Takes back the newest request the kernel has not taken yet, if any, and
+   returns 1 with its user_data. Otherwise 0. Must not run at the same time
+   as uringSubmit. */
+int uringUnqueue(uring *r, void **user_data);
+
+/* Takes the oldest completion, if any, and returns 1. Otherwise 0. */
+int uringReap(uring *r, void **user_data, int *res);
+
+/* Tears down the ring. */
+void uringExit(uring *r);
+
+#endif // __URING_H__